@@ -1,25 +1,82 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-// Struct for an image, containing its dimensions and pixel data
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// Make "byte" mean "unsigned char"
+typedef unsigned char byte;
+
+// Two pixel buffers that a bitmap's ops ping-pong between: each op
+// writes its result into the buffer the bitmap isn't using and then
+// switches to it. The buffers only grow, so a chain of ops on a stream
+// of images no bigger than the first one allocates nothing after it.
+struct pixel_arena
+{
+    void *buffers[2];
+    long capacity[2];
+    int current;
+};
+
+// How a struct bitmap holds its pixels in memory:
+//   LAYOUT_INT    one int per pixel (0xRRGGBB) in pixels
+//   LAYOUT_BGR24  3 bytes per pixel (B, G, R, as in the file) in bgr,
+//                 rows top to bottom with no padding
+enum pixel_layout
+{
+    LAYOUT_INT,
+    LAYOUT_BGR24
+};
+
+// Struct for an image, containing its dimensions and pixel data. If
+// arena is set, the pixels belong to it instead of to the bitmap. In
+// lazy mode (bitmap_set_lazy), pending holds the geometric ops not yet
+// applied to the pixels, and width and height are still the pixels'.
+// With bitmap_track_dirty, dirty records which rows changed since the
+// bitmap was last saved.
 struct bitmap
 {
 	int width;
 	int height;
 	int *pixels;
+	int layout;
+	byte *bgr;
+	struct pixel_arena *arena;
+	struct pipeline_pass *pending;
+	struct dirty_rows *dirty;
+};
+
+// A rectangle of an image: x and y are its top left pixel, with y
+// counted from the top
+struct rect
+{
+    int x;
+    int y;
+    int width;
+    int height;
 };
 
 const int DIB_HEADER_SIZE = 14;
 const int BMP_HEADER_SIZE = 40;
 
-// Make "byte" mean "unsigned char"
-typedef unsigned char byte;
-
 // Calculates the stride of a .bmp file.
 // (The stride is how many bytes of memory a single row of
 // the image requires.)
@@ -33,6 +90,12 @@ inline int bmp_file_size(struct bitmap *bmp);
 // so that we can access its contents through pointers.
 void *map_file_for_reading(char *filename);
 
+// Maps a bitmap file for reading, sets *size to the length mapped,
+// and checks the headers against it (bmp_file_check). Returns NULL,
+// having printed why, if the file can't be mapped or isn't a whole
+// bitmap.
+void *map_bitmap_for_reading(char *filename, long *size);
+
 // Opens (and creates if necessary) the file with the given name
 // and maps it into memory so that we can access its contents
 // through pointers. 
@@ -44,19 +107,239 @@ void *map_file_for_writing(char *filename, int file_size);
 // valid.
 int read_bitmap(void *bmp_file, struct bitmap *bmp);
 
+// Same as read_bitmap, but stores the pixels in the given layout
+int read_bitmap_layout(void *bmp_file, struct bitmap *bmp, int layout);
+
+// Same as read_bitmap_layout, but the pixels and the results of every
+// op on bmp live in arena's buffers
+int read_bitmap_arena(void *bmp_file, struct bitmap *bmp, int layout, struct pixel_arena *arena);
+
+// Same as read_bitmap_arena (arena may be NULL), but only decodes the
+// window r of the image, which must lie inside it: only r's rows of
+// the file are read, and only r's columns of those. A NULL r is the
+// whole image. Returns 0, or -1 if the file data isn't valid or r
+// isn't inside the image.
+int read_bitmap_rect(void *bmp_file, struct bitmap *bmp, int layout, struct pixel_arena *arena,
+                     const struct rect *r);
+
+// Checks the headers of a bitmap file and fills in the width and
+// height of bmp, without reading any pixels. Returns the offset of the
+// pixel data, or -1 if the file data isn't valid or isn't 24-bit with
+// its rows bottom to top (the form the modes that work on the file's
+// rows directly expect).
+int read_bitmap_header(void *bmp_file, struct bitmap *bmp);
+
 void write_bitmap(void *bmp_file, struct bitmap *bmp);
 
+// Writes just the headers of a bitmap file for bmp's dimensions.
+void write_bitmap_header(void *bmp_file, struct bitmap *bmp);
+
+// Pixel formats of .bmp files: 24-bit BGR, 32-bit BGRA (BI_RGB, or
+// BI_BITFIELDS with the same masks), 32-bit with other channel masks,
+// and 8-bit indices into a palette
+enum bmp_pixel_format
+{
+    BMP_BGR24,
+    BMP_BGRA32,
+    BMP_BITFIELDS32,
+    BMP_PAL8
+};
+
+// How the pixels of a .bmp file are laid out. top_down is set for rows
+// stored top to bottom (a negative height in the header). masks are
+// the red, green and blue bits of 32-bit pixels, and palette holds the
+// ncolors colors of 8-bit ones as packed pixels. When writing, the
+// palette_keys and palette_index hash table finds a color's index.
+struct bmp_format
+{
+    int format;
+    int top_down;
+    int offset;
+    int stride;
+    unsigned int masks[3];
+    int ncolors;
+    int palette[256];
+    int palette_keys[512];
+    byte palette_index[512];
+};
+
+// Checks the headers of any supported bitmap file and fills in the
+// width and (positive) height of bmp and how its pixels are laid out,
+// without reading any pixels. Returns 0 if everything worked, -1 if
+// the file data isn't valid or the format isn't supported.
+int read_bitmap_format(void *bmp_file, struct bitmap *bmp, struct bmp_format *fmt);
+
+// Checks that size bytes of a mapped file are a bitmap that
+// read_bitmap_format accepts, with at least one pixel and every row
+// inside those bytes, so that nothing reading it can run off the end
+// of the mapping. Returns 0 if so, -1 (having printed why) if not.
+int bmp_file_check(void *bmp_file, long size);
+
+// Sets fmt up for writing bmp in a pixel format, with its rows top to
+// bottom if top_down is set. An 8-bit palette is made of bmp's own
+// colors. Returns 0 on success, -1 if bmp has more than 256 colors for
+// BMP_PAL8.
+int bmp_format_for(struct bmp_format *fmt, const struct bitmap *bmp, int format, int top_down);
+
+// The size of a .bmp file holding bmp laid out as fmt
+int bmp_format_file_size(const struct bmp_format *fmt, const struct bitmap *bmp);
+
+// Checks that a width x height result fits a .bmp file, whose sizes
+// are ints: a row of 4-byte pixels and the whole file with the largest
+// header must stay under 2 GB. Returns 0 if so, -1 (having printed
+// why) if not.
+int bmp_size_check(long width, long height);
+
+// Writes bmp into the mapped file bmp_file, laid out as fmt
+void write_bitmap_format(void *bmp_file, struct bitmap *bmp, const struct bmp_format *fmt);
+
+// Converts a bitmap's pixels to another layout in place
+void bitmap_set_layout(struct bitmap *bmp, int layout);
+
+// Frees a bitmap's pixels, whatever their layout. Pixels in an arena
+// stay there for the next bitmap.
+void bitmap_free(struct bitmap *bmp);
+
+// Sets up an empty arena, and frees the buffers of one no longer needed
+void pixel_arena_init(struct pixel_arena *arena);
+void pixel_arena_release(struct pixel_arena *arena);
+
+// When a bmp_writer forces what it wrote to disk
+enum fsync_policy
+{
+    FSYNC_NONE,
+    FSYNC_END,
+    FSYNC_EACH
+};
+
+// A way of writing .bmp files other than map_file_for_writing(): the
+// header and rows are encoded into a reusable buffer that is flushed
+// with large pwrite() calls. With direct set, files are opened with
+// O_DIRECT (or normally, where the filesystem doesn't support it).
+// fsync_policy is FSYNC_NONE (leave it to the kernel), FSYNC_END (once
+// the file is complete) or FSYNC_EACH (after every flush).
+struct bmp_writer
+{
+    byte *buffer;
+    long capacity;
+    long used;
+    long offset;
+    int fd;
+    int direct;
+    int fsync_policy;
+};
+
+// Sets up a writer with a buffer of about buffer_size bytes, and frees
+// it when done
+void bmp_writer_init(struct bmp_writer *w, long buffer_size, int direct, int fsync_policy);
+void bmp_writer_release(struct bmp_writer *w);
+
+// Writes bmp to filename through w, laid out as fmt (NULL for 24-bit
+// rows bottom to top). Returns 0 on success, -1 on failure.
+int write_bitmap_file(struct bmp_writer *w, char *filename, struct bitmap *bmp, const struct bmp_format *fmt);
+
 
 // Converts between a packed pixel (0xRRGGBB) and its components.
 void rgb_to_pixel(int *p, int r, int g, int b);
 void pixel_to_rgb(int p, int *r, int *g, int *b);
 
+// Converts a row of n pixels between the 24-bit BGR bytes of a .bmp
+// file and packed pixels.
+void decode_row(const byte *src, int *dst, int n);
+void encode_row(const int *src, byte *dst, int n);
+
+// The same for the rows of a file in any of the BMP_ pixel formats
+void decode_format_row(const struct bmp_format *fmt, const byte *src, int *dst, int n);
+void encode_format_row(const struct bmp_format *fmt, const int *src, byte *dst, int n);
+
 //Grayscale
 void bitmap_to_grayscale(struct bitmap *bmp);
 
+// How a grayscale weighs the channels: their plain average (what
+// bitmap_to_grayscale does), or the luma of BT.601 or BT.709
+enum gray_mode
+{
+    GRAY_AVERAGE,
+    GRAY_BT601,
+    GRAY_BT709
+};
+
+void bitmap_to_grayscale_mode(struct bitmap *bmp, int mode);
+
 //Posterizing
 void bitmap_posterize(struct bitmap *bmp);
 
+// The channels of a pixel, in the order of their bytes in memory
+enum channel
+{
+    CHANNEL_BLUE,
+    CHANNEL_GREEN,
+    CHANNEL_RED
+};
+
+#define POSTERIZE_MAX_STEPS 15
+
+// A posterize compiled once and applied to any number of images.
+// lut[c][v] is the new value of byte v of channel c. When no channel's
+// table changes value more than POSTERIZE_MAX_STEPS times, nsteps is
+// the most changes of any channel and the vector kernels use the step
+// form instead: the output starts at value[0] and becomes value[s + 1]
+// wherever the input is at least at[s]. The int_ steps are packed like
+// a pixel and the bgr_ ones repeat for 16 pixels of LAYOUT_BGR24; a
+// channel with fewer steps repeats its last one. nsteps is -1 when only
+// the lookup tables can be used.
+//
+// Two cheaper forms are tried first. buckets is set when every channel
+// rounds to multiples of a power of two s, as the 2^k + 1 level counts
+// and bitmap_posterize do: bytes from top up become 255 (or keep their
+// value where saturate is 0, bitmap_posterize's blue quirk) and the
+// rest become (v + add) & mask. shared is set when all three channels
+// use one table, which nibbles then holds as 16 XOR-chained rows of 16
+// entries for vpshufb lookups.
+struct posterize_table
+{
+    byte lut[3][256];
+    int buckets;
+    int int_top, int_add, int_mask, int_saturate;
+    byte bgr_top[48], bgr_add[48], bgr_mask[48], bgr_saturate[48];
+    int shared;
+    byte nibbles[16][16];
+    int nsteps;
+    int int_at[POSTERIZE_MAX_STEPS];
+    int int_value[POSTERIZE_MAX_STEPS + 1];
+    byte bgr_at[POSTERIZE_MAX_STEPS][48];
+    byte bgr_value[POSTERIZE_MAX_STEPS + 1][48];
+};
+
+// Sets up a posterize to the given number of evenly spaced levels per
+// channel (2 to 256), each byte going to the nearest one. 5 levels are
+// the buckets of bitmap_posterize, without its quirk of leaving blue
+// values from 224 to 254 alone, and 256 changes nothing. Returns 0 on
+// success, -1 if a level count is out of range.
+int posterize_table_levels(struct posterize_table *t, int red, int green, int blue);
+
+// Replaces one channel of a posterize with n levels: bytes below
+// thresholds[0] become values[0], and bytes from thresholds[i - 1] up
+// become values[i]. The n - 1 thresholds must increase; values may be
+// NULL for evenly spaced ones. Returns 0 on success, -1 if invalid.
+int posterize_table_thresholds(struct posterize_table *t, int channel, int n,
+                               const int *thresholds, const int *values);
+
+// Posterizes a bitmap with a compiled table
+void bitmap_posterize_table(struct bitmap *bmp, const struct posterize_table *t);
+
+// The per-pixel ops on just the rectangle r of a bitmap, leaving the
+// rows and columns outside it alone. A lazy bitmap is materialized
+// first, since r is where the pixels end up. Return 0, or -1 if r
+// isn't inside the bitmap.
+int bitmap_to_grayscale_rect(struct bitmap *bmp, const struct rect *r);
+int bitmap_posterize_rect(struct bitmap *bmp, const struct rect *r);
+int bitmap_posterize_table_rect(struct bitmap *bmp, const struct posterize_table *t, const struct rect *r);
+
+// Replaces a bitmap with its rectangle r. Returns 0, or -1 if r isn't
+// inside the bitmap.
+int bitmap_crop(struct bitmap *bmp, const struct rect *r);
+
 //Mirroring
 void bitmap_mirror(struct bitmap *bmp);
 
@@ -69,12 +352,460 @@ void bitmap_reflect(struct bitmap *bmp);
 //Rotating
 void bitmap_rotate(struct bitmap *bmp);
 
+// Rotations by 90, 180 and 270 degrees clockwise. (bitmap_rotate
+// transposes the image, i.e. rotates and then reflects it.)
+void bitmap_rotate_90(struct bitmap *bmp);
+void bitmap_rotate_180(struct bitmap *bmp);
+void bitmap_rotate_270(struct bitmap *bmp);
+
 //Skewing
 void bitmap_skew(struct bitmap *bmp);
 
 //Shrinking
 void bitmap_shrink(struct bitmap *bmp);
 
+// Averages each fx x fy block of pixels into one, dropping the columns
+// and rows left over at the right and bottom edges. bitmap_squash is
+// bitmap_downsample(bmp, 2, 1) and bitmap_shrink is (bmp, 2, 2).
+void bitmap_downsample(struct bitmap *bmp, int fx, int fy);
+
+// Filters for bitmap_resize
+enum resize_filter
+{
+    FILTER_BOX,
+    FILTER_BILINEAR,
+    FILTER_LANCZOS
+};
+
+// Resizes a bitmap to new_width x new_height with a box, bilinear or
+// Lanczos (3 lobes) filter, widened when shrinking so every source
+// pixel counts. Rows are filtered horizontally and then vertically
+// with precomputed 14-bit fixed-point weights. A box resize to
+// width / k x height / l for whole k and l goes through
+// bitmap_downsample and matches it exactly. Returns 0 on success, -1
+// if a size is not positive or too big for a .bmp file.
+int bitmap_resize(struct bitmap *bmp, int new_width, int new_height, int filter);
+
+// Replaces a bitmap with its rectangle r resized to new_width x
+// new_height, reading only r's pixels. A box filter by whole factors
+// of r's size averages blocks as bitmap_downsample does, so squashing
+// or shrinking just r is a box resize to half its width, or to half
+// both ways. Returns 0, or -1 if r isn't inside the bitmap or a size is
+// not positive or too big for a .bmp file.
+int bitmap_resize_rect(struct bitmap *bmp, const struct rect *r, int new_width, int new_height, int filter);
+
+#define MAX_MIP_LEVELS 32
+
+// Builds the mip chain of a bitmap: levels[0] is bitmap_shrink of bmp,
+// levels[1] is bitmap_shrink of levels[0], and so on, stopping after
+// max_levels or before a level with no pixels. Each level row is made
+// as soon as the two rows above it are, while they are still in cache,
+// so the chain costs one pass over bmp. Returns the number of levels
+// (free each with bitmap_free).
+int bitmap_mip_chain(struct bitmap *bmp, struct bitmap *levels, int max_levels);
+
+// The same straight from the mapped BMP file bmp_file into one BMP
+// file per level, out_prefix-1.bmp, out_prefix-2.bmp and so on. Rows
+// are read from the input mapping and written into the output
+// mappings, without decoding the image (unless it isn't 24-bit, when it
+// is decoded to 24-bit rows first). Returns the number of levels
+// written, or -1 on failure.
+int write_mip_chain(void *bmp_file, const char *out_prefix, int max_levels);
+
+// A 2D affine map of pixel coordinates, with y going down:
+// x' = a * x + b * y + c and y' = d * x + e * y + f.
+struct affine
+{
+    double a, b, c;
+    double d, e, f;
+};
+
+// Sampling of bitmap_affine and bitmap_warp
+enum sample_mode
+{
+    SAMPLE_NEAREST,
+    SAMPLE_BILINEAR
+};
+
+// Builders for affine maps. Each one composes a step after what m
+// already does: a clockwise rotation by any angle, a shear (x moves by
+// sx * y and y by sy * x) or a scale, all about the origin.
+void affine_identity(struct affine *m);
+void affine_rotate(struct affine *m, double degrees);
+void affine_shear(struct affine *m, double sx, double sy);
+void affine_scale(struct affine *m, double sx, double sy);
+
+// Sets inverse to the inverse of m. Returns 0 on success, -1 if m is
+// singular.
+int affine_invert(const struct affine *m, struct affine *inverse);
+
+// Resamples a bitmap to new_width x new_height: the output pixel
+// centred at (x + 0.5, y + 0.5) takes the source at inverse(x + 0.5,
+// y + 0.5), or black if that falls outside the source. Source
+// coordinates are stepped in 16.16 fixed point along each row of a
+// tile instead of being multiplied out per pixel, and the output is
+// made in square tiles so rotations walk the source cache-friendly
+// blocks at a time. Returns 0 on success, -1 if a size is not positive
+// or too big for a .bmp file.
+int bitmap_affine(struct bitmap *bmp, const struct affine *inverse, int new_width,
+                  int new_height, int sample);
+
+// Applies the linear part of forward (a, b, d and e) about the centre
+// of a bitmap, on a canvas grown or shrunk to just fit the result.
+// Returns 0 on success, -1 if forward is singular or the canvas would
+// be too big for a .bmp file.
+int bitmap_warp(struct bitmap *bmp, const struct affine *forward, int sample);
+
+// malloc() and calloc() for image-sized buffers. They are counted per
+// stage when tracing is on. They never return NULL: running out of
+// memory prints an error and exits with status 1.
+void *bitmap_malloc(size_t size);
+void *bitmap_calloc(size_t n, size_t size);
+
+// Opt-in tracing of where the time goes. Turned on by --trace FILE or
+// the PROJECT2_TRACE=FILE environment variable. trace_begin() starts a
+// stage and returns a handle for trace_end(), which records its wall
+// time, the bytes it touched and the bitmap_malloc() calls made in
+// between. At exit a summary table goes to stderr and FILE gets a
+// Chrome trace-event JSON (load it in chrome://tracing or Perfetto).
+void trace_enable(const char *json_path);
+int trace_begin(const char *name);
+void trace_end(int event, long bytes);
+
+// Sets how many threads the bitmap operations split their rows
+// across (1, the default, runs everything on the calling thread).
+void set_thread_count(int n);
+
+// Calls fn(ctx, y0, y1) on ranges of rows covering [0, nrows), spread
+// over the worker threads. Each row is handled exactly once, so as
+// long as fn only writes the rows it is given the result does not
+// depend on the number of threads.
+void parallel_rows(int nrows, void (*fn)(void *ctx, int y0, int y1), void *ctx);
+
+// Instruction sets the per-pixel kernels can use. The best one the CPU
+// supports is picked at run time; PROJECT2_SIMD=scalar|sse2|ssse3|avx2
+// forces a specific one (e.g. to compare results). ssse3 is SIMD_SSE2
+// plus the byte-shuffle kernels, which plain sse2 leaves out.
+enum simd_level
+{
+    SIMD_SCALAR,
+    SIMD_SSE2,
+    SIMD_AVX2
+};
+
+// Returns the instruction set the kernels are using.
+int simd_level(void);
+
+// Operations understood by the headless pipeline. Each one has the
+// same letter as in the interactive menu.
+enum op_kind
+{
+    OP_GRAYSCALE,
+    OP_POSTERIZE,
+    OP_SQUASH,
+    OP_MIRROR,
+    OP_REFLECT,
+    OP_ROTATE,
+    OP_SKEW,
+    OP_SHRINK,
+    // Grayscales by luma, which have no letter of their own ('g' is
+    // made into one of them by pipeline_set_grayscale)
+    OP_GRAYSCALE_BT601,
+    OP_GRAYSCALE_BT709
+};
+
+// Kinds of geometric remap. An orientation is any mix of a transpose
+// and horizontal/vertical flips (reflect, rotate and their
+// compositions).
+enum remap_kind
+{
+    REMAP_ORIENT,
+    REMAP_MIRROR,
+    REMAP_SKEW
+};
+
+// Bits of an orientation code. The transpose is applied first, then
+// the flips, when mapping an output pixel back to its source.
+#define ORIENT_TRANSPOSE 4
+#define ORIENT_FLIP_X 1
+#define ORIENT_FLIP_Y 2
+
+// Applies an orientation (see the ORIENT_ bits) to a bitmap, working
+// in square tiles so that transposes don't miss the cache on every
+// store.
+void bitmap_orient(struct bitmap *bmp, int orient);
+
+// Lazy mode: while it is on, mirror, reflect, the rotations, skew and
+// bitmap_orient only add a remap to bmp->pending, composing
+// orientations as they go, so reflecting twice or rotating four times
+// leaves nothing to do. Per-pixel ops run on the pixels as they are.
+// Saving, and every op that needs the pixels in place (squash, shrink,
+// resize, warps, mip chains, pipelines), first calls
+// bitmap_materialize(). Turning lazy mode off materializes too.
+void bitmap_set_lazy(struct bitmap *bmp, int lazy);
+
+// Applies the pending remaps of a lazy bitmap. Runs of orientations
+// have composed into one tiled pass by then, and are gone if they
+// cancelled out; a mirror or skew still takes a pass of its own.
+void bitmap_materialize(struct bitmap *bmp);
+
+// Side of the square tiles the undo history keeps pixels in
+#define HISTORY_TILE 64
+
+struct history_tile;
+
+// One state of an image in the history: its size, layout and pending
+// remaps, and its pixels as tiles, row by row of tiles
+struct history_state
+{
+    int width;
+    int height;
+    int layout;
+    struct pipeline_pass *pending;
+    struct history_tile **tiles;
+};
+
+// Undo history for the interactive editor. States share tiles:
+// recording a state only copies the tiles that differ from the state
+// before it, so an op that changes part of an image only costs that
+// part, and a lazy remap (which leaves the pixels alone) almost
+// nothing. bytes is what all the tiles take, and the oldest states are
+// forgotten to keep it under budget (though the newest one is always
+// kept).
+struct history
+{
+    struct history_state *states;
+    int nstates;
+    int capacity;
+    int current;
+    long budget;
+    long bytes;
+};
+
+void history_init(struct history *h, long budget);
+void history_release(struct history *h);
+
+// Records bmp as the state after the current one, dropping the states
+// that could have been redone
+void history_push(struct history *h, struct bitmap *bmp);
+
+// Puts the state before (or after) the current one back into bmp.
+// Returns 0 on success, -1 if there is nothing to undo (or redo).
+int history_undo(struct history *h, struct bitmap *bmp);
+int history_redo(struct history *h, struct bitmap *bmp);
+
+// Starts tracking which rows of bmp change, with bmp taken to be what
+// was just written to the 24-bit file filename and every row clean.
+// Ops mark the rows they write: a per-pixel op every row, an op that
+// moves pixels or resizes the whole image, an undo or redo only the
+// rows it changes.
+void bitmap_track_dirty(struct bitmap *bmp, const char *filename);
+
+// Marks rows y0 to y1 - 1 of a tracked bitmap as changed
+void bitmap_mark_dirty(struct bitmap *bmp, int y0, int y1);
+
+// Saves a tracked bitmap by rewriting only its changed rows in place,
+// if filename is still the file it was tracked against, unchanged
+// since and of the same size. Returns the number of rows written, or
+// -1 if the whole file has to be written instead (then call
+// bitmap_track_dirty() again afterwards).
+int write_bitmap_dirty(struct bitmap *bmp, char *filename);
+
+// The index of luma in the channels of an image_stats, after those of
+// enum channel
+#define STATS_LUMA 3
+
+// Statistics of an image's pixels: a histogram of each channel's
+// values and of their BT.601 luma (what bitmap_to_grayscale_mode gives
+// for GRAY_BT601), and the smallest, largest and mean value of each
+struct image_stats
+{
+    int width;
+    int height;
+    long pixels;
+    long histogram[4][256];
+    int min[4];
+    int max[4];
+    double mean[4];
+};
+
+// Works out the statistics of a bitmap in one pass over its rows,
+// spread over the threads. Each range of rows counts into private bins
+// that are added up at the end. A lazy bitmap is materialized first.
+void bitmap_stats(struct bitmap *bmp, struct image_stats *st);
+
+// The same straight from the rows of the mapped BMP file bmp_file, of
+// the window r, or the whole image if r is NULL, without decoding it
+// into a bitmap. Returns 0, or -1 if the file data isn't valid or r
+// isn't inside the image.
+int bmp_file_stats(void *bmp_file, const struct rect *r, struct image_stats *st);
+
+// Prints statistics as JSON
+void image_stats_print_json(const struct image_stats *st);
+
+// Sets up a posterize that stretches each channel's values to 0 to 255
+// (256 levels, so nothing is lost but contrast), ignoring the darkest
+// and brightest clip fraction of the pixels of st
+void posterize_table_auto_levels(struct posterize_table *t, const struct image_stats *st, double clip);
+
+// Sets up a posterize to n levels per channel whose thresholds give
+// each level about the same share of the pixels of st, each going to
+// the mean of its pixels. Returns 0, or -1 if n isn't from 2 to 256.
+int posterize_table_auto(struct posterize_table *t, const struct image_stats *st, int n);
+
+#define MAX_PIPELINE_OPS 32
+
+// One geometric step of a pipeline pass. in_width and in_height are
+// filled in when the pass runs, since they depend on the image.
+struct remap_stage
+{
+    int kind;
+    int orient;
+    int fill;
+    int fill_from;
+    int in_width;
+    int in_height;
+};
+
+// A single traversal of the image: an optional resample (OP_SQUASH or
+// OP_SHRINK, otherwise -1), then a composed chain of geometric remaps,
+// then a run of per-pixel ops applied to each output row. posterize is
+// the table OP_POSTERIZE uses, or NULL for the buckets of
+// bitmap_posterize.
+struct pipeline_pass
+{
+    int resample;
+    int nremaps;
+    struct remap_stage remaps[MAX_PIPELINE_OPS];
+    int npoint;
+    int point_ops[MAX_PIPELINE_OPS];
+    const struct posterize_table *posterize;
+};
+
+// A chain of operations planned once and reusable for any number of
+// images. If warp is set, the result then goes through
+// bitmap_warp(warp_forward, warp_sample), and if resize_width is set,
+// it is finally resized to resize_width x resize_height with
+// resize_filter.
+struct pipeline
+{
+    int npasses;
+    struct pipeline_pass passes[MAX_PIPELINE_OPS];
+    int warp;
+    struct affine warp_forward;
+    int warp_sample;
+    int resize_width;
+    int resize_height;
+    int resize_filter;
+};
+
+// Parses a comma separated list of menu letters (e.g. "g,p,h,o") into
+// a pipeline, fusing what can be fused. Returns 0 on success, -1 if
+// the list is invalid.
+int pipeline_plan(const char *ops, struct pipeline *pl);
+
+// Makes the posterizes of a planned pipeline use a compiled table
+// instead of the fixed buckets of bitmap_posterize (NULL goes back to
+// them). The table has to outlive the pipeline.
+void pipeline_set_posterize(struct pipeline *pl, const struct posterize_table *t);
+
+// Makes the grayscales of a planned pipeline use one of the gray_mode
+// weightings
+void pipeline_set_grayscale(struct pipeline *pl, int mode);
+
+// Makes a planned pipeline finish with bitmap_resize(). A pipeline
+// that resizes needs the whole image, so it is neither direct nor row
+// local.
+void pipeline_set_resize(struct pipeline *pl, int width, int height, int filter);
+
+// Makes a planned pipeline warp its result with bitmap_warp(), before
+// any resize. Like a resize, this needs the whole image.
+void pipeline_set_warp(struct pipeline *pl, const struct affine *forward, int sample);
+
+// Runs a planned pipeline on a bitmap. Returns 0 on success, -1 (having
+// printed why) if its warp or resize can't be done.
+int pipeline_run(const struct pipeline *pl, struct bitmap *bmp);
+
+// Returns 1 if a pipeline can run straight from one BMP file to
+// another (a single pass), 0 otherwise.
+int pipeline_is_direct(const struct pipeline *pl);
+
+// Runs a single-pass pipeline from the mapped BMP file bmp_file
+// straight into the 24-bit rows of out_filename. No struct bitmap is
+// ever decoded; each thread only needs a row of scratch space. The
+// input can be 24-bit or 32-bit BGRA, with its rows either way up.
+// Returns 0 on success, -1 on failure.
+int pipeline_run_direct(const struct pipeline *pl, void *bmp_file, char *out_filename);
+
+// The same on just the window r of the image in bmp_file, which must
+// lie inside it; the rest of the file isn't read
+int pipeline_run_direct_rect(const struct pipeline *pl, void *bmp_file, const struct rect *r, char *out_filename);
+
+// The same from an already decoded LAYOUT_INT bitmap, which is left as
+// it is, so a cached image can be transformed without being copied
+int pipeline_run_direct_bitmap(const struct pipeline *pl, const struct bitmap *bmp, char *out_filename);
+
+// Returns 1 if every op in a pipeline only looks at the rows it
+// produces (grayscale, posterize, mirror, reflect, squash) or at pairs
+// of rows (shrink), so it can be streamed in strips, 0 otherwise.
+int pipeline_is_row_local(const struct pipeline *pl);
+
+// Streams in_filename through a row-local pipeline into out_filename
+// in horizontal strips, with pread/pwrite instead of mapping the
+// files. The strip height is picked so that the buffers for one strip
+// fit in mem_budget bytes. Returns 0 on success, -1 on failure.
+int pipeline_run_streaming(const struct pipeline *pl, char *in_filename, char *out_filename, long mem_budget);
+
+// Benchmarks:
+//   project2 bench [--size WxH] [--iters N] [--threads N] [--json]
+// times every bitmap_* op plus read_bitmap/write_bitmap on a synthetic
+// image,
+//   project2 bench rotate [MP ...]
+// compares the tiled rotate with the untiled one, and
+//   project2 bench warp [--angle DEG]
+// times arbitrary-angle rotations with scalar and AVX2 gather kernels.
+int run_bench_cli(int argc, char *argv[]);
+
+// Self tests: project2 test [NAME ...] runs the checks named, or all of
+// them, printing ok or FAIL for each. Returns 1 if any failed.
+int run_test_cli(int argc, char *argv[]);
+
+// Headless mode: project2 in.bmp out.bmp --ops g,p,h,o
+int run_pipeline_cli(int argc, char *argv[]);
+
+// Mip mode: project2 --mips in.bmp out_prefix [--max-levels N]
+// writes every level of write_mip_chain().
+int run_mips_cli(int argc, char *argv[]);
+
+// Batch mode: project2 --batch <dir|list> outdir --ops g,p,h,o
+// runs the same chain on every .bmp of a directory (or every path
+// listed in a file, one per line), writing each result under outdir
+// with the same name. A reader thread, a pool of transform workers and
+// the writer overlap disk I/O with compute.
+int run_batch_cli(int argc, char *argv[]);
+
+// Stats mode: project2 --stats in.bmp [--crop WxH+X+Y] [--threads N]
+// prints the histograms, min, max and mean of each channel and of
+// luma as JSON, reading the file's rows without decoding the image.
+int run_stats_cli(int argc, char *argv[]);
+
+// Server mode: project2 --serve SOCKET [--cache SIZE] [--threads N]
+// listens on a Unix socket for one-line requests and answers each with
+// one line:
+//   apply OPS IN OUT [average|bt601|bt709]
+//                      runs a chain as the headless mode does, with g
+//                      in the given gray mode
+//   stats              hits, misses and latencies so far
+//   quit               stops the server
+// Decoded inputs stay in an LRU cache of at most SIZE bytes, keyed by
+// path, mtime and size, so editing the same file again skips the decode.
+int run_serve_cli(int argc, char *argv[]);
+
+// Client mode: project2 --client SOCKET apply g,h in.bmp out.bmp sends
+// one request to a server, with its paths made absolute, and prints
+// the reply.
+int run_client_cli(int argc, char *argv[]);
+
 /* Please note: if your program has a main() function, then
  * the test programs given to you will not run (your main()
  * will override the test program's). When running a test,
@@ -82,29 +813,93 @@ void bitmap_shrink(struct bitmap *bmp);
  * function!
  */
 
+// "64M" and the like to a number of bytes, with the option parsers
+// further down
+static long parse_size(const char *text);
+
 int main(int argc, char *argv[])
 {
+    char *trace_path = getenv("PROJECT2_TRACE");
+    if (trace_path != NULL && trace_path[0] != '\0')
+    {
+        trace_enable(trace_path);
+    }
+
     if (argc == 1)
     {
         printf("There is no image specified in the command line\n");
         return 1;
     }
-    else if (argc == 2)
+    else if (strcmp(argv[1], "bench") == 0)
+    {
+        return run_bench_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "test") == 0)
+    {
+        return run_test_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "--batch") == 0)
+    {
+        return run_batch_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "--mips") == 0)
+    {
+        return run_mips_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "--stats") == 0)
+    {
+        return run_stats_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "--serve") == 0)
+    {
+        return run_serve_cli(argc, argv);
+    }
+    else if (strcmp(argv[1], "--client") == 0)
+    {
+        return run_client_cli(argc, argv);
+    }
+    else if (argc == 2 || (argc == 4 && strcmp(argv[2], "--history") == 0))
     {
         char *filename = argv[1];
+        long history_budget = argc == 4 ? parse_size(argv[3]) : 256L << 20;
         char input[20];
 
-        int *pointer = map_file_for_reading(filename);
+        int ev = trace_begin("map_file_for_reading");
+        long file_size;
+        int *pointer = map_bitmap_for_reading(filename, &file_size);
+        trace_end(ev, 0);
+        if (pointer == NULL)
+        {
+            return 1;
+        }
+
+        // Every op of the session ping-pongs between the same two buffers
+        struct pixel_arena arena;
+        pixel_arena_init(&arena);
 
         struct bitmap t_bmp;
-        read_bitmap(pointer, &t_bmp);
-        long file_size = bmp_file_size(&t_bmp);
+        struct bmp_format fmt;
+        ev = trace_begin("read_bitmap");
+        read_bitmap_format(pointer, &t_bmp, &fmt);
+        read_bitmap_arena(pointer, &t_bmp, LAYOUT_INT, &arena);
+        trace_end(ev, file_size + (long) t_bmp.width * t_bmp.height * sizeof(int));
         munmap(pointer, file_size);
 
+        // Mirror, reflect, rotate and skew only pile up until a save
+        // or an op that needs the pixels in place
+        bitmap_set_lazy(&t_bmp, 1);
+
+        // Every state the image goes through, for undo and redo
+        struct history history;
+        history_init(&history, history_budget);
+        history_push(&history, &t_bmp);
+
         while (input[0] != 'q')
         {
             printf("Menu:\n");
             printf("\tG) Make grayscale\n");
+            printf("\tB) Make grayscale (BT.601 luma)\n");
+            printf("\tV) Make grayscale (BT.709 luma)\n");
             printf("\tP) Posterize\n");
             printf("\tU) Squash\n");
             printf("\tM) Mirror\n");
@@ -112,18 +907,30 @@ int main(int argc, char *argv[])
             printf("\tO) Rotate\n");
             printf("\tK) Skew\n");
             printf("\tH) Shrink\n");
+            printf("\tZ) Undo\n");
+            printf("\tY) Redo\n");
             printf("\tS) Save\n");
             printf("\tQ) Quit\n");
 
             printf("What would you like to do? ");
             scanf("%s", input);
 
+            long in_bytes = (long) t_bmp.width * t_bmp.height * sizeof(int);
+            // Saving reads the filename into input, so this is decided now
+            int changes = input[0] != '\0' && strchr("gbvpumrokh", input[0]) != NULL;
+            int op_ev = input[0] != 's' && input[0] != 'q' ? trace_begin("transform") : -1;
+
             if (input[0] == 'g')
             {
                 bitmap_to_grayscale(&t_bmp);
                 printf("\nGrayscale selected\n");
 
             }
+            else if (input[0] == 'b' || input[0] == 'v')
+            {
+                bitmap_to_grayscale_mode(&t_bmp, input[0] == 'b' ? GRAY_BT601 : GRAY_BT709);
+                printf("\nGrayscale (%s) selected\n", input[0] == 'b' ? "BT.601" : "BT.709");
+            }
             else if (input[0] == 'p')
             {
                 bitmap_posterize(&t_bmp);
@@ -159,64 +966,66 @@ int main(int argc, char *argv[])
                 printf("\nShrink selected\n");
                 bitmap_shrink(&t_bmp);
             }
+            else if (input[0] == 'z')
+            {
+                printf(history_undo(&history, &t_bmp) == 0 ? "\nUndone\n" : "\nNothing to undo\n");
+            }
+            else if (input[0] == 'y')
+            {
+                printf(history_redo(&history, &t_bmp) == 0 ? "\nRedone\n" : "\nNothing to redo\n");
+            }
             else if (input[0] == 's')
             {
                 printf("\nEnter filename: ");
                 scanf("%s", input);
                 char *o_filename = input;
                 printf("\nSaving to %s", input);
-                int file_size_updated = bmp_file_size(&t_bmp);
-                int *o_pointer = map_file_for_writing(o_filename, file_size_updated);
-                write_bitmap(o_pointer, &t_bmp);
-                printf("\nSaved!\n");
-                long length = file_size_updated;
-                munmap(o_pointer, length);
+                bitmap_materialize(&t_bmp);
+
+                // Saving over the last save only rewrites the rows
+                // changed since
+                if (write_bitmap_dirty(&t_bmp, o_filename) != -1)
+                {
+                    printf("\nSaved!\n");
+                }
+                else
+                {
+                    int file_size_updated = bmp_file_size(&t_bmp);
+                    int ev = trace_begin("map_file_for_writing");
+                    int *o_pointer = map_file_for_writing(o_filename, file_size_updated);
+                    trace_end(ev, 0);
+                    ev = trace_begin("write_bitmap");
+                    write_bitmap(o_pointer, &t_bmp);
+                    trace_end(ev, file_size_updated + (long) t_bmp.width * t_bmp.height * sizeof(int));
+                    printf("\nSaved!\n");
+                    long length = file_size_updated;
+                    ev = trace_begin("munmap");
+                    munmap(o_pointer, length);
+                    trace_end(ev, length);
+                    bitmap_track_dirty(&t_bmp, o_filename);
+                }
             }
             else if (input[0] == 'q')
             {
                 printf("\nBye.\n");
+                history_release(&history);
+                bitmap_free(&t_bmp);
+                pixel_arena_release(&arena);
                 return 0;
             }
+            if (changes)
+            {
+                history_push(&history, &t_bmp);
+            }
+            trace_end(op_ev, in_bytes + (long) t_bmp.width * t_bmp.height * sizeof(int));
         }
     }
+    else
+    {
+        return run_pipeline_cli(argc, argv);
+    }
 
 
-    //*/ My code I used for testing
-
-    char *filename = "/var/project02/images/converse.bmp";
-    int *pointer = map_file_for_reading(filename);
-
-    struct bitmap o_bmp;
-    read_bitmap(pointer, &o_bmp);
-    long file_size = bmp_file_size(&o_bmp);
-
-    //bitmap_to_grayscale(&o_bmp);
-
-    //bitmap_posterize(&o_bmp);
-
-    //bitmap_mirror(&o_bmp);
-
-    //bitmap_squash(&o_bmp);
-
-    //bitmap_reflect(&o_bmp);
-
-    //bitmap_rotate(&o_bmp);
-
-    bitmap_skew(&o_bmp);
-
-    //bitmap_shrink(&o_bmp);
-
-    /*int file_size_updated = bmp_file_size(&o_bmp);
-    
-    char *o_filename = "test_skew.bmp";
-    int munmap(pointer, file_size);
-    int *o_pointer = map_file_for_writing(o_filename, file_size_updated);
-
-    write_bitmap(o_pointer, &o_bmp);
-    long length = file_size_updated;
-    int munmap(o_pointer, length);
-    //*/
-    
 	return 0;
 }
 // */
@@ -277,11 +1086,48 @@ void *map_file_for_reading(char *filename)
     //return NULL;
 }
 
+void *map_bitmap_for_reading(char *filename, long *size)
+{
+    struct stat statbuf;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1 || fstat(fd, &statbuf) == -1)
+    {
+        perror(filename);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return NULL;
+    }
+    *size = statbuf.st_size;
+    if (*size < 54)
+    {
+        printf("Error: %s is too short to be a bitmap\n", filename);
+        close(fd);
+        return NULL;
+    }
+
+    void *p = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+    {
+        perror(filename);
+        return NULL;
+    }
+    if (bmp_file_check(p, *size) == -1)
+    {
+        munmap(p, *size);
+        return NULL;
+    }
+    return p;
+}
+
 void *map_file_for_writing(char *filename, int file_size)
 {
 
     // A) Use open() to open the file for writing.
-    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    // O_TRUNC so nothing of an older file survives in the padding
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (fd == -1) 
     {
         perror(NULL);
@@ -297,7 +1143,9 @@ void *map_file_for_writing(char *filename, int file_size)
     }
 
     // C) Call mmap() to map the file into memory.
-    int *p = mmap(NULL, file_size, PROT_WRITE, MAP_SHARED, fd, 0);
+    // Readable too, so a mip level can be made from the rows written
+    // for the one above it.
+    int *p = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 
     if (p == MAP_FAILED)
     {
@@ -316,95 +1164,179 @@ void *map_file_for_writing(char *filename, int file_size)
 
 }
 
-int read_bitmap(void *bmp_file, struct bitmap *bmp)
+int read_bitmap_header(void *bmp_file, struct bitmap *bmp)
 {
-    // Cast bmp_file to a byte * so we can access it
-    // byte by byte.
-    byte *file = (byte *) bmp_file;
+    struct bmp_format fmt;
+    if (read_bitmap_format(bmp_file, bmp, &fmt) == -1)
+    {
+        return -1;
+    }
+    if (fmt.format != BMP_BGR24 || fmt.top_down)
+    {
+        printf("Error: This needs a 24-bit bitmap with its rows bottom to top\n");
+        return -1;
+    }
+    return fmt.offset;
+}
 
-    // Check the magic: it should start with "BM"
+void pixel_arena_init(struct pixel_arena *arena)
+{
+    arena->buffers[0] = NULL;
+    arena->buffers[1] = NULL;
+    arena->capacity[0] = 0;
+    arena->capacity[1] = 0;
+    arena->current = 0;
+}
 
-    if (file[0] == 'B')
+void pixel_arena_release(struct pixel_arena *arena)
+{
+    free(arena->buffers[0]);
+    free(arena->buffers[1]);
+    pixel_arena_init(arena);
+}
+
+// A buffer of at least bytes bytes for the result of an op on bmp: the
+// arena's spare one if bmp has an arena, otherwise a new one
+static void *bitmap_new_buffer(struct bitmap *bmp, long bytes)
+{
+    struct pixel_arena *arena = bmp->arena;
+    if (arena == NULL)
     {
-        if (file[1] == 'M')
-        {
-            bmp->width = *((int *)(file + 18));
-            bmp->height = *((int *)(file + 22));
-            int *pix = (int *)(file + 10);
-            short *cdep = (short *)(file + 28);
-            if (*cdep != 24)
-            {
-                printf("Color depth is not 24");
-                return -1;
-            }
-            int *compmeth = (int *)(file + 30);
-            if (*compmeth != 0)
-            {
-                printf("The compression method is not 0");
-                return -1;
-            }
+        return bitmap_malloc(bytes);
+    }
 
-            int stride = bmp_file_stride(bmp);
-            //allocating memory for the pixels
-            bmp->pixels = (int *) malloc(bmp->width * bmp->height * sizeof(int));
-            
-            for (int y = 0; y < bmp->height; ++y)
-            {
-                // Calculate where this row of pixels begins in the file
-                // (Use the pixel data offset and stride)
+    int spare = 1 - arena->current;
+    if (arena->capacity[spare] < bytes)
+    {
+        free(arena->buffers[spare]);
+        arena->buffers[spare] = bitmap_malloc(bytes);
+        arena->capacity[spare] = bytes;
+    }
+    return arena->buffers[spare];
+}
 
-                int bott_height = bmp->height - (y+1);
-                
-                // Remember that the file stores rows from bottom to top!
-    
-                for (int x = 0; x < bmp->width; ++x)
-                {
+// Makes buffer, from bitmap_new_buffer(), hold bmp's pixels in bmp's
+// layout, and lets go of the old pixels. Every row counts as changed.
+static void bitmap_replace_buffer(struct bitmap *bmp, void *buffer)
+{
+    bitmap_mark_dirty(bmp, 0, bmp->height);
+    if (bmp->arena != NULL)
+    {
+        bmp->arena->current = 1 - bmp->arena->current;
+    }
+    else
+    {
+        free(bmp->pixels);
+        free(bmp->bgr);
+    }
 
-                    int start = *pix + (bott_height * stride) + (3 * x);
-
-                    // Locate the B, G, and R bytes for the pixel (x, y)
-                    int b = file[start];
-                    int g = file[start + 1];
-                    int r = file[start + 2];
-        
-                    // Assemble the R, G, B into a pixel value by using rgb_to_pixel()
-                    int stored_pixel;
-                    rgb_to_pixel(&stored_pixel, r, g, b);
-                    
-        
-                    // Place the pixel (x, y) at the appropriate place in the pixels array
-                    int i = y * bmp->width + x;
-                    bmp->pixels[i] = stored_pixel;
-                }
-            }
-            return 0;
-        }
-        else
-        {
-            printf("Error: Not a bitmap!");
-            return -1;
-        }
+    bmp->pixels = NULL;
+    bmp->bgr = NULL;
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bmp->bgr = (byte *) buffer;
     }
     else
     {
-        printf("Error: Not a bitmap!");
+        bmp->pixels = (int *) buffer;
+    }
+}
+
+int read_bitmap(void *bmp_file, struct bitmap *bmp)
+{
+    return read_bitmap_layout(bmp_file, bmp, LAYOUT_INT);
+}
+
+int read_bitmap_layout(void *bmp_file, struct bitmap *bmp, int layout)
+{
+    return read_bitmap_arena(bmp_file, bmp, layout, NULL);
+}
+
+// Bytes per pixel of a BMP_ format, with the other formats further
+// down
+static int bmp_format_bpp(int format);
+
+// Returns 1 if r is a rectangle inside a width x height image,
+// otherwise prints why not and returns 0
+static int rect_inside(const struct rect *r, int width, int height)
+{
+    if (r->width < 1 || r->height < 1 || r->x < 0 || r->y < 0
+        || r->x > width - r->width || r->y > height - r->height)
+    {
+        printf("Error: The rectangle %dx%d+%d+%d isn't inside the %dx%d image\n",
+               r->width, r->height, r->x, r->y, width, height);
+        return 0;
+    }
+    return 1;
+}
+
+int read_bitmap_rect(void *bmp_file, struct bitmap *bmp, int layout, struct pixel_arena *arena,
+                     const struct rect *r)
+{
+    byte *file = (byte *) bmp_file;
+
+    struct bmp_format fmt;
+    if (read_bitmap_format(bmp_file, bmp, &fmt) == -1)
+    {
+        return -1;
+    }
+    struct rect whole = { 0, 0, bmp->width, bmp->height };
+    if (r == NULL)
+    {
+        r = &whole;
+    }
+    else if (!rect_inside(r, bmp->width, bmp->height))
+    {
         return -1;
     }
+    int image_height = bmp->height;
+    bmp->width = r->width;
+    bmp->height = r->height;
+    bmp->layout = layout;
+    bmp->pixels = NULL;
+    bmp->bgr = NULL;
+    bmp->arena = arena;
+    bmp->pending = NULL;
+    bmp->dirty = NULL;
 
-    
+    // Where row y of the window is in the file. Most files store rows
+    // from bottom to top!
+    long first_row = fmt.top_down ? r->y : image_height - 1 - r->y;
+    const byte *first = file + fmt.offset + first_row * fmt.stride + (long) r->x * bmp_format_bpp(fmt.format);
+    long step = fmt.top_down ? fmt.stride : -fmt.stride;
+
+    if (layout == LAYOUT_BGR24 && fmt.format == BMP_BGR24)
+    {
+        // The file rows are already in this layout, just padded
+        long row_bytes = (long) bmp->width * 3;
+        bitmap_replace_buffer(bmp, bitmap_new_buffer(bmp, row_bytes * bmp->height));
+        for (int y = 0; y < bmp->height; ++y)
+        {
+            memcpy(bmp->bgr + y * row_bytes, first + y * step, row_bytes);
+        }
+        return 0;
+    }
 
-    // Default implementation: just returns 0.
+    // A whole row at a time, into ints first for the other formats
+    bmp->layout = LAYOUT_INT;
+    bitmap_replace_buffer(bmp, bitmap_new_buffer(bmp, (long) bmp->width * bmp->height * sizeof(int)));
+    for (int y = 0; y < bmp->height; ++y)
+    {
+        decode_format_row(&fmt, first + y * step, bmp->pixels + (long) y * bmp->width, bmp->width);
+    }
+    bitmap_set_layout(bmp, layout);
     return 0;
 }
 
-void write_bitmap(void *bmp_file, struct bitmap *bmp)
+int read_bitmap_arena(void *bmp_file, struct bitmap *bmp, int layout, struct pixel_arena *arena)
+{
+    return read_bitmap_rect(bmp_file, bmp, layout, arena, NULL);
+}
+
+void write_bitmap_header(void *bmp_file, struct bitmap *bmp)
 {
-    
-    // Cast bmp_file to a byte * so we can access it
-    // byte by byte.
     byte *file = (byte *) bmp_file;
 
-    // Fill in the rest :)
     //Magic
     file[0] = 'B';
     file[1] = 'M';
@@ -429,336 +1361,8638 @@ void write_bitmap(void *bmp_file, struct bitmap *bmp)
     *((int *)(file +34)) = bmp->height * stride;
     //Palette Size
     file[46] = 0;
+}
 
-    //Pixel Data
-    //bmp->pixels = (int *) malloc(bmp->width * bmp->height * sizeof(int));
-            
-            for (int y = 0; y < bmp->height; ++y)
-            {
-                int bott_height = bmp->height - (y+1);
-             
-                for (int x = 0; x < bmp->width; ++x)
-                {
-
-                    int start = 54 + (bott_height * stride) + (3 * x);
+void write_bitmap(void *bmp_file, struct bitmap *bmp)
+{
+    
+    // Cast bmp_file to a byte * so we can access it
+    // byte by byte.
+    byte *file = (byte *) bmp_file;
 
-                    int r;
-                    int g;
-                    int b;
+    bitmap_materialize(bmp);
+    write_bitmap_header(bmp_file, bmp);
+    int stride = bmp_file_stride(bmp);
 
-                    int i = y * bmp->width + x;
-                    
-                    int stored_pixel = bmp->pixels[i];
-                    
-                    pixel_to_rgb(stored_pixel, &r, &g, &b);
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        long row_bytes = (long) bmp->width * 3;
+        for (int y = 0; y < bmp->height; ++y)
+        {
+            byte *dst = file + 54 + (long) (bmp->height - 1 - y) * stride;
+            memcpy(dst, bmp->bgr + y * row_bytes, row_bytes);
+            memset(dst + row_bytes, 0, stride - row_bytes);
+        }
+        return;
+    }
 
-                    file[start] = b;
-                    file[start + 1] = g;
-                    file[start + 2] = r;
-                }
-            }
+    //Pixel Data, a whole row at a time, bottom to top
+    long row_bytes = (long) bmp->width * 3;
+    for (int y = 0; y < bmp->height; ++y)
+    {
+        byte *dst = file + 54 + (long) (bmp->height - 1 - y) * stride;
+        encode_row(bmp->pixels + (long) y * bmp->width, dst, bmp->width);
+        memset(dst + row_bytes, 0, stride - row_bytes);
+    }
 }
 
-void rgb_to_pixel(int *p, int r, int g, int b)
+// ---- Other BMP formats ----
+
+// Compression methods of the headers
+#define BI_RGB 0
+#define BI_BITFIELDS 3
+
+// Bytes per pixel of a BMP_ format
+static int bmp_format_bpp(int format)
 {
-    // Pack r, g, and b into an int value and save
-    // into what p points to
-    *p = ((r & 0xff) << 16) |
-        ((g & 0xff) << 8) |
-        (b & 0xff);
+    return format == BMP_BGR24 ? 3 : format == BMP_PAL8 ? 1 : 4;
 }
 
-void pixel_to_rgb(int p, int *r, int *g, int *b)
+// Returns 1 if mask is a single run of set bits
+static int bitfield_mask_valid(unsigned int mask)
 {
-    // Separate the pixel p into its components
-    // and save in the pointers
-    *r = (p & 0xff0000) >> 16;
-    *g = (p & 0x00ff00) >> 8;
-    *b = (p & 0xff);
+    if (mask == 0)
+    {
+        return 0;
+    }
+    unsigned int field = mask >> __builtin_ctz(mask);
+    return (field & (field + 1)) == 0;
 }
 
-void bitmap_to_grayscale(struct bitmap *bmp)
+int read_bitmap_format(void *bmp_file, struct bitmap *bmp, struct bmp_format *fmt)
 {
-    for (int y = 0; y < bmp->height; ++y)
-            {
-                for (int x = 0; x < bmp->width; ++x)
-                {
-                    int r;
-                    int g;
-                    int b;
+    byte *file = (byte *) bmp_file;
 
-                    int i = y * bmp->width + x;
-                    
-                    int stored_pixel = bmp->pixels[i];
-                    
-                    pixel_to_rgb(stored_pixel, &r, &g, &b);
-                    int grayscale = (r+g+b)/3;
-                    int changed_pixel;
-                    rgb_to_pixel(&changed_pixel, grayscale, grayscale, grayscale);
-                    bmp->pixels[i] = changed_pixel;
+    // Check the magic: it should start with "BM"
+    if (file[0] != 'B' || file[1] != 'M')
+    {
+        printf("Error: Not a bitmap!");
+        return -1;
+    }
 
-                }
-            }
-}
+    int header_size = *((int *)(file + 14));
+    int height = *((int *)(file + 22));
+    short depth = *((short *)(file + 28));
+    int compression = *((int *)(file + 30));
+    if (header_size < 40)
+    {
+        printf("Error: Unsupported bitmap header of %d bytes\n", header_size);
+        return -1;
+    }
 
-void bitmap_posterize(struct bitmap *bmp)
-{
-    for (int y = 0; y < bmp->height; ++y)
+    bmp->width = *((int *)(file + 18));
+    bmp->height = height < 0 ? -height : height;
+    fmt->top_down = height < 0;
+    fmt->offset = *((int *)(file + 10));
+    fmt->masks[0] = 0xff0000;
+    fmt->masks[1] = 0x00ff00;
+    fmt->masks[2] = 0x0000ff;
+    fmt->ncolors = 0;
+
+    if (depth == 24 && compression == BI_RGB)
+    {
+        fmt->format = BMP_BGR24;
+    }
+    else if (depth == 32 && (compression == BI_RGB || compression == BI_BITFIELDS))
+    {
+        // The masks follow a 40-byte header, and bigger headers have
+        // them in the same place
+        if (compression == BI_BITFIELDS)
+        {
+            for (int c = 0; c < 3; ++c)
             {
-                for (int x = 0; x < bmp->width; ++x)
+                fmt->masks[c] = *((unsigned int *)(file + 54 + 4 * c));
+                if (!bitfield_mask_valid(fmt->masks[c]))
                 {
-                    int r;
-                    int g;
-                    int b;
-
-                    int i = y * bmp->width + x;
-                    
-                    int stored_pixel = bmp->pixels[i];
-                    
-                    pixel_to_rgb(stored_pixel, &r, &g, &b);
+                    printf("Error: Bad bit field mask 0x%08x\n", fmt->masks[c]);
+                    return -1;
+                }
+            }
+        }
+        fmt->format = fmt->masks[0] == 0xff0000 && fmt->masks[1] == 0x00ff00 && fmt->masks[2] == 0x0000ff
+            ? BMP_BGRA32 : BMP_BITFIELDS32;
+    }
+    else if (depth == 8 && compression == BI_RGB)
+    {
+        // The palette follows the header, as B, G, R, 0 entries
+        int ncolors = *((int *)(file + 46));
+        ncolors = ncolors == 0 ? 256 : ncolors;
+        if (ncolors < 0 || ncolors > 256 || 14 + header_size + 4 * ncolors > fmt->offset)
+        {
+            printf("Error: Bad palette of %d colors\n", ncolors);
+            return -1;
+        }
+        const byte *entry = file + 14 + header_size;
+        for (int i = 0; i < 256; ++i)
+        {
+            fmt->palette[i] = i < ncolors
+                ? (entry[4 * i + 2] << 16) | (entry[4 * i + 1] << 8) | entry[4 * i] : 0;
+        }
+        fmt->ncolors = ncolors;
+        fmt->format = BMP_PAL8;
+    }
+    else
+    {
+        printf("Error: Only uncompressed 24-bit, 32-bit and 8-bit bitmaps are supported, "
+               "not %d-bit with compression %d\n", depth, compression);
+        return -1;
+    }
 
-                    //Less than 32
-                    if (r < 32)
-                    {
-                        r = 0;
-                    }
-                    else if (32 <= r && r <= 95)
-                    {
-                        r = 64;
-                    }
-                    else if (96 <= r && r <= 159)
-                    {
-                        r = 128;
-                    }
-                    else if (160 <= r && r <= 223)
-                    {
-                        r = 192;
-                    }
-                    else if (r >= 224)
-                    {
-                        r = 255;
-                    }
+    fmt->stride = (8 * bmp_format_bpp(fmt->format) * bmp->width + 31) / 32 * 4;
+    return 0;
+}
 
+int bmp_file_check(void *bmp_file, long size)
+{
+    byte *file = (byte *) bmp_file;
+    if (size < 54)
+    {
+        printf("Error: A bitmap needs at least 54 bytes of headers, not %ld\n", size);
+        return -1;
+    }
 
-                    if (g < 32)
-                    {
-                        g = 0;
-                    }
-                    else if (32 <= g && g <= 95)
-                    {
-                        g = 64;
-                    }
-                    else if (96 <= g && g <= 159)
-                    {
-                        g = 128;
-                    }
-                    else if (160 <= g && g <= 223)
-                    {
-                        g = 192;
-                    }
-                    else if (g >= 224)
-                    {
-                        g = 255;
-                    }
+    // The header, palette and masks all sit before the pixels, so
+    // with the pixel offset inside the file they are too
+    long header_size = *((int *)(file + 14));
+    long offset = *((int *)(file + 10));
+    if (offset < 54 || offset > size || 14 + header_size > offset)
+    {
+        printf("Error: Bad pixel offset %ld in a file of %ld bytes\n", offset, size);
+        return -1;
+    }
 
-                    
-                    if (b < 32)
-                    {
-                        b = 0;
-                    }
-                    else if (32 <= b && b <= 95)
-                    {
-                        b = 64;
-                    }
-                    else if (96 <= b && b <= 159)
-                    {
-                        b = 128;
-                    }
-                    else if (160 <= b && b <= 223)
-                    {
-                        b = 192;
-                    }
-                    else if (b >= 255)
-                    {
-                        b = 255;
-                    }
+    struct bitmap header;
+    struct bmp_format fmt;
+    if (read_bitmap_format(bmp_file, &header, &fmt) == -1)
+    {
+        return -1;
+    }
+    long stride = (8L * bmp_format_bpp(fmt.format) * header.width + 31) / 32 * 4;
+    if (header.width <= 0 || header.height <= 0 || stride != fmt.stride)
+    {
+        printf("Error: Bad bitmap size %dx%d\n", header.width, header.height);
+        return -1;
+    }
+    if (offset + stride * header.height > size)
+    {
+        printf("Error: The file has %ld bytes, but its %dx%d pixels need %ld\n",
+               size, header.width, header.height, offset + stride * header.height);
+        return -1;
+    }
+    return 0;
+}
 
-                    int changed_pixel;
-                    rgb_to_pixel(&changed_pixel, r, g, b);
-                    bmp->pixels[i] = changed_pixel;
-                }
-            }
+// The slot of color in the 512-entry hash table of a palette, where
+// empty slots hold -1
+static int palette_slot(const int *keys, int color)
+{
+    unsigned int h = ((unsigned int) color * 2654435761u) >> 23;
+    while (keys[h] != -1 && keys[h] != color)
+    {
+        h = (h + 1) & 511;
+    }
+    return h;
 }
 
-void bitmap_mirror(struct bitmap *bmp)
+static int compare_ints(const void *a, const void *b)
 {
-    int new_width = bmp->width * 2;
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
 
-    int *new_pixels = (int *) malloc(new_width * bmp->height * sizeof(int));
+// Makes fmt's palette of bmp's colors, in increasing order. Returns
+// 0, or -1 if there are more than 256.
+static int bmp_format_palette(struct bmp_format *fmt, const struct bitmap *bmp)
+{
+    int *keys = fmt->palette_keys;
+    int n = 0;
+    int last = -1;
+    for (int i = 0; i < 512; ++i)
+    {
+        keys[i] = -1;
+    }
 
+    long npixels = (long) bmp->width * bmp->height;
+    for (long i = 0; i < npixels; ++i)
+    {
+        int color;
+        if (bmp->layout == LAYOUT_BGR24)
+        {
+            const byte *p = bmp->bgr + 3 * i;
+            color = (p[2] << 16) | (p[1] << 8) | p[0];
+        }
+        else
+        {
+            color = bmp->pixels[i] & 0xffffff;
+        }
+        if (color == last)
+        {
+            continue;
+        }
+        last = color;
 
-        for (int y = 0; y < bmp->height; ++y)
+        int slot = palette_slot(keys, color);
+        if (keys[slot] == -1)
+        {
+            if (n == 256)
             {
-                for (int x = 0; x < bmp->width; ++x)
-                {
-                    int stored_pixel = bmp->pixels[y * bmp->width + x];
-
-                    new_pixels[y * new_width + x] = stored_pixel;
-                    new_pixels[y * new_width + (new_width - x - 1)] = stored_pixel;
-                }
+                printf("Error: The image has more than 256 colors, too many for an 8-bit file "
+                       "(posterize or grayscale it first)\n");
+                return -1;
             }
-            
-            free(bmp->pixels);
-            bmp->pixels = new_pixels;
-            bmp->width = new_width;
+            keys[slot] = color;
+            fmt->palette[n++] = color;
+        }
+    }
 
+    qsort(fmt->palette, n, sizeof(int), compare_ints);
+    for (int i = 0; i < n; ++i)
+    {
+        fmt->palette_index[palette_slot(keys, fmt->palette[i])] = (byte) i;
+    }
+    for (int i = n; i < 256; ++i)
+    {
+        fmt->palette[i] = 0;
+    }
+    fmt->ncolors = n;
+    return 0;
 }
 
-
-void bitmap_squash(struct bitmap *bmp)
+int bmp_format_for(struct bmp_format *fmt, const struct bitmap *bmp, int format, int top_down)
 {
-	int new_width = bmp->width / 2;
-
-    int *new_pixels = (int *) malloc(new_width * bmp->height * sizeof(int));
+    fmt->format = format;
+    fmt->top_down = top_down;
+    fmt->offset = 54 + (format == BMP_BITFIELDS32 ? 12 : 0) + (format == BMP_PAL8 ? 1024 : 0);
+    fmt->stride = (8 * bmp_format_bpp(format) * bmp->width + 31) / 32 * 4;
+    fmt->masks[0] = 0xff0000;
+    fmt->masks[1] = 0x00ff00;
+    fmt->masks[2] = 0x0000ff;
+    fmt->ncolors = 0;
 
-        for (int y = 0; y < bmp->height; ++y)
-            {
-                for (int x = 0; x < bmp->width;)
-                {
-                    //get rgb and average red green and blue seperate
-                    int m = y * new_width + (x / 2);
-                    int n = y * bmp->width + x;
-                    int o = y * bmp->width + x + 1;
-
-                    int first_pixel = bmp->pixels[n];
-                    int second_pixel = bmp->pixels[o];
-
-                    int r1, g1, b1, r2, g2, b2;
-                    
-                    pixel_to_rgb(first_pixel, &r1, &g1, &b1);
-                    pixel_to_rgb(second_pixel, &r2, &g2, &b2);
-
-                    int r = (r1 + r2) / 2;
-                    int g = (g1 + g2) / 2;
-                    int b = (b1 + b2) / 2;
-                    int changed_pixel;
-                    rgb_to_pixel(&changed_pixel, r, g, b);
-                    new_pixels[m] = changed_pixel;
-                    x+= 2;
-                }
-            }
-            
-            free(bmp->pixels);
-            bmp->pixels = new_pixels;
-            bmp->width = new_width;
+    if (format == BMP_PAL8)
+    {
+        return bmp_format_palette(fmt, bmp);
+    }
+    return 0;
 }
- 
-void bitmap_reflect(struct bitmap *bmp)
-{
 
-    int *new_pixels = (int *) malloc(bmp->width * bmp->height * sizeof(int));
+int bmp_format_file_size(const struct bmp_format *fmt, const struct bitmap *bmp)
+{
+    return fmt->offset + fmt->stride * bmp->height;
+}
+
+int bmp_size_check(long width, long height)
+{
+    // Room for the headers, masks and a 256-color palette
+    const long limit = INT_MAX - 2048;
+    if (width > limit / 4 || 4 * width * height > limit)
+    {
+        printf("Error: A %ldx%ld image is too big for a bitmap file\n", width, height);
+        return -1;
+    }
+    return 0;
+}
+
+// Writes the headers of a .bmp file of bmp laid out as fmt, with the
+// masks or palette that follow them: fmt->offset bytes in all
+static void write_format_header(byte *file, const struct bitmap *bmp, const struct bmp_format *fmt)
+{
+    memset(file, 0, fmt->offset);
+    file[0] = 'B';
+    file[1] = 'M';
+    *((int *)(file + 2)) = bmp_format_file_size(fmt, bmp);
+    *((int *)(file + 10)) = fmt->offset;
+    file[14] = 40;
+    *((int *)(file + 18)) = bmp->width;
+    *((int *)(file + 22)) = fmt->top_down ? -bmp->height : bmp->height;
+    file[26] = 1;
+    file[28] = 8 * bmp_format_bpp(fmt->format);
+    *((int *)(file + 30)) = fmt->format == BMP_BITFIELDS32 ? BI_BITFIELDS : BI_RGB;
+    *((int *)(file + 34)) = fmt->stride * bmp->height;
+
+    if (fmt->format == BMP_BITFIELDS32)
+    {
+        memcpy(file + 54, fmt->masks, 12);
+    }
+    else if (fmt->format == BMP_PAL8)
+    {
+        *((int *)(file + 46)) = 256;
+        for (int i = 0; i < 256; ++i)
+        {
+            file[54 + 4 * i] = fmt->palette[i] & 0xff;
+            file[54 + 4 * i + 1] = (fmt->palette[i] >> 8) & 0xff;
+            file[54 + 4 * i + 2] = (fmt->palette[i] >> 16) & 0xff;
+        }
+    }
+}
+
+// 32-bit BGRA rows are ints already: converting them only clears or
+// drops the alpha byte
+static void decode_row_bgra32(const byte *src, int *dst, int n)
+{
+    int x = 0;
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2)
+    {
+        __m128i rgb = _mm_set1_epi32(0x00ffffff);
+        for (; x + 4 <= n; x += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *) (src + 4 * x));
+            _mm_storeu_si128((__m128i *) (dst + x), _mm_and_si128(p, rgb));
+        }
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        dst[x] = (src[4 * x + 2] << 16) | (src[4 * x + 1] << 8) | src[4 * x];
+    }
+}
+
+static void encode_row_bgra32(const int *src, byte *dst, int n)
+{
+    int x = 0;
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() >= SIMD_SSE2)
+    {
+        __m128i rgb = _mm_set1_epi32(0x00ffffff);
+        for (; x + 4 <= n; x += 4)
+        {
+            __m128i p = _mm_loadu_si128((const __m128i *) (src + x));
+            _mm_storeu_si128((__m128i *) (dst + 4 * x), _mm_and_si128(p, rgb));
+        }
+    }
+#endif
+    for (; x < n; ++x)
+    {
+        dst[4 * x] = src[x] & 0xff;
+        dst[4 * x + 1] = (src[x] >> 8) & 0xff;
+        dst[4 * x + 2] = (src[x] >> 16) & 0xff;
+        dst[4 * x + 3] = 0;
+    }
+}
+
+// Channels under any other masks are shifted down and scaled to 8 bits
+static void decode_row_bitfields(const unsigned int *masks, const byte *src, int *dst, int n)
+{
+    int shift[3];
+    unsigned int max[3];
+    int bits[3];
+    for (int c = 0; c < 3; ++c)
+    {
+        shift[c] = __builtin_ctz(masks[c]);
+        max[c] = masks[c] >> shift[c];
+        bits[c] = 32 - __builtin_clz(max[c]);
+    }
+
+    for (int x = 0; x < n; ++x)
+    {
+        unsigned int p = src[4 * x] | (src[4 * x + 1] << 8) | (src[4 * x + 2] << 16)
+            | ((unsigned int) src[4 * x + 3] << 24);
+        int pixel = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned int v = (p >> shift[c]) & max[c];
+            v = bits[c] >= 8 ? v >> (bits[c] - 8) : (v * 255 + max[c] / 2) / max[c];
+            pixel = (pixel << 8) | v;
+        }
+        dst[x] = pixel;
+    }
+}
+
+static void encode_row_bitfields(const unsigned int *masks, const int *src, byte *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+    {
+        unsigned int p = 0;
+        for (int c = 0; c < 3; ++c)
+        {
+            int shift = __builtin_ctz(masks[c]);
+            unsigned long long max = masks[c] >> shift;
+            unsigned int v = (src[x] >> (16 - 8 * c)) & 0xff;
+            p |= (unsigned int) ((v * max + 127) / 255) << shift;
+        }
+        memcpy(dst + 4 * x, &p, 4);
+    }
+}
+
+static void decode_row_pal8_scalar(const int *palette, const byte *src, int *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+    {
+        dst[x] = palette[src[x]];
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// 8 palette lookups per gather
+__attribute__((target("avx2")))
+static void decode_row_pal8_avx2(const int *palette, const byte *src, int *dst, int n)
+{
+    int x = 0;
+    for (; x + 8 <= n; x += 8)
+    {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + x)));
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_i32gather_epi32(palette, index, 4));
+    }
+    decode_row_pal8_scalar(palette, src + x, dst + x, n - x);
+}
+
+#endif
+
+// Colors are looked up in the palette's hash table, skipping the
+// lookup for runs of the same color
+static void encode_row_pal8(const struct bmp_format *fmt, const int *src, byte *dst, int n)
+{
+    int last = -1;
+    byte index = 0;
+    for (int x = 0; x < n; ++x)
+    {
+        int color = src[x] & 0xffffff;
+        if (color != last)
+        {
+            last = color;
+            index = fmt->palette_index[palette_slot(fmt->palette_keys, color)];
+        }
+        dst[x] = index;
+    }
+}
+
+void decode_format_row(const struct bmp_format *fmt, const byte *src, int *dst, int n)
+{
+    if (fmt->format == BMP_BGRA32)
+    {
+        decode_row_bgra32(src, dst, n);
+    }
+    else if (fmt->format == BMP_BITFIELDS32)
+    {
+        decode_row_bitfields(fmt->masks, src, dst, n);
+    }
+    else if (fmt->format == BMP_PAL8)
+    {
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+        if (simd_level() == SIMD_AVX2)
+        {
+            decode_row_pal8_avx2(fmt->palette, src, dst, n);
+            return;
+        }
+#endif
+        decode_row_pal8_scalar(fmt->palette, src, dst, n);
+    }
+    else
+    {
+        decode_row(src, dst, n);
+    }
+}
+
+void encode_format_row(const struct bmp_format *fmt, const int *src, byte *dst, int n)
+{
+    if (fmt->format == BMP_BGRA32)
+    {
+        encode_row_bgra32(src, dst, n);
+    }
+    else if (fmt->format == BMP_BITFIELDS32)
+    {
+        encode_row_bitfields(fmt->masks, src, dst, n);
+    }
+    else if (fmt->format == BMP_PAL8)
+    {
+        encode_row_pal8(fmt, src, dst, n);
+    }
+    else
+    {
+        encode_row(src, dst, n);
+    }
+}
+
+// Encodes row y of bmp into the file row dst laid out as fmt, padding
+// included. scratch holds a row of ints on the way from LAYOUT_BGR24
+// to the other formats.
+static void encode_file_row(const struct bmp_format *fmt, const struct bitmap *bmp, int y, byte *dst, int *scratch)
+{
+    long row_bytes = (long) bmp->width * bmp_format_bpp(fmt->format);
+    if (row_bytes == 0)
+    {
+        // An image squashed down to no columns has no buffer and
+        // rows of no bytes, padding included
+        return;
+    }
+    if (bmp->layout == LAYOUT_BGR24 && fmt->format == BMP_BGR24)
+    {
+        memcpy(dst, bmp->bgr + (long) y * bmp->width * 3, row_bytes);
+    }
+    else if (bmp->layout == LAYOUT_BGR24)
+    {
+        decode_row(bmp->bgr + (long) y * bmp->width * 3, scratch, bmp->width);
+        encode_format_row(fmt, scratch, dst, bmp->width);
+    }
+    else
+    {
+        encode_format_row(fmt, bmp->pixels + (long) y * bmp->width, dst, bmp->width);
+    }
+    memset(dst + row_bytes, 0, fmt->stride - row_bytes);
+}
+
+void write_bitmap_format(void *bmp_file, struct bitmap *bmp, const struct bmp_format *fmt)
+{
+    byte *file = (byte *) bmp_file;
+    bitmap_materialize(bmp);
+    write_format_header(file, bmp, fmt);
+
+    int *scratch = bmp->layout == LAYOUT_BGR24 && fmt->format != BMP_BGR24
+        ? (int *) bitmap_malloc((long) bmp->width * sizeof(int)) : NULL;
+    for (int y = 0; y < bmp->height; ++y)
+    {
+        int r = fmt->top_down ? y : bmp->height - 1 - y;
+        encode_file_row(fmt, bmp, y, file + fmt->offset + (long) r * fmt->stride, scratch);
+    }
+    free(scratch);
+}
+
+// pread()/pwrite() that keep going until all n bytes are done. Return
+// 0 on success, -1 on failure.
+static int pread_fully(int fd, void *buf, long n, long pos)
+{
+    byte *p = (byte *) buf;
+    while (n > 0)
+    {
+        ssize_t got = pread(fd, p, n, pos);
+        if (got <= 0)
+        {
+            if (got == -1)
+            {
+                perror(NULL);
+            }
+            return -1;
+        }
+        p += got;
+        pos += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int pwrite_fully(int fd, const void *buf, long n, long pos)
+{
+    const byte *p = (const byte *) buf;
+    while (n > 0)
+    {
+        ssize_t put = pwrite(fd, p, n, pos);
+        if (put == -1)
+        {
+            perror(NULL);
+            return -1;
+        }
+        p += put;
+        pos += put;
+        n -= put;
+    }
+    return 0;
+}
+
+// O_DIRECT writes need aligned buffers, offsets and lengths
+#define WRITER_ALIGN 4096
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+static void bmp_writer_alloc(struct bmp_writer *w, long size)
+{
+    void *buffer = NULL;
+    w->capacity = (size + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+    if (posix_memalign(&buffer, WRITER_ALIGN, w->capacity) != 0)
+    {
+        buffer = NULL;
+        w->capacity = 0;
+    }
+    w->buffer = (byte *) buffer;
+}
+
+void bmp_writer_init(struct bmp_writer *w, long buffer_size, int direct, int fsync_policy)
+{
+    bmp_writer_alloc(w, buffer_size > WRITER_ALIGN ? buffer_size : WRITER_ALIGN);
+    w->used = 0;
+    w->offset = 0;
+    w->fd = -1;
+    w->direct = direct;
+    w->fsync_policy = fsync_policy;
+}
+
+void bmp_writer_release(struct bmp_writer *w)
+{
+    free(w->buffer);
+    w->buffer = NULL;
+    w->capacity = 0;
+}
+
+// Writes out the buffer. Except on the last flush, an O_DIRECT writer
+// only writes whole blocks and keeps the rest for next time; the last
+// one is padded to a block and the file cut back to size afterwards.
+static int bmp_writer_flush(struct bmp_writer *w, int last)
+{
+    long n = w->used;
+    if (w->direct)
+    {
+        if (last)
+        {
+            n = (n + WRITER_ALIGN - 1) / WRITER_ALIGN * WRITER_ALIGN;
+            memset(w->buffer + w->used, 0, n - w->used);
+        }
+        else
+        {
+            n = n / WRITER_ALIGN * WRITER_ALIGN;
+        }
+    }
+
+    if (n > 0 && pwrite_fully(w->fd, w->buffer, n, w->offset) == -1)
+    {
+        return -1;
+    }
+    if (last)
+    {
+        w->offset += w->used;
+        w->used = 0;
+    }
+    else
+    {
+        memmove(w->buffer, w->buffer + n, w->used - n);
+        w->offset += n;
+        w->used -= n;
+    }
+
+    if (w->fsync_policy == FSYNC_EACH && n > 0 && fdatasync(w->fd) == -1)
+    {
+        perror(NULL);
+        return -1;
+    }
+    return 0;
+}
+
+// Room for the next n bytes of the file, flushing first if needed
+static byte *bmp_writer_reserve(struct bmp_writer *w, long n)
+{
+    if (w->used + n > w->capacity && bmp_writer_flush(w, 0) == -1)
+    {
+        return NULL;
+    }
+    byte *p = w->buffer + w->used;
+    w->used += n;
+    return p;
+}
+
+int write_bitmap_file(struct bmp_writer *w, char *filename, struct bitmap *bmp, const struct bmp_format *fmt)
+{
+    bitmap_materialize(bmp);
+    struct bmp_format plain;
+    if (fmt == NULL)
+    {
+        bmp_format_for(&plain, bmp, BMP_BGR24, 0);
+        fmt = &plain;
+    }
+    int stride = fmt->stride;
+
+    // The headers, a row and whatever an O_DIRECT flush leaves behind
+    // have to fit
+    if (w->capacity < stride + fmt->offset + WRITER_ALIGN)
+    {
+        free(w->buffer);
+        bmp_writer_alloc(w, stride + fmt->offset + WRITER_ALIGN);
+    }
+    if (w->buffer == NULL)
+    {
+        printf("Error: Out of memory for the write buffer\n");
+        return -1;
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int fd = open(filename, flags | (w->direct ? O_DIRECT : 0), 0644);
+    if (fd == -1 && w->direct && errno == EINVAL)
+    {
+        // tmpfs and a few others refuse O_DIRECT
+        w->direct = 0;
+        fd = open(filename, flags, 0644);
+    }
+    if (fd == -1)
+    {
+        perror(filename);
+        return -1;
+    }
+    w->fd = fd;
+    w->used = 0;
+    w->offset = 0;
+
+    write_format_header(bmp_writer_reserve(w, fmt->offset), bmp, fmt);
+
+    int *scratch = bmp->layout == LAYOUT_BGR24 && fmt->format != BMP_BGR24
+        ? (int *) bitmap_malloc((long) bmp->width * sizeof(int)) : NULL;
+    int result = 0;
+    for (int r = 0; r < bmp->height; ++r)
+    {
+        // Unless it is top-down, the file stores rows from bottom to top
+        int y = fmt->top_down ? r : bmp->height - 1 - r;
+        byte *row = bmp_writer_reserve(w, stride);
+        if (row == NULL)
+        {
+            result = -1;
+            break;
+        }
+        encode_file_row(fmt, bmp, y, row, scratch);
+    }
+    free(scratch);
+
+    if (result == 0 && bmp_writer_flush(w, 1) == -1)
+    {
+        result = -1;
+    }
+    if (result == 0 && w->direct && ftruncate(fd, w->offset) == -1)
+    {
+        perror(filename);
+        result = -1;
+    }
+    if (result == 0 && w->fsync_policy == FSYNC_END && fdatasync(fd) == -1)
+    {
+        perror(filename);
+        result = -1;
+    }
+    close(fd);
+    w->fd = -1;
+    return result;
+}
+
+void rgb_to_pixel(int *p, int r, int g, int b)
+{
+    // Pack r, g, and b into an int value and save
+    // into what p points to
+    *p = ((r & 0xff) << 16) |
+        ((g & 0xff) << 8) |
+        (b & 0xff);
+}
+
+void pixel_to_rgb(int p, int *r, int *g, int *b)
+{
+    // Separate the pixel p into its components
+    // and save in the pointers
+    *r = (p & 0xff0000) >> 16;
+    *g = (p & 0x00ff00) >> 8;
+    *b = (p & 0xff);
+}
+
+static void decode_row_scalar(const byte *src, int *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+    {
+        dst[x] = (src[3 * x + 2] << 16) | (src[3 * x + 1] << 8) | src[3 * x];
+    }
+}
+
+static void encode_row_scalar(const int *src, byte *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+    {
+        dst[3 * x] = src[x] & 0xff;
+        dst[3 * x + 1] = (src[x] >> 8) & 0xff;
+        dst[3 * x + 2] = (src[x] >> 16) & 0xff;
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// The byte shuffles of the row and BGR24 kernels need SSSE3, which
+// isn't implied by SSE2, so simd_level() settles it on its own. Returns
+// 1 if those kernels may run.
+static int simd_ssse3(void);
+
+// 16 pixels at a time: 48 bytes are loaded as three vectors, lined up
+// four pixels to a vector with alignr and spread out to ints with a
+// shuffle. Nothing past the n pixels is read or written.
+__attribute__((target("ssse3")))
+static void decode_row_ssse3(const byte *src, int *dst, int n)
+{
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        const byte *s = src + 3 * x;
+        __m128i a = _mm_loadu_si128((const __m128i *) s);
+        __m128i b = _mm_loadu_si128((const __m128i *) (s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *) (s + 32));
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_shuffle_epi8(a, spread));
+        _mm_storeu_si128((__m128i *) (dst + x + 4), _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), spread));
+        _mm_storeu_si128((__m128i *) (dst + x + 8), _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), spread));
+        _mm_storeu_si128((__m128i *) (dst + x + 12), _mm_shuffle_epi8(_mm_srli_si128(c, 4), spread));
+    }
+    decode_row_scalar(src + 3 * x, dst + x, n - x);
+}
+
+__attribute__((target("ssse3")))
+static void encode_row_ssse3(const int *src, byte *dst, int n)
+{
+    const __m128i pack = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i p0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + x)), pack);
+        __m128i p1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + x + 4)), pack);
+        __m128i p2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + x + 8)), pack);
+        __m128i p3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (src + x + 12)), pack);
+        byte *d = dst + 3 * x;
+        _mm_storeu_si128((__m128i *) d, _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+        _mm_storeu_si128((__m128i *) (d + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+        _mm_storeu_si128((__m128i *) (d + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+    }
+    encode_row_scalar(src + x, dst + 3 * x, n - x);
+}
+
+// 8 pixels at a time, four per 128-bit lane. The high lane is loaded
+// from byte 8 rather than 12 so that the loads end exactly at the
+// 24th byte.
+__attribute__((target("avx2")))
+static void decode_row_avx2(const byte *src, int *dst, int n)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+                                            4, 5, 6, -1, 7, 8, 9, -1, 10, 11, 12, -1, 13, 14, 15, -1);
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        const byte *s = src + 3 * x;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) s)),
+                                            _mm_loadu_si128((const __m128i *) (s + 8)), 1);
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_shuffle_epi8(v, spread));
+    }
+    // gcc makes this call a jump without a vzeroupper first, and dirty
+    // upper halves slow down every SSE instruction that runs after it
+    _mm256_zeroupper();
+    decode_row_scalar(src + 3 * x, dst + x, n - x);
+}
+
+// Each lane packs its four pixels into 12 bytes, a permute closes the
+// gap between the lanes, and the 24 bytes go out as 16 + 8
+__attribute__((target("avx2")))
+static void encode_row_avx2(const int *src, byte *dst, int n)
+{
+    const __m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                          0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256i join = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int x = 0;
+
+    for (; x + 8 <= n; x += 8)
+    {
+        __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) (src + x)), pack);
+        p = _mm256_permutevar8x32_epi32(p, join);
+        byte *d = dst + 3 * x;
+        _mm_storeu_si128((__m128i *) d, _mm256_castsi256_si128(p));
+        _mm_storel_epi64((__m128i *) (d + 16), _mm256_extracti128_si256(p, 1));
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    encode_row_scalar(src + x, dst + 3 * x, n - x);
+}
+
+#endif
+
+void decode_row(const byte *src, int *dst, int n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() == SIMD_AVX2)
+    {
+        decode_row_avx2(src, dst, n);
+        return;
+    }
+    if (simd_ssse3())
+    {
+        decode_row_ssse3(src, dst, n);
+        return;
+    }
+#endif
+    decode_row_scalar(src, dst, n);
+}
+
+void encode_row(const int *src, byte *dst, int n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() == SIMD_AVX2)
+    {
+        encode_row_avx2(src, dst, n);
+        return;
+    }
+    if (simd_ssse3())
+    {
+        encode_row_ssse3(src, dst, n);
+        return;
+    }
+#endif
+    encode_row_scalar(src, dst, n);
+}
+
+void bitmap_set_layout(struct bitmap *bmp, int layout)
+{
+    if (bmp->layout == layout)
+    {
+        return;
+    }
+
+    long n = (long) bmp->width * bmp->height;
+    if (layout == LAYOUT_BGR24)
+    {
+        byte *bgr = (byte *) bitmap_new_buffer(bmp, n * 3);
+        for (int y = 0; y < bmp->height; ++y)
+        {
+            encode_row(bmp->pixels + (long) y * bmp->width, bgr + (long) y * bmp->width * 3, bmp->width);
+        }
+        bmp->layout = layout;
+        bitmap_replace_buffer(bmp, bgr);
+    }
+    else
+    {
+        int *pixels = (int *) bitmap_new_buffer(bmp, n * sizeof(int));
+        for (int y = 0; y < bmp->height; ++y)
+        {
+            decode_row(bmp->bgr + (long) y * bmp->width * 3, pixels + (long) y * bmp->width, bmp->width);
+        }
+        bmp->layout = layout;
+        bitmap_replace_buffer(bmp, pixels);
+    }
+}
+
+// Size of a bitmap's pixels in memory
+static long bitmap_bytes(const struct bitmap *bmp)
+{
+    return (long) bmp->width * bmp->height * (bmp->layout == LAYOUT_BGR24 ? 3 : sizeof(int));
+}
+
+void bitmap_free(struct bitmap *bmp)
+{
+    if (bmp->arena == NULL)
+    {
+        free(bmp->pixels);
+        free(bmp->bgr);
+    }
+    free(bmp->pending);
+    free(bmp->dirty);
+    bmp->pixels = NULL;
+    bmp->bgr = NULL;
+    bmp->pending = NULL;
+    bmp->dirty = NULL;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define MAX_TRACE_EVENTS 4096
+
+// One recorded stage. While it is open, mallocs and malloc_bytes hold
+// the counters at its start.
+struct trace_event
+{
+    char name[48];
+    int tid;
+    double start;
+    double duration;
+    long bytes;
+    long mallocs;
+    long malloc_bytes;
+};
+
+static struct
+{
+    int enabled;
+    const char *path;
+    double origin;
+    long mallocs;
+    long malloc_bytes;
+    int nevents;
+    int nthreads;
+    struct trace_event events[MAX_TRACE_EVENTS];
+} trace;
+
+// Small number naming the calling thread in the JSON, from 1 up
+static __thread int trace_tid;
+
+// Image buffers are too big to fall back on anything smaller, and the
+// ops that want them have no way to fail, so running out ends the run
+static void bitmap_out_of_memory(size_t size)
+{
+    printf("Error: Out of memory for %zu bytes\n", size);
+    fflush(stdout);
+    exit(1);
+}
+
+void *bitmap_malloc(size_t size)
+{
+    if (trace.enabled)
+    {
+        __atomic_fetch_add(&trace.mallocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&trace.malloc_bytes, (long) size, __ATOMIC_RELAXED);
+    }
+    void *p = malloc(size);
+    if (p == NULL && size > 0)
+    {
+        bitmap_out_of_memory(size);
+    }
+    return p;
+}
+
+void *bitmap_calloc(size_t n, size_t size)
+{
+    if (trace.enabled)
+    {
+        __atomic_fetch_add(&trace.mallocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&trace.malloc_bytes, (long) (n * size), __ATOMIC_RELAXED);
+    }
+    void *p = calloc(n, size);
+    if (p == NULL && n > 0 && size > 0)
+    {
+        bitmap_out_of_memory(n * size);
+    }
+    return p;
+}
+
+int trace_begin(const char *name)
+{
+    if (!trace.enabled)
+    {
+        return -1;
+    }
+
+    // Stages can begin on several threads at once (--batch)
+    int i = __atomic_fetch_add(&trace.nevents, 1, __ATOMIC_RELAXED);
+    if (i >= MAX_TRACE_EVENTS)
+    {
+        return -1;
+    }
+    if (trace_tid == 0)
+    {
+        trace_tid = __atomic_add_fetch(&trace.nthreads, 1, __ATOMIC_RELAXED);
+    }
+
+    struct trace_event *ev = &trace.events[i];
+    snprintf(ev->name, sizeof(ev->name), "%s", name);
+    ev->tid = trace_tid;
+    ev->mallocs = __atomic_load_n(&trace.mallocs, __ATOMIC_RELAXED);
+    ev->malloc_bytes = __atomic_load_n(&trace.malloc_bytes, __ATOMIC_RELAXED);
+    ev->bytes = 0;
+    ev->start = now_seconds();
+    return i;
+}
+
+void trace_end(int event, long bytes)
+{
+    if (event < 0)
+    {
+        return;
+    }
+
+    struct trace_event *ev = &trace.events[event];
+    ev->duration = now_seconds() - ev->start;
+    ev->bytes = bytes;
+    ev->mallocs = __atomic_load_n(&trace.mallocs, __ATOMIC_RELAXED) - ev->mallocs;
+    ev->malloc_bytes = __atomic_load_n(&trace.malloc_bytes, __ATOMIC_RELAXED) - ev->malloc_bytes;
+}
+
+// Prints the per-stage summary and writes the JSON file
+static void trace_finish(void)
+{
+    if (!trace.enabled)
+    {
+        return;
+    }
+    trace.enabled = 0;
+    if (trace.nevents > MAX_TRACE_EVENTS)
+    {
+        trace.nevents = MAX_TRACE_EVENTS;
+    }
+
+    fprintf(stderr, "%-24s %6s %12s %14s %10s %8s %12s\n",
+        "stage", "count", "total ms", "bytes", "MB/s", "mallocs", "malloc MB");
+    for (int i = 0; i < trace.nevents; ++i)
+    {
+        // Each name is summed up at its first appearance
+        int first = 1;
+        for (int j = 0; j < i && first; ++j)
+        {
+            first = strcmp(trace.events[i].name, trace.events[j].name) != 0;
+        }
+        if (!first)
+        {
+            continue;
+        }
+
+        int count = 0;
+        double seconds = 0;
+        long bytes = 0, mallocs = 0, malloc_bytes = 0;
+        for (int j = i; j < trace.nevents; ++j)
+        {
+            const struct trace_event *ev = &trace.events[j];
+            if (strcmp(ev->name, trace.events[i].name) == 0)
+            {
+                count++;
+                seconds += ev->duration;
+                bytes += ev->bytes;
+                mallocs += ev->mallocs;
+                malloc_bytes += ev->malloc_bytes;
+            }
+        }
+        fprintf(stderr, "%-24s %6d %12.3f %14ld %10.1f %8ld %12.2f\n", trace.events[i].name, count,
+            seconds * 1e3, bytes, seconds > 0 ? bytes / seconds / 1e6 : 0.0, mallocs, malloc_bytes / 1e6);
+    }
+
+    FILE *out = fopen(trace.path, "w");
+    if (out == NULL)
+    {
+        perror(trace.path);
+        return;
+    }
+    fprintf(out, "{\"traceEvents\": [\n");
+    for (int i = 0; i < trace.nevents; ++i)
+    {
+        const struct trace_event *ev = &trace.events[i];
+        fprintf(out, "  {\"name\": \"%s\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, "
+                     "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"bytes\": %ld, "
+                     "\"mallocs\": %ld, \"malloc_bytes\": %ld}}%s\n",
+            ev->name, (int) getpid(), ev->tid, (ev->start - trace.origin) * 1e6, ev->duration * 1e6,
+            ev->bytes, ev->mallocs, ev->malloc_bytes, i + 1 < trace.nevents ? "," : "");
+    }
+    fprintf(out, "]}\n");
+    fclose(out);
+}
+
+void trace_enable(const char *json_path)
+{
+    if (trace.path == NULL)
+    {
+        atexit(trace_finish);
+    }
+    trace.path = json_path;
+    trace.origin = now_seconds();
+    trace.enabled = 1;
+}
+
+// Worker threads for parallel_rows. They are started on first use and
+// then sleep on wake until the next job.
+static struct
+{
+    int nthreads;
+    int started;
+    pthread_t *workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    long generation;
+    int busy;
+    void (*fn)(void *ctx, int y0, int y1);
+    void *ctx;
+    int nrows;
+    int chunk;
+    int next_row;
+} pool = { 1, 0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, 0, 0, NULL, NULL, 0, 0, 0 };
+
+void set_thread_count(int n)
+{
+    if (n < 1)
+    {
+        n = 1;
+    }
+    // Workers are only started once, so this can't grow past them
+    if (pool.started && n > pool.started)
+    {
+        n = pool.started;
+    }
+    pool.nthreads = n;
+}
+
+// Takes chunks of rows off the current job until there are none left
+static void pool_run_chunks(void)
+{
+    for (;;)
+    {
+        int y0 = __atomic_fetch_add(&pool.next_row, pool.chunk, __ATOMIC_RELAXED);
+        if (y0 >= pool.nrows)
+        {
+            return;
+        }
+        int y1 = y0 + pool.chunk < pool.nrows ? y0 + pool.chunk : pool.nrows;
+        pool.fn(pool.ctx, y0, y1);
+    }
+}
+
+static void *pool_worker(void *arg)
+{
+    long seen = 0;
+    (void) arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;)
+    {
+        while (pool.generation == seen)
+        {
+            pthread_cond_wait(&pool.wake, &pool.lock);
+        }
+        seen = pool.generation;
+        pthread_mutex_unlock(&pool.lock);
+
+        pool_run_chunks();
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.busy == 0)
+        {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    return NULL;
+}
+
+void parallel_rows(int nrows, void (*fn)(void *ctx, int y0, int y1), void *ctx)
+{
+    // Not worth waking anyone up for a handful of rows
+    if (pool.nthreads <= 1 || nrows < 2 * pool.nthreads)
+    {
+        if (nrows > 0)
+        {
+            fn(ctx, 0, nrows);
+        }
+        return;
+    }
+
+    // Kernel dispatch is decided before the workers can race on it
+    simd_level();
+
+    pthread_mutex_lock(&pool.lock);
+    if (!pool.started)
+    {
+        pool.workers = (pthread_t *) malloc((pool.nthreads - 1) * sizeof(pthread_t));
+        for (int i = 0; i < pool.nthreads - 1; ++i)
+        {
+            pthread_create(&pool.workers[i], NULL, pool_worker, NULL);
+        }
+        pool.started = pool.nthreads;
+    }
+
+    // A few chunks per thread so uneven rows still balance out
+    int nworkers = pool.started - 1;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.nrows = nrows;
+    pool.chunk = (nrows + 4 * pool.nthreads - 1) / (4 * pool.nthreads);
+    pool.next_row = 0;
+    pool.busy = nworkers;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.lock);
+
+    // The calling thread does its share too
+    pool_run_chunks();
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.busy > 0)
+    {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// What a thread's scratch buffers are for. Each use gets its own, so
+// one can't clobber another that is live on the same thread.
+enum scratch_use
+{
+    SCRATCH_DOWNSAMPLE,
+    SCRATCH_RESIZE,
+    SCRATCH_REMAP,
+    SCRATCH_STATS,
+    NSCRATCH
+};
+
+// A thread's scratch buffers, kept between calls and only ever grown,
+// so that ops on images of a size seen before don't allocate. They are
+// freed when the thread exits.
+struct thread_scratch
+{
+    void *buffers[NSCRATCH];
+    size_t sizes[NSCRATCH];
+};
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+static void scratch_release(void *ptr)
+{
+    struct thread_scratch *scratch = (struct thread_scratch *) ptr;
+    for (int i = 0; i < NSCRATCH; ++i)
+    {
+        free(scratch->buffers[i]);
+    }
+    free(scratch);
+}
+
+static void scratch_key_create(void)
+{
+    pthread_key_create(&scratch_key, scratch_release);
+}
+
+// At least bytes bytes of the calling thread's scratch for use. The
+// contents are whatever the last call of the same use left there.
+static void *thread_scratch(int use, size_t bytes)
+{
+    pthread_once(&scratch_once, scratch_key_create);
+    struct thread_scratch *scratch = (struct thread_scratch *) pthread_getspecific(scratch_key);
+    if (scratch == NULL)
+    {
+        scratch = (struct thread_scratch *) bitmap_calloc(1, sizeof(struct thread_scratch));
+        pthread_setspecific(scratch_key, scratch);
+    }
+    if (scratch->sizes[use] < bytes)
+    {
+        free(scratch->buffers[use]);
+        scratch->buffers[use] = bitmap_malloc(bytes);
+        scratch->sizes[use] = bytes;
+    }
+    return scratch->buffers[use];
+}
+
+// The weights of each gray_mode, in 32768ths, and what is added to
+// the weighted sum before it is shifted down by 15. A third is
+// rounded up to 10923, which is still exact: (r+g+b)/3 for any sum up
+// to 765.
+struct gray_weights
+{
+    int blue;
+    int green;
+    int red;
+    int round;
+};
+
+static const struct gray_weights gray_weights[3] = {
+    { 10923, 10923, 10923, 0 },
+    { 3735, 19235, 9798, 1 << 14 },
+    { 2366, 23436, 6966, 1 << 14 },
+};
+
+static const int gray_ops[3] = { OP_GRAYSCALE, OP_GRAYSCALE_BT601, OP_GRAYSCALE_BT709 };
+
+// The weights of a grayscale op, or NULL if op isn't one
+static const struct gray_weights *gray_op_weights(int op)
+{
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        if (gray_ops[mode] == op)
+        {
+            return &gray_weights[mode];
+        }
+    }
+    return NULL;
+}
+
+// Grayscale value of a single pixel
+static int grayscale_pixel(const struct gray_weights *w, int p)
+{
+    int r;
+    int g;
+    int b;
+
+    pixel_to_rgb(p, &r, &g, &b);
+    int grayscale = (w->blue * b + w->green * g + w->red * r + w->round) >> 15;
+    int changed_pixel;
+    rgb_to_pixel(&changed_pixel, grayscale, grayscale, grayscale);
+    return changed_pixel;
+}
+
+// Posterized value of a single pixel
+static int posterize_pixel(int p)
+{
+    int r;
+    int g;
+    int b;
+
+    pixel_to_rgb(p, &r, &g, &b);
+
+    //Less than 32
+    if (r < 32)
+    {
+        r = 0;
+    }
+    else if (32 <= r && r <= 95)
+    {
+        r = 64;
+    }
+    else if (96 <= r && r <= 159)
+    {
+        r = 128;
+    }
+    else if (160 <= r && r <= 223)
+    {
+        r = 192;
+    }
+    else if (r >= 224)
+    {
+        r = 255;
+    }
+
+
+    if (g < 32)
+    {
+        g = 0;
+    }
+    else if (32 <= g && g <= 95)
+    {
+        g = 64;
+    }
+    else if (96 <= g && g <= 159)
+    {
+        g = 128;
+    }
+    else if (160 <= g && g <= 223)
+    {
+        g = 192;
+    }
+    else if (g >= 224)
+    {
+        g = 255;
+    }
+
+    
+    if (b < 32)
+    {
+        b = 0;
+    }
+    else if (32 <= b && b <= 95)
+    {
+        b = 64;
+    }
+    else if (96 <= b && b <= 159)
+    {
+        b = 128;
+    }
+    else if (160 <= b && b <= 223)
+    {
+        b = 192;
+    }
+    else if (b >= 255)
+    {
+        b = 255;
+    }
+
+    int changed_pixel;
+    rgb_to_pixel(&changed_pixel, r, g, b);
+    return changed_pixel;
+}
+
+// Whether a channel's lookup table is the buckets of size s, with
+// bytes from the top one kept as they are or saturated to 255
+static int posterize_is_buckets(const byte *lut, int s, int keep_top)
+{
+    int half = s / 2;
+    int top = half > 0 ? 256 - half : 255;
+    for (int v = 0; v < 256; ++v)
+    {
+        int want = v >= top ? (keep_top ? v : 255) : (v + half) & ~(s - 1);
+        if (lut[v] != want)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Works out the buckets form of a posterize, if it has one
+static void posterize_table_compile_buckets(struct posterize_table *t)
+{
+    int top[3], add[3], mask[3], saturate[3];
+
+    t->buckets = 0;
+    for (int c = 0; c < 3; ++c)
+    {
+        int found = 0;
+        for (int s = 1; s <= 256 && !found; s *= 2)
+        {
+            for (int keep_top = 0; keep_top < 2 && !found; ++keep_top)
+            {
+                found = posterize_is_buckets(t->lut[c], s, keep_top);
+                add[c] = s / 2;
+                top[c] = s > 1 ? 256 - s / 2 : 255;
+                mask[c] = ~(s - 1) & 0xff;
+                saturate[c] = keep_top ? 0 : 0xff;
+            }
+        }
+        if (!found)
+        {
+            return;
+        }
+    }
+
+    t->buckets = 1;
+    t->int_top = (top[2] << 16) | (top[1] << 8) | top[0];
+    t->int_add = (add[2] << 16) | (add[1] << 8) | add[0];
+    t->int_mask = (mask[2] << 16) | (mask[1] << 8) | mask[0];
+    t->int_saturate = (saturate[2] << 16) | (saturate[1] << 8) | saturate[0];
+    for (int i = 0; i < 48; ++i)
+    {
+        t->bgr_top[i] = top[i % 3];
+        t->bgr_add[i] = add[i % 3];
+        t->bgr_mask[i] = mask[i % 3];
+        t->bgr_saturate[i] = saturate[i % 3];
+    }
+}
+
+// Works out the nibble rows of a posterize whose channels share one
+// table. Row 8 k + i holds entries 128 k + 16 i up to 128 k + 16 i + 15,
+// XORed with those of the row before it in the same half.
+static void posterize_table_compile_nibbles(struct posterize_table *t)
+{
+    t->shared = memcmp(t->lut[0], t->lut[1], 256) == 0 && memcmp(t->lut[0], t->lut[2], 256) == 0;
+    for (int row = 0; row < 16; ++row)
+    {
+        for (int low = 0; low < 16; ++low)
+        {
+            int previous = row % 8 > 0 ? t->lut[0][16 * (row - 1) + low] : 0;
+            t->nibbles[row][low] = t->lut[0][16 * row + low] ^ previous;
+        }
+    }
+}
+
+// Works out the buckets, nibble and step forms of a posterize from its
+// lookup tables
+static void posterize_table_compile(struct posterize_table *t)
+{
+    int at[3][POSTERIZE_MAX_STEPS];
+    int count[3] = { 0, 0, 0 };
+
+    posterize_table_compile_buckets(t);
+    posterize_table_compile_nibbles(t);
+
+    t->nsteps = 0;
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int v = 1; v < 256; ++v)
+        {
+            if (t->lut[c][v] == t->lut[c][v - 1])
+            {
+                continue;
+            }
+            if (count[c] == POSTERIZE_MAX_STEPS)
+            {
+                t->nsteps = -1;
+                return;
+            }
+            at[c][count[c]++] = v;
+        }
+        if (count[c] > t->nsteps)
+        {
+            t->nsteps = count[c];
+        }
+    }
+
+    for (int s = -1; s < t->nsteps; ++s)
+    {
+        int step_at[3];
+        int step_value[3];
+        for (int c = 0; c < 3; ++c)
+        {
+            int k = s < count[c] ? s : count[c] - 1;
+            step_at[c] = k >= 0 ? at[c][k] : 0;
+            step_value[c] = t->lut[c][step_at[c]];
+        }
+
+        t->int_value[s + 1] = (step_value[2] << 16) | (step_value[1] << 8) | step_value[0];
+        for (int i = 0; i < 48; ++i)
+        {
+            t->bgr_value[s + 1][i] = step_value[i % 3];
+        }
+        if (s >= 0)
+        {
+            t->int_at[s] = (step_at[2] << 16) | (step_at[1] << 8) | step_at[0];
+            for (int i = 0; i < 48; ++i)
+            {
+                t->bgr_at[s][i] = step_at[i % 3];
+            }
+        }
+    }
+}
+
+// Fills one channel's lookup table, without compiling the steps
+static int posterize_table_channel(struct posterize_table *t, int channel, int n,
+                                   const int *thresholds, const int *values)
+{
+    if (channel < CHANNEL_BLUE || channel > CHANNEL_RED || n < 2 || n > 256)
+    {
+        printf("Error: A posterize needs 2 to 256 levels per channel\n");
+        return -1;
+    }
+    for (int i = 0; i < n - 1; ++i)
+    {
+        int previous = i > 0 ? thresholds[i - 1] : 0;
+        if (thresholds[i] <= previous || thresholds[i] > 255)
+        {
+            printf("Error: Posterize thresholds must increase from 1 to 255\n");
+            return -1;
+        }
+    }
+    for (int i = 0; i < n && values != NULL; ++i)
+    {
+        if (values[i] < 0 || values[i] > 255)
+        {
+            printf("Error: Posterize values must be from 0 to 255\n");
+            return -1;
+        }
+    }
+
+    int level = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        while (level < n - 1 && v >= thresholds[level])
+        {
+            ++level;
+        }
+
+        int value = values != NULL ? values[level] : level * 256 / (n - 1);
+        t->lut[channel][v] = value > 255 ? 255 : value;
+    }
+    return 0;
+}
+
+int posterize_table_thresholds(struct posterize_table *t, int channel, int n,
+                               const int *thresholds, const int *values)
+{
+    if (posterize_table_channel(t, channel, n, thresholds, values) == -1)
+    {
+        return -1;
+    }
+    posterize_table_compile(t);
+    return 0;
+}
+
+int posterize_table_levels(struct posterize_table *t, int red, int green, int blue)
+{
+    int levels[3] = { blue, green, red };
+
+    for (int c = 0; c < 3; ++c)
+    {
+        // Byte v is nearest to level (v * (n - 1) + 127) / 255, which
+        // starts at the thresholds below
+        int n = levels[c];
+        int thresholds[255];
+        for (int i = 0; i < n - 1 && n <= 256; ++i)
+        {
+            thresholds[i] = ((i + 1) * 255 - 127 + n - 2) / (n - 1);
+        }
+        if (posterize_table_channel(t, c, n, thresholds, NULL) == -1)
+        {
+            return -1;
+        }
+    }
+    posterize_table_compile(t);
+    return 0;
+}
+
+// A compiled copy of posterize_pixel, blue quirk included, for the
+// scalar kernels. Built once, on first use.
+static struct posterize_table posterize_legacy_table;
+static pthread_once_t posterize_legacy_once = PTHREAD_ONCE_INIT;
+
+static void posterize_legacy_build(void)
+{
+    for (int c = 0; c < 3; ++c)
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            posterize_legacy_table.lut[c][v] = (posterize_pixel(v << (8 * c)) >> (8 * c)) & 0xff;
+        }
+    }
+    posterize_table_compile(&posterize_legacy_table);
+}
+
+static const struct posterize_table *posterize_legacy(void)
+{
+    pthread_once(&posterize_legacy_once, posterize_legacy_build);
+    return &posterize_legacy_table;
+}
+
+// A posterize by table lookups, one byte at a time
+static void posterize_table_span_scalar(const struct posterize_table *t, int *px, long n)
+{
+    for (long i = 0; i < n; ++i)
+    {
+        int p = px[i];
+        px[i] = (t->lut[CHANNEL_RED][(p >> 16) & 0xff] << 16)
+              | (t->lut[CHANNEL_GREEN][(p >> 8) & 0xff] << 8)
+              | t->lut[CHANNEL_BLUE][p & 0xff];
+    }
+}
+
+static void bgr24_posterize_table_span_scalar(const struct posterize_table *t, byte *p, long n)
+{
+    for (long i = 0; i < n; ++i, p += 3)
+    {
+        p[0] = t->lut[CHANNEL_BLUE][p[0]];
+        p[1] = t->lut[CHANNEL_GREEN][p[1]];
+        p[2] = t->lut[CHANNEL_RED][p[2]];
+    }
+}
+
+// Grayscale on a run of n pixels, one pixel at a time. This is the
+// reference the vector kernels must match exactly (posterize has its
+// own in posterize_table_span_scalar, on a table built from
+// posterize_pixel).
+static void grayscale_span_scalar(const struct gray_weights *w, int *px, long n)
+{
+    for (long i = 0; i < n; ++i)
+    {
+        px[i] = grayscale_pixel(w, px[i]);
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// Grayscale of four pixels at once. Blue and red are the two 16-bit
+// halves of p & 0x00ff00ff, and green the low half of the same mask a
+// byte further up, so two multiply-adds with blue_red = red << 16 |
+// blue and green give each pixel's weighted sum, with no division.
+static inline __m128i grayscale_sse2(__m128i p, __m128i blue_red, __m128i green, __m128i round)
+{
+    const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+    __m128i sum = _mm_add_epi32(_mm_madd_epi16(_mm_and_si128(p, mask), blue_red),
+        _mm_madd_epi16(_mm_and_si128(_mm_srli_epi32(p, 8), mask), green));
+    __m128i gray = _mm_srli_epi32(_mm_add_epi32(sum, round), 15);
+    return _mm_or_si128(gray, _mm_or_si128(_mm_slli_epi32(gray, 8), _mm_slli_epi32(gray, 16)));
+}
+
+// The same for eight pixels whose channels are the 16-bit lanes of b,
+// g and r, giving their grays as 16-bit lanes
+static inline __m128i grayscale_lanes_sse2(__m128i b, __m128i g, __m128i r,
+                                           __m128i blue_red, __m128i green, __m128i round)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(b, r), blue_red),
+                               _mm_madd_epi16(_mm_unpacklo_epi16(g, zero), green));
+    __m128i hi = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(b, r), blue_red),
+                               _mm_madd_epi16(_mm_unpackhi_epi16(g, zero), green));
+    lo = _mm_srli_epi32(_mm_add_epi32(lo, round), 15);
+    hi = _mm_srli_epi32(_mm_add_epi32(hi, round), 15);
+    return _mm_packs_epi32(lo, hi);
+}
+
+static void grayscale_span_sse2(const struct gray_weights *w, int *px, long n)
+{
+    const __m128i blue_red = _mm_set1_epi32((w->red << 16) | w->blue);
+    const __m128i green = _mm_set1_epi32(w->green);
+    const __m128i round = _mm_set1_epi32(w->round);
+    long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i p = _mm_loadu_si128((__m128i *) (px + i));
+        _mm_storeu_si128((__m128i *) (px + i), grayscale_sse2(p, blue_red, green, round));
+    }
+    grayscale_span_scalar(w, px + i, n - i);
+}
+
+// Same kernels, eight pixels at a time
+__attribute__((target("avx2")))
+static void grayscale_span_avx2(const struct gray_weights *w, int *px, long n)
+{
+    const __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    const __m256i blue_red = _mm256_set1_epi32((w->red << 16) | w->blue);
+    const __m256i green = _mm256_set1_epi32(w->green);
+    const __m256i round = _mm256_set1_epi32(w->round);
+    long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i p = _mm256_loadu_si256((__m256i *) (px + i));
+        __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(_mm256_and_si256(p, mask), blue_red),
+            _mm256_madd_epi16(_mm256_and_si256(_mm256_srli_epi32(p, 8), mask), green));
+        __m256i gray = _mm256_srli_epi32(_mm256_add_epi32(sum, round), 15);
+        gray = _mm256_or_si256(gray, _mm256_or_si256(_mm256_slli_epi32(gray, 8), _mm256_slli_epi32(gray, 16)));
+        _mm256_storeu_si256((__m256i *) (px + i), gray);
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    grayscale_span_scalar(w, px + i, n - i);
+}
+
+#endif
+
+static int simd_selected = -1;
+static int simd_ssse3_selected = -1;
+
+int simd_level(void)
+{
+    if (simd_selected != -1)
+    {
+        return simd_selected;
+    }
+
+    int level = SIMD_SCALAR;
+    int ssse3 = 0;
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    level = SIMD_SSE2;
+    ssse3 = __builtin_cpu_supports("ssse3") ? 1 : 0;
+    if (__builtin_cpu_supports("avx2"))
+    {
+        level = SIMD_AVX2;
+    }
+#endif
+
+    char *forced = getenv("PROJECT2_SIMD");
+    if (forced != NULL)
+    {
+        if (strcmp(forced, "scalar") == 0)
+        {
+            level = SIMD_SCALAR;
+        }
+        else if ((strcmp(forced, "sse2") == 0 || strcmp(forced, "ssse3") == 0) && level > SIMD_SSE2)
+        {
+            level = SIMD_SSE2;
+        }
+        if (strcmp(forced, "sse2") == 0)
+        {
+            ssse3 = 0;
+        }
+    }
+
+    simd_ssse3_selected = ssse3 && level != SIMD_SCALAR;
+    simd_selected = level;
+    return level;
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+static int simd_ssse3(void)
+{
+    simd_level();
+    return simd_ssse3_selected;
+}
+
+#endif
+
+// Per-pixel ops applied to a run of n pixels, using the best kernel
+// for this CPU
+static void grayscale_span(const struct gray_weights *w, int *px, long n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    int level = simd_level();
+    if (level == SIMD_AVX2)
+    {
+        grayscale_span_avx2(w, px, n);
+        return;
+    }
+    else if (level == SIMD_SSE2)
+    {
+        grayscale_span_sse2(w, px, n);
+        return;
+    }
+#endif
+    grayscale_span_scalar(w, px, n);
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// One step of a compiled posterize on every byte at once: the bytes
+// that are at least at take the step's value.
+static inline __m128i posterize_step_sse2(__m128i v, __m128i out, __m128i at, __m128i value)
+{
+    __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, at), v);
+    return _mm_or_si128(_mm_and_si128(above, value), _mm_andnot_si128(above, out));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i posterize_step_avx2(__m256i v, __m256i out, __m256i at, __m256i value)
+{
+    return _mm256_blendv_epi8(out, value, _mm256_cmpeq_epi8(_mm256_max_epu8(v, at), v));
+}
+
+static void posterize_table_span_sse2(const struct posterize_table *t, int *px, long n)
+{
+    __m128i at[POSTERIZE_MAX_STEPS];
+    __m128i value[POSTERIZE_MAX_STEPS + 1];
+    value[0] = _mm_set1_epi32(t->int_value[0]);
+    for (int s = 0; s < t->nsteps; ++s)
+    {
+        at[s] = _mm_set1_epi32(t->int_at[s]);
+        value[s + 1] = _mm_set1_epi32(t->int_value[s + 1]);
+    }
+
+    long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((__m128i *) (px + i));
+        __m128i out = value[0];
+        for (int s = 0; s < t->nsteps; ++s)
+        {
+            out = posterize_step_sse2(v, out, at[s], value[s + 1]);
+        }
+        _mm_storeu_si128((__m128i *) (px + i), out);
+    }
+    posterize_table_span_scalar(t, px + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void posterize_table_span_avx2(const struct posterize_table *t, int *px, long n)
+{
+    __m256i at[POSTERIZE_MAX_STEPS];
+    __m256i value[POSTERIZE_MAX_STEPS + 1];
+    value[0] = _mm256_set1_epi32(t->int_value[0]);
+    for (int s = 0; s < t->nsteps; ++s)
+    {
+        at[s] = _mm256_set1_epi32(t->int_at[s]);
+        value[s + 1] = _mm256_set1_epi32(t->int_value[s + 1]);
+    }
+
+    long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i *) (px + i));
+        __m256i out = value[0];
+        for (int s = 0; s < t->nsteps; ++s)
+        {
+            out = posterize_step_avx2(v, out, at[s], value[s + 1]);
+        }
+        _mm256_storeu_si256((__m256i *) (px + i), out);
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    posterize_table_span_scalar(t, px + i, n - i);
+}
+
+// 16 or 32 BGR24 pixels (three vectors) at a time, with the steps
+// loaded at offset k % 3 to line up with a vector starting at byte k
+static void bgr24_posterize_table_span_sse2(const struct posterize_table *t, byte *p, long n)
+{
+    long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128i *q = (__m128i *) (p + 3 * i + 16 * k);
+            int offset = 16 * k % 3;
+            __m128i v = _mm_loadu_si128(q);
+            __m128i out = _mm_loadu_si128((const __m128i *) (t->bgr_value[0] + offset));
+            for (int s = 0; s < t->nsteps; ++s)
+            {
+                out = posterize_step_sse2(v, out, _mm_loadu_si128((const __m128i *) (t->bgr_at[s] + offset)),
+                                          _mm_loadu_si128((const __m128i *) (t->bgr_value[s + 1] + offset)));
+            }
+            _mm_storeu_si128(q, out);
+        }
+    }
+    bgr24_posterize_table_span_scalar(t, p + 3 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bgr24_posterize_table_span_avx2(const struct posterize_table *t, byte *p, long n)
+{
+    long i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            __m256i *q = (__m256i *) (p + 3 * i + 32 * k);
+            int offset = 32 * k % 3;
+            __m256i v = _mm256_loadu_si256(q);
+            __m256i out = _mm256_loadu_si256((const __m256i *) (t->bgr_value[0] + offset));
+            for (int s = 0; s < t->nsteps; ++s)
+            {
+                out = posterize_step_avx2(v, out, _mm256_loadu_si256((const __m256i *) (t->bgr_at[s] + offset)),
+                                          _mm256_loadu_si256((const __m256i *) (t->bgr_value[s + 1] + offset)));
+            }
+            _mm256_storeu_si256(q, out);
+        }
+    }
+    bgr24_posterize_table_span_scalar(t, p + 3 * i, n - i);
+}
+
+// The buckets form on every byte at once
+static inline __m128i posterize_buckets_sse2(__m128i v, __m128i top, __m128i add, __m128i mask, __m128i saturate)
+{
+    __m128i above = _mm_cmpeq_epi8(_mm_max_epu8(v, top), v);
+    __m128i low = _mm_and_si128(_mm_add_epi8(v, add), mask);
+    __m128i high = _mm_or_si128(v, saturate);
+    return _mm_or_si128(_mm_and_si128(above, high), _mm_andnot_si128(above, low));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i posterize_buckets_avx2(__m256i v, __m256i top, __m256i add, __m256i mask, __m256i saturate)
+{
+    __m256i above = _mm256_cmpeq_epi8(_mm256_max_epu8(v, top), v);
+    __m256i low = _mm256_and_si256(_mm256_add_epi8(v, add), mask);
+    return _mm256_blendv_epi8(low, _mm256_or_si256(v, saturate), above);
+}
+
+static void posterize_buckets_span_sse2(const struct posterize_table *t, int *px, long n)
+{
+    const __m128i top = _mm_set1_epi32(t->int_top);
+    const __m128i add = _mm_set1_epi32(t->int_add);
+    const __m128i mask = _mm_set1_epi32(t->int_mask);
+    const __m128i saturate = _mm_set1_epi32(t->int_saturate);
+    long i = 0;
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128((__m128i *) (px + i));
+        v = posterize_buckets_sse2(v, top, add, mask, saturate);
+        _mm_storeu_si128((__m128i *) (px + i), _mm_and_si128(v, _mm_set1_epi32(0x00ffffff)));
+    }
+    posterize_table_span_scalar(t, px + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void posterize_buckets_span_avx2(const struct posterize_table *t, int *px, long n)
+{
+    const __m256i top = _mm256_set1_epi32(t->int_top);
+    const __m256i add = _mm256_set1_epi32(t->int_add);
+    const __m256i mask = _mm256_set1_epi32(t->int_mask);
+    const __m256i saturate = _mm256_set1_epi32(t->int_saturate);
+    long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = _mm256_loadu_si256((__m256i *) (px + i));
+        v = posterize_buckets_avx2(v, top, add, mask, saturate);
+        _mm256_storeu_si256((__m256i *) (px + i), _mm256_and_si256(v, _mm256_set1_epi32(0x00ffffff)));
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    posterize_table_span_scalar(t, px + i, n - i);
+}
+
+static void bgr24_posterize_buckets_span_sse2(const struct posterize_table *t, byte *p, long n)
+{
+    long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            __m128i *q = (__m128i *) (p + 3 * i + 16 * k);
+            int offset = 16 * k % 3;
+            __m128i v = posterize_buckets_sse2(_mm_loadu_si128(q),
+                                               _mm_loadu_si128((const __m128i *) (t->bgr_top + offset)),
+                                               _mm_loadu_si128((const __m128i *) (t->bgr_add + offset)),
+                                               _mm_loadu_si128((const __m128i *) (t->bgr_mask + offset)),
+                                               _mm_loadu_si128((const __m128i *) (t->bgr_saturate + offset)));
+            _mm_storeu_si128(q, v);
+        }
+    }
+    bgr24_posterize_table_span_scalar(t, p + 3 * i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bgr24_posterize_buckets_span_avx2(const struct posterize_table *t, byte *p, long n)
+{
+    long i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        for (int k = 0; k < 3; ++k)
+        {
+            __m256i *q = (__m256i *) (p + 3 * i + 32 * k);
+            int offset = 32 * k % 3;
+            __m256i v = posterize_buckets_avx2(_mm256_loadu_si256(q),
+                                               _mm256_loadu_si256((const __m256i *) (t->bgr_top + offset)),
+                                               _mm256_loadu_si256((const __m256i *) (t->bgr_add + offset)),
+                                               _mm256_loadu_si256((const __m256i *) (t->bgr_mask + offset)),
+                                               _mm256_loadu_si256((const __m256i *) (t->bgr_saturate + offset)));
+            _mm256_storeu_si256(q, v);
+        }
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    bgr24_posterize_table_span_scalar(t, p + 3 * i, n - i);
+}
+
+// A full 256-entry lookup on every byte at once, for a table all three
+// channels share. vpshufb looks up 16 entries by the low nibble and
+// gives 0 where the index has its top bit set. With the top bit of
+// each byte put aside, x - 16 i keeps it clear just where the high
+// nibble is at least i, so XORing in rows 0 to 7 leaves the XOR chain
+// up to the byte's own row: its entry. Rows 8 to 15 do the same for
+// the bytes from 128 up. (With 16-byte pshufb this takes longer than
+// the scalar lookups, so there is no SSSE3 version.)
+__attribute__((target("avx2")))
+static inline __m256i posterize_nibbles_avx2(__m256i v, const __m256i *rows)
+{
+    __m256i x = _mm256_and_si256(v, _mm256_set1_epi8(0x7f));
+    __m256i low = _mm256_setzero_si256();
+    __m256i high = _mm256_setzero_si256();
+    for (int i = 0; i < 8; ++i)
+    {
+        low = _mm256_xor_si256(low, _mm256_shuffle_epi8(rows[i], x));
+        high = _mm256_xor_si256(high, _mm256_shuffle_epi8(rows[8 + i], x));
+        x = _mm256_sub_epi8(x, _mm256_set1_epi8(16));
+    }
+    return _mm256_blendv_epi8(low, high, v);
+}
+
+// The int layout runs the lookup on the unused top byte too, and then
+// clears it. BGR24 has no such byte, so it is just a run of 3 n bytes.
+__attribute__((target("avx2")))
+static void posterize_nibbles_span_avx2(const struct posterize_table *t, int *px, long n)
+{
+    __m256i rows[16];
+    for (int r = 0; r < 16; ++r)
+    {
+        rows[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->nibbles[r]));
+    }
+
+    long i = 0;
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i v = posterize_nibbles_avx2(_mm256_loadu_si256((__m256i *) (px + i)), rows);
+        _mm256_storeu_si256((__m256i *) (px + i), _mm256_and_si256(v, _mm256_set1_epi32(0x00ffffff)));
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    posterize_table_span_scalar(t, px + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void bgr24_posterize_nibbles_span_avx2(const struct posterize_table *t, byte *p, long n)
+{
+    __m256i rows[16];
+    for (int r = 0; r < 16; ++r)
+    {
+        rows[r] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *) t->nibbles[r]));
+    }
+
+    long bytes = 3 * n;
+    long i = 0;
+    for (; i + 32 <= bytes; i += 32)
+    {
+        _mm256_storeu_si256((__m256i *) (p + i), posterize_nibbles_avx2(_mm256_loadu_si256((__m256i *) (p + i)), rows));
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    for (; i < bytes; ++i)
+    {
+        p[i] = t->lut[0][p[i]];
+    }
+}
+
+#endif
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// The most steps for which the step kernels beat the nibble lookups on
+// AVX2, and the scalar lookups on SSE2
+#define POSTERIZE_SSE2_STEPS 4
+#define POSTERIZE_AVX2_STEPS 8
+
+// Which kernel suits a compiled posterize on this CPU: the buckets
+// form if it has one, then steps while they are few, then (on AVX2)
+// the nibble lookups for a shared table. Anything else stays on the
+// scalar lookups.
+enum posterize_kernel
+{
+    POSTERIZE_SCALAR,
+    POSTERIZE_BUCKETS,
+    POSTERIZE_STEPS,
+    POSTERIZE_NIBBLES
+};
+
+static int posterize_kernel(const struct posterize_table *t, int level)
+{
+    if (level == SIMD_SCALAR)
+    {
+        return POSTERIZE_SCALAR;
+    }
+    int max_steps = level == SIMD_AVX2 ? POSTERIZE_AVX2_STEPS : POSTERIZE_SSE2_STEPS;
+    if (t->buckets)
+    {
+        return POSTERIZE_BUCKETS;
+    }
+    if (t->nsteps >= 0 && t->nsteps <= max_steps)
+    {
+        return POSTERIZE_STEPS;
+    }
+    if (t->shared && level == SIMD_AVX2)
+    {
+        return POSTERIZE_NIBBLES;
+    }
+    return POSTERIZE_SCALAR;
+}
+
+#endif
+
+// A compiled posterize on a run of n pixels, using the best kernel for
+// the table and this CPU
+static void posterize_table_span(const struct posterize_table *t, int *px, long n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    int level = simd_level();
+    int kernel = posterize_kernel(t, level);
+    if (kernel == POSTERIZE_BUCKETS && level == SIMD_AVX2)
+    {
+        posterize_buckets_span_avx2(t, px, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_BUCKETS)
+    {
+        posterize_buckets_span_sse2(t, px, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_STEPS && level == SIMD_AVX2)
+    {
+        posterize_table_span_avx2(t, px, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_STEPS)
+    {
+        posterize_table_span_sse2(t, px, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_NIBBLES)
+    {
+        posterize_nibbles_span_avx2(t, px, n);
+        return;
+    }
+#endif
+    posterize_table_span_scalar(t, px, n);
+}
+
+static void bgr24_posterize_table_span(const struct posterize_table *t, byte *p, long n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    int level = simd_level();
+    int kernel = posterize_kernel(t, level);
+    if (kernel == POSTERIZE_BUCKETS && level == SIMD_AVX2)
+    {
+        bgr24_posterize_buckets_span_avx2(t, p, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_BUCKETS)
+    {
+        bgr24_posterize_buckets_span_sse2(t, p, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_STEPS && level == SIMD_AVX2)
+    {
+        bgr24_posterize_table_span_avx2(t, p, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_STEPS)
+    {
+        bgr24_posterize_table_span_sse2(t, p, n);
+        return;
+    }
+    else if (kernel == POSTERIZE_NIBBLES)
+    {
+        bgr24_posterize_nibbles_span_avx2(t, p, n);
+        return;
+    }
+#endif
+    bgr24_posterize_table_span_scalar(t, p, n);
+}
+
+// bitmap_posterize's buckets on a run of n pixels
+static void posterize_span(int *px, long n)
+{
+    posterize_table_span(posterize_legacy(), px, n);
+}
+
+// The ops on LAYOUT_BGR24 bitmaps, defined further down next to the
+// remap helpers they share with the pipeline
+static void bgr24_point(struct bitmap *bmp, int op);
+static void bgr24_point_span(int op, byte *p, long n);
+static void bgr24_remap(struct bitmap *bmp, const struct remap_stage *st);
+
+// The lazy mode hooks, defined after the pipeline whose passes they
+// reuse. bitmap_defer adds a remap to a lazy bitmap's pending pass
+// (returning 0 if bmp isn't lazy), and bitmap_defer_point makes the
+// fill of any pending skew see a per-pixel op.
+static int bitmap_defer(struct bitmap *bmp, const struct remap_stage *st);
+static void bitmap_defer_point(struct bitmap *bmp, int op, const struct posterize_table *t);
+
+// What a range of rows needs to know to produce its part of an
+// operation's result
+struct rows_job
+{
+    struct bitmap *bmp;
+    int *new_pixels;
+    int new_width;
+};
+
+struct grayscale_job
+{
+    struct bitmap *bmp;
+    const struct gray_weights *w;
+};
+
+static void grayscale_rows(void *ctx, int y0, int y1)
+{
+    struct grayscale_job *job = (struct grayscale_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    grayscale_span(job->w, bmp->pixels + (long) y0 * bmp->width, (long) (y1 - y0) * bmp->width);
+}
+
+static void posterize_rows(void *ctx, int y0, int y1)
+{
+    struct bitmap *bmp = ((struct rows_job *) ctx)->bmp;
+    posterize_span(bmp->pixels + (long) y0 * bmp->width, (long) (y1 - y0) * bmp->width);
+}
+
+void bitmap_to_grayscale(struct bitmap *bmp)
+{
+    bitmap_to_grayscale_mode(bmp, GRAY_AVERAGE);
+}
+
+void bitmap_to_grayscale_mode(struct bitmap *bmp, int mode)
+{
+    int op = gray_ops[mode];
+    bitmap_defer_point(bmp, op, NULL);
+    bitmap_mark_dirty(bmp, 0, bmp->height);
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_point(bmp, op);
+        return;
+    }
+    struct grayscale_job job = { bmp, &gray_weights[mode] };
+    parallel_rows(bmp->height, grayscale_rows, &job);
+}
+
+void bitmap_posterize(struct bitmap *bmp)
+{
+    bitmap_defer_point(bmp, OP_POSTERIZE, NULL);
+    bitmap_mark_dirty(bmp, 0, bmp->height);
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_point(bmp, OP_POSTERIZE);
+        return;
+    }
+    struct rows_job job = { bmp, NULL, 0 };
+    parallel_rows(bmp->height, posterize_rows, &job);
+}
+
+struct posterize_job
+{
+    struct bitmap *bmp;
+    const struct posterize_table *t;
+};
+
+static void posterize_table_rows(void *ctx, int y0, int y1)
+{
+    struct posterize_job *job = (struct posterize_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    long n = (long) (y1 - y0) * bmp->width;
+
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_posterize_table_span(job->t, bmp->bgr + (long) y0 * bmp->width * 3, n);
+    }
+    else
+    {
+        posterize_table_span(job->t, bmp->pixels + (long) y0 * bmp->width, n);
+    }
+}
+
+void bitmap_posterize_table(struct bitmap *bmp, const struct posterize_table *t)
+{
+    bitmap_defer_point(bmp, OP_POSTERIZE, t);
+    bitmap_mark_dirty(bmp, 0, bmp->height);
+    struct posterize_job job = { bmp, t };
+    parallel_rows(bmp->height, posterize_table_rows, &job);
+}
+
+// A per-pixel op on a rectangle: op, or the posterize t if it isn't
+// NULL. Rows here are the rectangle's.
+struct rect_job
+{
+    struct bitmap *bmp;
+    const struct rect *r;
+    int op;
+    const struct posterize_table *t;
+};
+
+static void point_rect_rows(void *ctx, int y0, int y1)
+{
+    struct rect_job *job = (struct rect_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    const struct rect *r = job->r;
+
+    for (int y = r->y + y0; y < r->y + y1; ++y)
+    {
+        long i = (long) y * bmp->width + r->x;
+        if (bmp->layout == LAYOUT_BGR24 && job->t != NULL)
+        {
+            bgr24_posterize_table_span(job->t, bmp->bgr + 3 * i, r->width);
+        }
+        else if (bmp->layout == LAYOUT_BGR24)
+        {
+            bgr24_point_span(job->op, bmp->bgr + 3 * i, r->width);
+        }
+        else if (job->t != NULL)
+        {
+            posterize_table_span(job->t, bmp->pixels + i, r->width);
+        }
+        else if (gray_op_weights(job->op) != NULL)
+        {
+            grayscale_span(gray_op_weights(job->op), bmp->pixels + i, r->width);
+        }
+        else
+        {
+            posterize_span(bmp->pixels + i, r->width);
+        }
+    }
+}
+
+static int bitmap_point_rect(struct bitmap *bmp, const struct rect *r, int op, const struct posterize_table *t)
+{
+    bitmap_materialize(bmp);
+    if (!rect_inside(r, bmp->width, bmp->height))
+    {
+        return -1;
+    }
+    bitmap_mark_dirty(bmp, r->y, r->y + r->height);
+    struct rect_job job = { bmp, r, op, t };
+    parallel_rows(r->height, point_rect_rows, &job);
+    return 0;
+}
+
+int bitmap_to_grayscale_rect(struct bitmap *bmp, const struct rect *r)
+{
+    return bitmap_point_rect(bmp, r, OP_GRAYSCALE, NULL);
+}
+
+int bitmap_posterize_rect(struct bitmap *bmp, const struct rect *r)
+{
+    return bitmap_point_rect(bmp, r, OP_POSTERIZE, NULL);
+}
+
+int bitmap_posterize_table_rect(struct bitmap *bmp, const struct posterize_table *t, const struct rect *r)
+{
+    return bitmap_point_rect(bmp, r, OP_POSTERIZE, t);
+}
+
+static void mirror_rows(void *ctx, int y0, int y1)
+{
+    struct rows_job *job = (struct rows_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    int *new_pixels = job->new_pixels;
+    int new_width = job->new_width;
+
+        for (int y = y0; y < y1; ++y)
+            {
+                for (int x = 0; x < bmp->width; ++x)
+                {
+                    int stored_pixel = bmp->pixels[y * bmp->width + x];
+
+                    new_pixels[y * new_width + x] = stored_pixel;
+                    new_pixels[y * new_width + (new_width - x - 1)] = stored_pixel;
+                }
+            }
+}
+
+void bitmap_mirror(struct bitmap *bmp)
+{
+    struct remap_stage st = { REMAP_MIRROR, 0, 0, 0, 0, 0 };
+    if (bitmap_defer(bmp, &st))
+    {
+        return;
+    }
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_remap(bmp, &st);
+        return;
+    }
+    int new_width = bmp->width * 2;
+
+    int *new_pixels = (int *) bitmap_new_buffer(bmp, (long) new_width * bmp->height * sizeof(int));
+
+    struct rows_job job = { bmp, new_pixels, new_width };
+    parallel_rows(bmp->height, mirror_rows, &job);
+
+            bitmap_replace_buffer(bmp, new_pixels);
+            bmp->width = new_width;
+
+}
+
+void bitmap_squash(struct bitmap *bmp)
+{
+    bitmap_downsample(bmp, 2, 1);
+}
+
+static void reflect_rows(void *ctx, int y0, int y1)
+{
+    struct rows_job *job = (struct rows_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    int *new_pixels = job->new_pixels;
+
+        for (int y = y0; y < y1; ++y)
+            {
+                for (int x = 0; x < bmp->width; ++x)
+                {
+                    int stored_pixel = bmp->pixels[y * bmp->width + x];
+
+                    new_pixels[y * bmp->width + (bmp->width - x - 1)] = stored_pixel;
+                }
+            }
+}
+ 
+void bitmap_reflect(struct bitmap *bmp)
+{
+    struct remap_stage st = { REMAP_ORIENT, ORIENT_FLIP_X, 0, 0, 0, 0 };
+    if (bitmap_defer(bmp, &st))
+    {
+        return;
+    }
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_remap(bmp, &st);
+        return;
+    }
+
+    int *new_pixels = (int *) bitmap_new_buffer(bmp, (long) bmp->width * bmp->height * sizeof(int));
+
+    struct rows_job job = { bmp, new_pixels, bmp->width };
+    parallel_rows(bmp->height, reflect_rows, &job);
+
+        bitmap_replace_buffer(bmp, new_pixels);
+}
+
+static void rotate_rows(void *ctx, int y0, int y1)
+{
+    struct rows_job *job = (struct rows_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    int *new_pixels = job->new_pixels;
+    int new_width = job->new_width;
+
+        for (int y = y0; y < y1; ++y)
+            {
+                for (int x = 0; x < bmp->width; ++x)
+                {
+                    int stored_pixel = bmp->pixels[y * bmp->width + x];
+                    new_pixels[x * new_width + y] = stored_pixel;
+                }
+            }
+}
+
+// The original row-by-row transpose, kept as the baseline for
+// "project2 bench rotate"
+static void bitmap_rotate_untiled(struct bitmap *bmp)
+{
+    int new_width = bmp->height;
+    int new_height = bmp->width;
+    
+    int *new_pixels = (int *) bitmap_new_buffer(bmp, (long) new_width * new_height * sizeof(int));
+
+    struct rows_job job = { bmp, new_pixels, new_width };
+    parallel_rows(bmp->height, rotate_rows, &job);
+
+        bitmap_replace_buffer(bmp, new_pixels);
+        bmp->width = new_width;
+        bmp->height = new_height;
+}
+
+// Side of the square tiles bitmap_orient works in. 32 x 32 pixels of
+// source and destination together are 8K, well inside L1.
+#define ORIENT_TILE 32
+
+struct orient_job
+{
+    const int *src;
+    int *dst;
+    int width;
+    int height;
+    int new_width;
+    int new_height;
+    int orient;
+};
+
+// Plain transpose of the output block [x0, x1) x [y0, y1): output
+// pixel (x, y) is source pixel (y, x).
+static void transpose_block(const struct orient_job *job, int x0, int x1, int y0, int y1)
+{
+    const int *src = job->src;
+    int w = job->width;
+    int *dst = job->dst;
+    int ow = job->new_width;
+    int y = y0;
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    // 4 x 4 blocks transposed in registers
+    for (; y + 4 <= y1; y += 4)
+    {
+        int x = x0;
+        for (; x + 4 <= x1; x += 4)
+        {
+            __m128i r0 = _mm_loadu_si128((const __m128i *) (src + (long) x * w + y));
+            __m128i r1 = _mm_loadu_si128((const __m128i *) (src + (long) (x + 1) * w + y));
+            __m128i r2 = _mm_loadu_si128((const __m128i *) (src + (long) (x + 2) * w + y));
+            __m128i r3 = _mm_loadu_si128((const __m128i *) (src + (long) (x + 3) * w + y));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+            _mm_storeu_si128((__m128i *) (dst + (long) y * ow + x), _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *) (dst + (long) (y + 1) * ow + x), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i *) (dst + (long) (y + 2) * ow + x), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i *) (dst + (long) (y + 3) * ow + x), _mm_unpackhi_epi64(t2, t3));
+        }
+        for (int yy = y; yy < y + 4; ++yy)
+        {
+            for (int xx = x; xx < x1; ++xx)
+            {
+                dst[(long) yy * ow + xx] = src[(long) xx * w + yy];
+            }
+        }
+    }
+#endif
+
+    for (; y < y1; ++y)
+    {
+        for (int x = x0; x < x1; ++x)
+        {
+            dst[(long) y * ow + x] = src[(long) x * w + y];
+        }
+    }
+}
+
+// Rows here are rows of tiles of the output
+static void orient_tile_rows(void *ctx, int t0, int t1)
+{
+    struct orient_job *job = (struct orient_job *) ctx;
+    int w = job->width;
+    int h = job->height;
+    int ow = job->new_width;
+    int oh = job->new_height;
+    int orient = job->orient;
+
+    for (int ty = t0 * ORIENT_TILE; ty < t1 * ORIENT_TILE && ty < oh; ty += ORIENT_TILE)
+    {
+        int y1 = ty + ORIENT_TILE < oh ? ty + ORIENT_TILE : oh;
+
+        for (int tx = 0; tx < ow; tx += ORIENT_TILE)
+        {
+            int x1 = tx + ORIENT_TILE < ow ? tx + ORIENT_TILE : ow;
+
+            if (orient == ORIENT_TRANSPOSE)
+            {
+                transpose_block(job, tx, x1, ty, y1);
+                continue;
+            }
+
+            for (int y = ty; y < y1; ++y)
+            {
+                int *out = job->dst + (long) y * ow;
+                for (int x = tx; x < x1; ++x)
+                {
+                    int sx = x;
+                    int sy = y;
+                    if (orient & ORIENT_TRANSPOSE)
+                    {
+                        sx = y;
+                        sy = x;
+                    }
+                    if (orient & ORIENT_FLIP_X)
+                    {
+                        sx = w - 1 - sx;
+                    }
+                    if (orient & ORIENT_FLIP_Y)
+                    {
+                        sy = h - 1 - sy;
+                    }
+                    out[x] = job->src[(long) sy * w + sx];
+                }
+            }
+        }
+    }
+}
+
+void bitmap_orient(struct bitmap *bmp, int orient)
+{
+    struct remap_stage st = { REMAP_ORIENT, orient, 0, 0, 0, 0 };
+    if (orient == 0 || bitmap_defer(bmp, &st))
+    {
+        return;
+    }
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_remap(bmp, &st);
+        return;
+    }
+    if (orient == ORIENT_FLIP_X)
+    {
+        // Rows stay rows, so tiles don't help
+        bitmap_reflect(bmp);
+        return;
+    }
+
+    int new_width = (orient & ORIENT_TRANSPOSE) ? bmp->height : bmp->width;
+    int new_height = (orient & ORIENT_TRANSPOSE) ? bmp->width : bmp->height;
+    int *new_pixels = (int *) bitmap_new_buffer(bmp, (long) new_width * new_height * sizeof(int));
+
+    struct orient_job job = { bmp->pixels, new_pixels, bmp->width, bmp->height,
+                              new_width, new_height, orient };
+    parallel_rows((new_height + ORIENT_TILE - 1) / ORIENT_TILE, orient_tile_rows, &job);
+
+    bitmap_replace_buffer(bmp, new_pixels);
+    bmp->width = new_width;
+    bmp->height = new_height;
+}
+
+void bitmap_rotate(struct bitmap *bmp)
+{
+    bitmap_orient(bmp, ORIENT_TRANSPOSE);
+}
+
+void bitmap_rotate_90(struct bitmap *bmp)
+{
+    bitmap_orient(bmp, ORIENT_TRANSPOSE | ORIENT_FLIP_Y);
+}
+
+void bitmap_rotate_180(struct bitmap *bmp)
+{
+    bitmap_orient(bmp, ORIENT_FLIP_X | ORIENT_FLIP_Y);
+}
+
+void bitmap_rotate_270(struct bitmap *bmp)
+{
+    bitmap_orient(bmp, ORIENT_TRANSPOSE | ORIENT_FLIP_X);
+}
+
+static void skew_rows(void *ctx, int y0, int y1)
+{
+    struct rows_job *job = (struct rows_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    int *new_pixels = job->new_pixels;
+
+        for (int y = y0; y < y1; ++y)
+            {
+                // The last pixel of a row is overwritten by the first
+                // of the next one, so only the last row writes it.
+                // That keeps rows on different threads apart.
+                int row_end = y + 1 < bmp->height ? bmp->width - 1 : bmp->width;
+
+                for (int x = 0; x < row_end; ++x)
+                {
+                    int i = y * bmp->width + x;
+                    int stored_pixel = bmp->pixels[i];
+
+                    new_pixels[i - y] = stored_pixel;
+                }
+            }
+
+    // The rows that finish the image blacken the tail the shift
+    // leaves behind
+    if (y1 == bmp->height && bmp->width > 0)
+    {
+        long tail = (long) (bmp->height - 1) * (bmp->width - 1) + bmp->width;
+        memset(new_pixels + tail, 0, ((long) bmp->width * bmp->height - tail) * sizeof(int));
+    }
+}
+
+void bitmap_skew(struct bitmap *bmp)
+{
+    struct remap_stage st = { REMAP_SKEW, 0, 0, 0, 0, 0 };
+    if (bitmap_defer(bmp, &st))
+    {
+        return;
+    }
+    if (bmp->layout == LAYOUT_BGR24)
+    {
+        bgr24_remap(bmp, &st);
+        return;
+    }
+    int *new_pixels = (int *) bitmap_new_buffer(bmp, (long) bmp->width * bmp->height * sizeof(int));
+
+    struct rows_job job = { bmp, new_pixels, bmp->width };
+    parallel_rows(bmp->height, skew_rows, &job);
+
+        bitmap_replace_buffer(bmp, new_pixels);
+}
+
+// Rows here are rows of the shrunk image
+void bitmap_shrink(struct bitmap *bmp)
+{
+    bitmap_downsample(bmp, 2, 2);
+}
+
+// ---- Resizing ----
+
+// What a range of output rows of bitmap_downsample needs. Both layouts
+// are handled as bytes: bpp is 4 for LAYOUT_INT, whose fourth byte
+// stays 0, and 3 for LAYOUT_BGR24.
+struct downsample_job
+{
+    const byte *src;
+    byte *dst;
+    int width;
+    int new_width;
+    int fx;
+    int fy;
+    int bpp;
+};
+
+// Any block size, with bpp known at compile time where it's inlined
+static inline void downsample_rows_any(struct downsample_job *job, int y0, int y1, int bpp)
+{
+    int fx = job->fx;
+    long in_row = (long) job->width * bpp;
+    long used = (long) job->new_width * fx * bpp;
+    unsigned int *sum = (unsigned int *) thread_scratch(SCRATCH_DOWNSAMPLE, (used > 0 ? used : 1) * sizeof(unsigned int));
+
+    // s / n as a multiply and a shift, which is exact for every sum of
+    // n bytes while n is below 65536
+    unsigned long n = (unsigned long) fx * job->fy;
+    unsigned long magic = (1UL << 40) / n + 1;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        // Add up the block's rows first, so that every column is read
+        // in order, then its columns
+        const byte *row = job->src + (long) y * job->fy * in_row;
+        for (long i = 0; i < used; ++i)
+        {
+            sum[i] = row[i];
+        }
+        for (int r = 1; r < job->fy; ++r)
+        {
+            row += in_row;
+            for (long i = 0; i < used; ++i)
+            {
+                sum[i] += row[i];
+            }
+        }
+
+        byte *out = job->dst + (long) y * job->new_width * bpp;
+        const unsigned int *block = sum;
+        for (int x = 0; x < job->new_width; ++x, out += bpp, block += fx * bpp)
+        {
+            for (int c = 0; c < bpp; ++c)
+            {
+                unsigned long total = 0;
+                for (int k = 0; k < fx; ++k)
+                {
+                    total += block[k * bpp + c];
+                }
+                out[c] = n < 65536 ? (total * magic) >> 40 : total / n;
+            }
+        }
+    }
+}
+
+// 2 x 1 and 2 x 2 blocks, which bitmap_squash and bitmap_shrink need:
+// n output pixels from row a (and b below it when fy is 2), one pixel
+// at a time. These are the reference the vector kernel must match
+// exactly.
+static inline void downsample2_row_scalar(const byte *a, const byte *b, byte *out, int from, int n,
+                                          int bpp, int fy)
+{
+    a += 2L * from * bpp;
+    b += 2L * from * bpp;
+    out += (long) from * bpp;
+    for (int x = from; x < n; ++x, a += 2 * bpp, b += 2 * bpp, out += bpp)
+    {
+        for (int c = 0; c < bpp; ++c)
+        {
+            if (fy == 2)
+            {
+                out[c] = (a[c] + a[c + bpp] + b[c] + b[c + bpp]) / 4;
+            }
+            else
+            {
+                out[c] = (a[c] + a[c + bpp]) / 2;
+            }
+        }
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// The same for LAYOUT_INT, four output pixels at a time. The even and
+// odd pixels of each row are split apart, then averaged byte by byte:
+// avg_epu8 rounds up, so pairs subtract the bit it added, and quads
+// add up in 16 bits.
+static void downsample2_row_sse2(const int *a, const int *b, int *out, int n, int fy)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    int x = 0;
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128 a0 = _mm_loadu_ps((const float *) (a + 2 * x));
+        __m128 a1 = _mm_loadu_ps((const float *) (a + 2 * x + 4));
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(a0, a1, _MM_SHUFFLE(3, 1, 3, 1)));
+        if (fy == 1)
+        {
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(even, odd), _mm_and_si128(_mm_xor_si128(even, odd), one));
+            _mm_storeu_si128((__m128i *) (out + x), avg);
+            continue;
+        }
+
+        __m128 b0 = _mm_loadu_ps((const float *) (b + 2 * x));
+        __m128 b1 = _mm_loadu_ps((const float *) (b + 2 * x + 4));
+        __m128i even_b = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd_b = _mm_castps_si128(_mm_shuffle_ps(b0, b1, _MM_SHUFFLE(3, 1, 3, 1)));
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(even, zero), _mm_unpacklo_epi8(odd, zero)),
+                                   _mm_add_epi16(_mm_unpacklo_epi8(even_b, zero), _mm_unpacklo_epi8(odd_b, zero)));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(even, zero), _mm_unpackhi_epi8(odd, zero)),
+                                   _mm_add_epi16(_mm_unpackhi_epi8(even_b, zero), _mm_unpackhi_epi8(odd_b, zero)));
+        _mm_storeu_si128((__m128i *) (out + x), _mm_packus_epi16(_mm_srli_epi16(lo, 2), _mm_srli_epi16(hi, 2)));
+    }
+    downsample2_row_scalar((const byte *) a, (const byte *) b, (byte *) out, x, n, 4, fy);
+}
+
+#endif
+
+static void downsample2_row(const byte *a, const byte *b, byte *out, int n, int bpp, int fy)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (bpp == 4 && simd_level() != SIMD_SCALAR)
+    {
+        downsample2_row_sse2((const int *) a, (const int *) b, (int *) out, n, fy);
+        return;
+    }
+#endif
+    if (bpp == 4)
+    {
+        downsample2_row_scalar(a, b, out, 0, n, 4, fy);
+    }
+    else
+    {
+        downsample2_row_scalar(a, b, out, 0, n, 3, fy);
+    }
+}
+
+static void downsample_rows(void *ctx, int y0, int y1)
+{
+    struct downsample_job *job = (struct downsample_job *) ctx;
+
+    if (job->fx == 2 && job->fy <= 2)
+    {
+        long in_row = (long) job->width * job->bpp;
+        for (int y = y0; y < y1; ++y)
+        {
+            const byte *a = job->src + (long) y * job->fy * in_row;
+            downsample2_row(a, job->fy == 2 ? a + in_row : a, job->dst + (long) y * job->new_width * job->bpp,
+                            job->new_width, job->bpp, job->fy);
+        }
+    }
+    else if (job->bpp == 4)
+    {
+        downsample_rows_any(job, y0, y1, 4);
+    }
+    else
+    {
+        downsample_rows_any(job, y0, y1, 3);
+    }
+}
+
+// Downsamples the rectangle r of a bitmap, which replaces it. The
+// rows of the bitmap are the job's source rows, starting at r's
+// corner.
+static void bitmap_downsample_window(struct bitmap *bmp, const struct rect *r, int fx, int fy)
+{
+    int new_width = r->width / fx;
+    int new_height = r->height / fy;
+    int bpp = bmp->layout == LAYOUT_BGR24 ? 3 : 4;
+    const byte *src = bmp->layout == LAYOUT_BGR24 ? bmp->bgr : (const byte *) bmp->pixels;
+    src += ((long) r->y * bmp->width + r->x) * bpp;
+    byte *dst = (byte *) bitmap_new_buffer(bmp, (long) new_width * new_height * bpp);
+
+    struct downsample_job job = { src, dst, bmp->width, new_width, fx, fy, bpp };
+    parallel_rows(new_height, downsample_rows, &job);
+
+    bitmap_replace_buffer(bmp, dst);
+    bmp->width = new_width;
+    bmp->height = new_height;
+}
+
+void bitmap_downsample(struct bitmap *bmp, int fx, int fy)
+{
+    bitmap_materialize(bmp);
+    struct rect whole = { 0, 0, bmp->width, bmp->height };
+    bitmap_downsample_window(bmp, &whole, fx, fy);
+}
+
+int bitmap_crop(struct bitmap *bmp, const struct rect *r)
+{
+    bitmap_materialize(bmp);
+    if (!rect_inside(r, bmp->width, bmp->height))
+    {
+        return -1;
+    }
+
+    int bpp = bmp->layout == LAYOUT_BGR24 ? 3 : 4;
+    const byte *src = bmp->layout == LAYOUT_BGR24 ? bmp->bgr : (const byte *) bmp->pixels;
+    long row_bytes = (long) r->width * bpp;
+    byte *dst = (byte *) bitmap_new_buffer(bmp, row_bytes * r->height);
+    for (int y = 0; y < r->height; ++y)
+    {
+        memcpy(dst + y * row_bytes, src + ((long) (r->y + y) * bmp->width + r->x) * bpp, row_bytes);
+    }
+
+    bitmap_replace_buffer(bmp, dst);
+    bmp->width = r->width;
+    bmp->height = r->height;
+    return 0;
+}
+
+// Weights for resampling one dimension: output i is the sum of
+// weights[i * max_taps + k] times source start[i] + k, for k below
+// count[i]. The weights are in 1/16384ths and add up to exactly 16384.
+struct resize_weights
+{
+    int *start;
+    int *count;
+    short *weights;
+    int max_taps;
+};
+
+// sin(pi * x), without needing libm
+static double resize_sin_pi(double x)
+{
+    x -= 2.0 * (long) (x / 2.0);
+    if (x > 1.0)
+    {
+        x -= 2.0;
+    }
+    else if (x < -1.0)
+    {
+        x += 2.0;
+    }
+    if (x > 0.5)
+    {
+        x = 1.0 - x;
+    }
+    else if (x < -0.5)
+    {
+        x = -1.0 - x;
+    }
+
+    double u = 3.14159265358979323846 * x;
+    double u2 = u * u;
+    double term = u;
+    double sum = u;
+    for (int i = 1; i < 8; ++i)
+    {
+        term *= -u2 / ((2 * i) * (2 * i + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static double resize_sinc(double x)
+{
+    if (x == 0.0)
+    {
+        return 1.0;
+    }
+    return resize_sin_pi(x) / (3.14159265358979323846 * x);
+}
+
+// The filter at distance x, and how far from 0 it is non-zero
+static double resize_filter_at(int filter, double x)
+{
+    if (filter == FILTER_BOX)
+    {
+        return x > -0.5 && x <= 0.5 ? 1.0 : 0.0;
+    }
+    if (x < 0.0)
+    {
+        x = -x;
+    }
+    if (filter == FILTER_BILINEAR)
+    {
+        return x < 1.0 ? 1.0 - x : 0.0;
+    }
+    return x < 3.0 ? resize_sinc(x) * resize_sinc(x / 3.0) : 0.0;
+}
+
+static double resize_filter_support(int filter)
+{
+    return filter == FILTER_BOX ? 0.5 : filter == FILTER_BILINEAR ? 1.0 : 3.0;
+}
+
+static void resize_weights_init(struct resize_weights *rw, int in, int out, int filter)
+{
+    double scale = (double) in / out;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    double support = resize_filter_support(filter) * filter_scale;
+    double *k = (double *) malloc(((long) support * 2 + 3) * sizeof(double));
+
+    rw->max_taps = (int) support * 2 + 3;
+    rw->start = (int *) malloc(2L * out * sizeof(int));
+    rw->count = rw->start + out;
+    rw->weights = (short *) calloc((long) out * rw->max_taps, sizeof(short));
+
+    for (int i = 0; i < out; ++i)
+    {
+        double center = (i + 0.5) * scale;
+        int x0 = (int) (center - support + 0.5);
+        int x1 = (int) (center + support + 0.5);
+        x0 = x0 < 0 ? 0 : x0;
+        x1 = x1 > in ? in : x1;
+        x1 = x1 > x0 + rw->max_taps ? x0 + rw->max_taps : x1;
+
+        double total = 0.0;
+        for (int x = x0; x < x1; ++x)
+        {
+            k[x - x0] = resize_filter_at(filter, (x - center + 0.5) / filter_scale);
+            total += k[x - x0];
+        }
+
+        // Drop the taps with no weight at either end
+        int first = 0;
+        int n = x1 - x0;
+        while (n > 1 && k[first] == 0.0)
+        {
+            ++first;
+            --n;
+        }
+        while (n > 1 && k[first + n - 1] == 0.0)
+        {
+            --n;
+        }
+
+        // Round to 14 bits, giving what rounding lost to the biggest
+        // weight so the weights still add up to one
+        short *w = rw->weights + (long) i * rw->max_taps;
+        int fixed_total = 0;
+        int biggest = 0;
+        for (int t = 0; t < n; ++t)
+        {
+            double v = total != 0.0 ? k[first + t] / total : (t == 0);
+            w[t] = (short) (v * 16384.0 + (v < 0.0 ? -0.5 : 0.5));
+            fixed_total += w[t];
+            if (w[t] > w[biggest])
+            {
+                biggest = t;
+            }
+        }
+        w[biggest] += 16384 - fixed_total;
+        rw->start[i] = x0 + first;
+        rw->count[i] = n;
+    }
+
+    free(k);
+}
+
+static void resize_weights_release(struct resize_weights *rw)
+{
+    free(rw->start);
+    free(rw->weights);
+}
+
+static inline int resize_clamp(int v)
+{
+    v = (v + (1 << 13)) >> 14;
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Horizontal pass over one row, and vertical pass over the taps rows
+// of one output row, one channel at a time. These are the reference
+// the vector kernels must match exactly.
+static void resize_h_row_scalar(const struct resize_weights *rw, const int *src, int *dst, int n)
+{
+    for (int x = 0; x < n; ++x)
+    {
+        const int *p = src + rw->start[x];
+        const short *w = rw->weights + (long) x * rw->max_taps;
+        int b = 0;
+        int g = 0;
+        int r = 0;
+        for (int k = 0; k < rw->count[x]; ++k)
+        {
+            b += w[k] * (p[k] & 0xff);
+            g += w[k] * ((p[k] >> 8) & 0xff);
+            r += w[k] * ((p[k] >> 16) & 0xff);
+        }
+        dst[x] = (resize_clamp(r) << 16) | (resize_clamp(g) << 8) | resize_clamp(b);
+    }
+}
+
+static void resize_v_row_scalar(const short *w, int taps, int *const *rows, int *dst, long from, long n)
+{
+    for (long x = from; x < n; ++x)
+    {
+        int b = 0;
+        int g = 0;
+        int r = 0;
+        for (int k = 0; k < taps; ++k)
+        {
+            int p = rows[k][x];
+            b += w[k] * (p & 0xff);
+            g += w[k] * ((p >> 8) & 0xff);
+            r += w[k] * ((p >> 16) & 0xff);
+        }
+        dst[x] = (resize_clamp(r) << 16) | (resize_clamp(g) << 8) | resize_clamp(b);
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// Two weights side by side, for _mm_madd_epi16 on pairs of taps
+static inline int resize_weight_pair(const short *w, int k, int taps)
+{
+    // Built unsigned, as shifting a negative Lanczos weight is undefined
+    unsigned short second = k + 1 < taps ? (unsigned short) w[k + 1] : 0;
+    return (int) (((unsigned) second << 16) | (unsigned short) w[k]);
+}
+
+// Each pair of taps is interleaved channel by channel (b0 b1 g0 g1 ...)
+// and multiplied by its two weights and summed with one madd
+static void resize_h_row_sse2(const struct resize_weights *rw, const int *src, int *dst, int n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << 13);
+
+    for (int x = 0; x < n; ++x)
+    {
+        const int *p = src + rw->start[x];
+        const short *w = rw->weights + (long) x * rw->max_taps;
+        int taps = rw->count[x];
+        __m128i sum = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i second = k + 1 < taps ? _mm_cvtsi32_si128(p[k + 1]) : zero;
+            __m128i pair = _mm_unpacklo_epi8(_mm_unpacklo_epi8(_mm_cvtsi32_si128(p[k]), second), zero);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(pair, _mm_set1_epi32(resize_weight_pair(w, k, taps))));
+        }
+        sum = _mm_srai_epi32(sum, 14);
+        sum = _mm_packs_epi32(sum, sum);
+        dst[x] = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    }
+}
+
+// Four pixels of every row at a time, two rows per madd
+static void resize_v_row_sse2(const short *w, int taps, int *const *rows, int *dst, long n)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << 13);
+
+    long x = 0;
+    for (; x + 4 <= n; x += 4)
+    {
+        __m128i sum0 = round;
+        __m128i sum1 = round;
+        __m128i sum2 = round;
+        __m128i sum3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *) (rows[k] + x));
+            __m128i b = k + 1 < taps ? _mm_loadu_si128((const __m128i *) (rows[k + 1] + x)) : zero;
+            __m128i weight = _mm_set1_epi32(resize_weight_pair(w, k, taps));
+            __m128i alo = _mm_unpacklo_epi8(a, zero);
+            __m128i blo = _mm_unpacklo_epi8(b, zero);
+            __m128i ahi = _mm_unpackhi_epi8(a, zero);
+            __m128i bhi = _mm_unpackhi_epi8(b, zero);
+            sum0 = _mm_add_epi32(sum0, _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), weight));
+            sum1 = _mm_add_epi32(sum1, _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), weight));
+            sum2 = _mm_add_epi32(sum2, _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), weight));
+            sum3 = _mm_add_epi32(sum3, _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), weight));
+        }
+        __m128i lo = _mm_packs_epi32(_mm_srai_epi32(sum0, 14), _mm_srai_epi32(sum1, 14));
+        __m128i hi = _mm_packs_epi32(_mm_srai_epi32(sum2, 14), _mm_srai_epi32(sum3, 14));
+        _mm_storeu_si128((__m128i *) (dst + x), _mm_packus_epi16(lo, hi));
+    }
+    resize_v_row_scalar(w, taps, rows, dst, x, n);
+}
+
+// The same, eight pixels at a time. The unpacks and packs work within
+// each 128-bit half, so the pixels come out in order.
+__attribute__((target("avx2")))
+static void resize_v_row_avx2(const short *w, int taps, int *const *rows, int *dst, long n)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i round = _mm256_set1_epi32(1 << 13);
+
+    long x = 0;
+    for (; x + 8 <= n; x += 8)
+    {
+        __m256i sum0 = round;
+        __m256i sum1 = round;
+        __m256i sum2 = round;
+        __m256i sum3 = round;
+        for (int k = 0; k < taps; k += 2)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (rows[k] + x));
+            __m256i b = k + 1 < taps ? _mm256_loadu_si256((const __m256i *) (rows[k + 1] + x)) : zero;
+            __m256i weight = _mm256_set1_epi32(resize_weight_pair(w, k, taps));
+            __m256i alo = _mm256_unpacklo_epi8(a, zero);
+            __m256i blo = _mm256_unpacklo_epi8(b, zero);
+            __m256i ahi = _mm256_unpackhi_epi8(a, zero);
+            __m256i bhi = _mm256_unpackhi_epi8(b, zero);
+            sum0 = _mm256_add_epi32(sum0, _mm256_madd_epi16(_mm256_unpacklo_epi16(alo, blo), weight));
+            sum1 = _mm256_add_epi32(sum1, _mm256_madd_epi16(_mm256_unpackhi_epi16(alo, blo), weight));
+            sum2 = _mm256_add_epi32(sum2, _mm256_madd_epi16(_mm256_unpacklo_epi16(ahi, bhi), weight));
+            sum3 = _mm256_add_epi32(sum3, _mm256_madd_epi16(_mm256_unpackhi_epi16(ahi, bhi), weight));
+        }
+        __m256i lo = _mm256_packs_epi32(_mm256_srai_epi32(sum0, 14), _mm256_srai_epi32(sum1, 14));
+        __m256i hi = _mm256_packs_epi32(_mm256_srai_epi32(sum2, 14), _mm256_srai_epi32(sum3, 14));
+        _mm256_storeu_si256((__m256i *) (dst + x), _mm256_packus_epi16(lo, hi));
+    }
+    _mm256_zeroupper(); // see decode_row_avx2
+    resize_v_row_scalar(w, taps, rows, dst, x, n);
+}
+
+#endif
+
+static void resize_h_row(const struct resize_weights *rw, const int *src, int *dst, int n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() != SIMD_SCALAR)
+    {
+        resize_h_row_sse2(rw, src, dst, n);
+        return;
+    }
+#endif
+    resize_h_row_scalar(rw, src, dst, n);
+}
+
+static void resize_v_row(const short *w, int taps, int *const *rows, int *dst, long n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    int level = simd_level();
+    if (level == SIMD_AVX2)
+    {
+        resize_v_row_avx2(w, taps, rows, dst, n);
+        return;
+    }
+    else if (level == SIMD_SSE2)
+    {
+        resize_v_row_sse2(w, taps, rows, dst, n);
+        return;
+    }
+#endif
+    resize_v_row_scalar(w, taps, rows, dst, 0, n);
+}
+
+// The weights map the columns and rows of the rectangle r of bmp
+struct resize_job
+{
+    struct bitmap *bmp;
+    const struct rect *r;
+    struct resize_weights h;
+    struct resize_weights v;
+    byte *dst;
+    int new_width;
+};
+
+// Each range of output rows streams through the source rows it needs,
+// keeping the horizontally filtered ones in a ring of v.max_taps rows.
+// The rows an output row needs are consecutive and move down with it,
+// so they never evict each other from the ring.
+static void resize_rows(void *ctx, int y0, int y1)
+{
+    struct resize_job *job = (struct resize_job *) ctx;
+    const struct bitmap *bmp = job->bmp;
+    int ring = job->v.max_taps;
+    long new_width = job->new_width;
+    int bgr = bmp->layout == LAYOUT_BGR24;
+
+    // The row pointers first, so they are aligned, then the ints
+    long ints = (long) ring * new_width + new_width + bmp->width + ring;
+    int **rows = (int **) thread_scratch(SCRATCH_RESIZE, ring * sizeof(int *) + ints * sizeof(int));
+    int *buffer = (int *) (rows + ring);
+    int *out_row = buffer + (long) ring * new_width;
+    int *in_row = out_row + new_width;
+    int *tags = in_row + bmp->width;
+    for (int i = 0; i < ring; ++i)
+    {
+        tags[i] = -1;
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        int start = job->v.start[y];
+        int taps = job->v.count[y];
+        for (int k = 0; k < taps; ++k)
+        {
+            int sy = start + k;
+            int *filtered = buffer + (long) (sy % ring) * new_width;
+            if (tags[sy % ring] != sy)
+            {
+                long first = (long) (job->r->y + sy) * bmp->width + job->r->x;
+                const int *src = bmp->pixels + first;
+                if (bgr)
+                {
+                    decode_row(bmp->bgr + first * 3, in_row, job->r->width);
+                    src = in_row;
+                }
+                resize_h_row(&job->h, src, filtered, new_width);
+                tags[sy % ring] = sy;
+            }
+            rows[k] = filtered;
+        }
+
+        const short *w = job->v.weights + (long) y * job->v.max_taps;
+        if (bgr)
+        {
+            resize_v_row(w, taps, rows, out_row, new_width);
+            encode_row(out_row, job->dst + (long) y * new_width * 3, new_width);
+        }
+        else
+        {
+            resize_v_row(w, taps, rows, (int *) job->dst + (long) y * new_width, new_width);
+        }
+    }
+}
+
+int bitmap_resize(struct bitmap *bmp, int new_width, int new_height, int filter)
+{
+    bitmap_materialize(bmp);
+    struct rect whole = { 0, 0, bmp->width, bmp->height };
+    return bitmap_resize_rect(bmp, &whole, new_width, new_height, filter);
+}
+
+int bitmap_resize_rect(struct bitmap *bmp, const struct rect *r, int new_width, int new_height, int filter)
+{
+    bitmap_materialize(bmp);
+    if (new_width < 1 || new_height < 1 || r->width < 1 || r->height < 1)
+    {
+        printf("Error: Can't resize a %dx%d image to %dx%d\n", r->width, r->height, new_width, new_height);
+        return -1;
+    }
+    if (!rect_inside(r, bmp->width, bmp->height) || bmp_size_check(new_width, new_height) == -1)
+    {
+        return -1;
+    }
+
+    int fx = r->width / new_width;
+    int fy = r->height / new_height;
+    if (filter == FILTER_BOX && fx >= 1 && fy >= 1
+        && r->width / fx == new_width && r->height / fy == new_height)
+    {
+        bitmap_downsample_window(bmp, r, fx, fy);
+        return 0;
+    }
+
+    struct resize_job job;
+    job.bmp = bmp;
+    job.r = r;
+    job.new_width = new_width;
+    resize_weights_init(&job.h, r->width, new_width, filter);
+    resize_weights_init(&job.v, r->height, new_height, filter);
+
+    int bpp = bmp->layout == LAYOUT_BGR24 ? 3 : 4;
+    job.dst = (byte *) bitmap_new_buffer(bmp, (long) new_width * new_height * bpp);
+    parallel_rows(new_height, resize_rows, &job);
+
+    bitmap_replace_buffer(bmp, job.dst);
+    bmp->width = new_width;
+    bmp->height = new_height;
+    resize_weights_release(&job.h);
+    resize_weights_release(&job.v);
+    return 0;
+}
+
+// Where the rows of each level of a mip chain live: row y of level l
+// is stride[l] bytes after row y - 1, or before it for the bottom-up
+// rows of BMP files. Level 0 is the source.
+struct mip_chain
+{
+    int nlevels;
+    int bpp;
+    int bottom_up;
+    int width[MAX_MIP_LEVELS + 1];
+    int height[MAX_MIP_LEVELS + 1];
+    byte *base[MAX_MIP_LEVELS + 1];
+    long stride[MAX_MIP_LEVELS + 1];
+};
+
+// Works out the sizes of up to max_levels levels below width x height
+static void mip_chain_init(struct mip_chain *chain, int width, int height, int max_levels, int bpp)
+{
+    chain->nlevels = 0;
+    chain->bpp = bpp;
+    chain->width[0] = width;
+    chain->height[0] = height;
+    while (chain->nlevels < max_levels && chain->nlevels < MAX_MIP_LEVELS
+           && chain->width[chain->nlevels] >= 2 && chain->height[chain->nlevels] >= 2)
+    {
+        ++chain->nlevels;
+        chain->width[chain->nlevels] = chain->width[chain->nlevels - 1] / 2;
+        chain->height[chain->nlevels] = chain->height[chain->nlevels - 1] / 2;
+    }
+}
+
+static inline byte *mip_row(const struct mip_chain *chain, int level, int y)
+{
+    if (chain->bottom_up)
+    {
+        y = chain->height[level] - 1 - y;
+    }
+    return chain->base[level] + y * chain->stride[level];
+}
+
+// Walks down the source rows. Every odd row of a level completes a pair,
+// which makes the next row of the level below, and so on down while
+// those are odd too.
+static void mip_chain_run(const struct mip_chain *chain)
+{
+    int ev = trace_begin("mip chain");
+    long bytes = 0;
+
+    for (int y = 0; y < chain->height[0]; ++y)
+    {
+        int r = y;
+        for (int level = 0; level < chain->nlevels && (r & 1) && r / 2 < chain->height[level + 1]; ++level)
+        {
+            downsample2_row(mip_row(chain, level, r - 1), mip_row(chain, level, r),
+                            mip_row(chain, level + 1, r / 2), chain->width[level + 1], chain->bpp, 2);
+            bytes += (long) chain->width[level + 1] * chain->bpp;
+            r /= 2;
+        }
+    }
+
+    trace_end(ev, (long) chain->width[0] * chain->height[0] * chain->bpp + bytes);
+}
+
+int bitmap_mip_chain(struct bitmap *bmp, struct bitmap *levels, int max_levels)
+{
+    bitmap_materialize(bmp);
+    struct mip_chain chain;
+    int bpp = bmp->layout == LAYOUT_BGR24 ? 3 : 4;
+    mip_chain_init(&chain, bmp->width, bmp->height, max_levels, bpp);
+    chain.bottom_up = 0;
+    chain.base[0] = bmp->layout == LAYOUT_BGR24 ? bmp->bgr : (byte *) bmp->pixels;
+    chain.stride[0] = (long) bmp->width * bpp;
+
+    for (int l = 1; l <= chain.nlevels; ++l)
+    {
+        struct bitmap *level = &levels[l - 1];
+        byte *pixels = (byte *) bitmap_malloc((long) chain.width[l] * chain.height[l] * bpp);
+        level->width = chain.width[l];
+        level->height = chain.height[l];
+        level->layout = bmp->layout;
+        level->pixels = bmp->layout == LAYOUT_BGR24 ? NULL : (int *) pixels;
+        level->bgr = bmp->layout == LAYOUT_BGR24 ? pixels : NULL;
+        level->arena = NULL;
+        level->pending = NULL;
+        level->dirty = NULL;
+        chain.base[l] = pixels;
+        chain.stride[l] = (long) chain.width[l] * bpp;
+    }
+
+    mip_chain_run(&chain);
+    return chain.nlevels;
+}
+
+int write_mip_chain(void *bmp_file, const char *out_prefix, int max_levels)
+{
+    struct bitmap in;
+    struct bmp_format fmt;
+    if (read_bitmap_format(bmp_file, &in, &fmt) == -1)
+    {
+        return -1;
+    }
+
+    // Level 0 is walked bottom-up like the levels written, so a
+    // top-down source is walked from its last row with a negative
+    // stride. Other pixel formats are decoded to 24-bit rows first.
+    struct bitmap decoded;
+    decoded.bgr = NULL;
+    struct mip_chain chain;
+    mip_chain_init(&chain, in.width, in.height, max_levels, 3);
+    chain.bottom_up = 1;
+    if (fmt.format == BMP_BGR24)
+    {
+        chain.base[0] = (byte *) bmp_file + fmt.offset;
+        chain.stride[0] = fmt.stride;
+    }
+    else
+    {
+        if (read_bitmap_layout(bmp_file, &decoded, LAYOUT_BGR24) == -1)
+        {
+            return -1;
+        }
+        chain.base[0] = decoded.bgr;
+        chain.stride[0] = (long) in.width * 3;
+        fmt.top_down = 1;
+    }
+    if (fmt.top_down)
+    {
+        chain.base[0] += (long) (in.height - 1) * chain.stride[0];
+        chain.stride[0] = -chain.stride[0];
+    }
+
+    int result = chain.nlevels;
+    int mapped = 0;
+    for (int l = 1; l <= chain.nlevels; ++l, ++mapped)
+    {
+        struct bitmap out = { chain.width[l], chain.height[l], NULL, LAYOUT_INT, NULL, NULL, NULL, NULL };
+        char filename[4096];
+        snprintf(filename, sizeof(filename), "%s-%d.bmp", out_prefix, l);
+
+        byte *o_pointer = map_file_for_writing(filename, bmp_file_size(&out));
+        if (o_pointer == NULL)
+        {
+            result = -1;
+            break;
+        }
+        write_bitmap_header(o_pointer, &out);
+        chain.base[l] = o_pointer + 54;
+        chain.stride[l] = bmp_file_stride(&out);
+    }
+
+    if (result != -1)
+    {
+        mip_chain_run(&chain);
+    }
+
+    for (int l = 1; l <= mapped; ++l)
+    {
+        struct bitmap out = { chain.width[l], chain.height[l], NULL, LAYOUT_INT, NULL, NULL, NULL, NULL };
+        munmap(chain.base[l] - 54, bmp_file_size(&out));
+    }
+    if (decoded.bgr != NULL)
+    {
+        bitmap_free(&decoded);
+    }
+    return result;
+}
+
+// ---- Affine warps ----
+
+void affine_identity(struct affine *m)
+{
+    struct affine identity = { 1, 0, 0, 0, 1, 0 };
+    *m = identity;
+}
+
+// Makes m do step after what it already does
+static void affine_then(struct affine *m, const struct affine *step)
+{
+    struct affine r;
+    r.a = step->a * m->a + step->b * m->d;
+    r.b = step->a * m->b + step->b * m->e;
+    r.c = step->a * m->c + step->b * m->f + step->c;
+    r.d = step->d * m->a + step->e * m->d;
+    r.e = step->d * m->b + step->e * m->e;
+    r.f = step->d * m->c + step->e * m->f + step->f;
+    *m = r;
+}
+
+void affine_rotate(struct affine *m, double degrees)
+{
+    // With y going down, this turns x towards y, i.e. clockwise
+    double s = resize_sin_pi(degrees / 180.0);
+    double c = resize_sin_pi(degrees / 180.0 + 0.5);
+    struct affine step = { c, -s, 0, s, c, 0 };
+    affine_then(m, &step);
+}
+
+void affine_shear(struct affine *m, double sx, double sy)
+{
+    struct affine step = { 1, sx, 0, sy, 1, 0 };
+    affine_then(m, &step);
+}
+
+void affine_scale(struct affine *m, double sx, double sy)
+{
+    struct affine step = { sx, 0, 0, 0, sy, 0 };
+    affine_then(m, &step);
+}
+
+int affine_invert(const struct affine *m, struct affine *inverse)
+{
+    double det = m->a * m->e - m->b * m->d;
+    if (det > -1e-12 && det < 1e-12)
+    {
+        return -1;
+    }
+
+    struct affine r;
+    r.a = m->e / det;
+    r.b = -m->b / det;
+    r.d = -m->d / det;
+    r.e = m->a / det;
+    r.c = -(r.a * m->c + r.b * m->f);
+    r.f = -(r.d * m->c + r.e * m->f);
+    *inverse = r;
+    return 0;
+}
+
+// Side of the square output tiles of bitmap_affine. A 64 x 64 tile of
+// a rotation reads a 64-pixel-wide band of source rows, which stays in
+// L2 until the tile is done.
+#define AFFINE_TILE 64
+
+// Source coordinates are only stepped in 16.16 fixed point while they
+// stay within this many pixels of the origin, so that they fit an int
+// with room for rounding
+#define AFFINE_FIXED_LIMIT 32000.0
+
+static int affine_fixed(double v)
+{
+    return (int) (v * 65536.0 + (v < 0 ? -0.5 : 0.5));
+}
+
+// (256 - w) parts of p0 and w parts of p1, channel by channel. Red and
+// blue are weighed together in the two halves of one 32-bit product,
+// and so are green and the unused top byte.
+static inline int bilinear_mix(int p0, int p1, int w)
+{
+    unsigned int rb = (((unsigned int) p0 & 0xff00ff) * (256 - w)
+                       + ((unsigned int) p1 & 0xff00ff) * w + 0x800080) >> 8;
+    unsigned int g = ((((unsigned int) p0 >> 8) & 0xff00ff) * (256 - w)
+                      + (((unsigned int) p1 >> 8) & 0xff00ff) * w + 0x800080) >> 8;
+    return (int) ((rb & 0xff00ff) | ((g & 0xff00ff) << 8));
+}
+
+// The source pixel at (u, v), in 16.16 fixed point with whole numbers
+// at pixel centres, or black if the nearest pixel is outside the
+// source. Bilinear sampling clamps the neighbours past the edges.
+static inline int affine_sample(const int *src, int w, int h, int u, int v, int sample)
+{
+    int x = (u + 0x8000) >> 16;
+    int y = (v + 0x8000) >> 16;
+    if ((unsigned int) x >= (unsigned int) w || (unsigned int) y >= (unsigned int) h)
+    {
+        return 0;
+    }
+    if (sample == SAMPLE_NEAREST)
+    {
+        return src[(long) y * w + x];
+    }
+
+    int x0 = u >> 16;
+    int y0 = v >> 16;
+    int x1 = x0 + 1 < w ? x0 + 1 : w - 1;
+    int y1 = y0 + 1 < h ? y0 + 1 : h - 1;
+    x0 = x0 < 0 ? 0 : x0;
+    y0 = y0 < 0 ? 0 : y0;
+    int wx = (u >> 8) & 0xff;
+    int wy = (v >> 8) & 0xff;
+
+    const int *r0 = src + (long) y0 * w;
+    const int *r1 = src + (long) y1 * w;
+    return bilinear_mix(bilinear_mix(r0[x0], r0[x1], wx), bilinear_mix(r1[x0], r1[x1], wx), wy);
+}
+
+// n output pixels whose source coordinates start at (u, v) and step by
+// (du, dv)
+static void affine_span_scalar(const int *src, int w, int h, int *out, int n,
+                               int u, int v, int du, int dv, int sample)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        out[i] = affine_sample(src, w, h, u, v, sample);
+        u += du;
+        v += dv;
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+__attribute__((target("avx2")))
+static inline __m256i bilinear_mix_avx2(__m256i p0, __m256i p1, __m256i w)
+{
+    __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    __m256i round = _mm256_set1_epi32(0x00800080);
+    __m256i iw = _mm256_sub_epi16(_mm256_set1_epi32(0x01000100), w);
+
+    __m256i rb = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(p0, mask), iw),
+                                  _mm256_mullo_epi16(_mm256_and_si256(p1, mask), w));
+    __m256i g = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p0, 8), mask), iw),
+                                 _mm256_mullo_epi16(_mm256_and_si256(_mm256_srli_epi32(p1, 8), mask), w));
+    rb = _mm256_and_si256(_mm256_srli_epi32(_mm256_add_epi16(rb, round), 8), mask);
+    g = _mm256_and_si256(_mm256_srli_epi32(_mm256_add_epi16(g, round), 8), mask);
+    return _mm256_or_si256(rb, _mm256_slli_epi32(g, 8));
+}
+
+// 8 output pixels at a time, with their source pixels fetched by
+// gathers. Lanes outside the source are masked out of the gathers and
+// come out black.
+__attribute__((target("avx2")))
+static void affine_span_avx2(const int *src, int w, int h, int *out, int n,
+                             int u, int v, int du, int dv, int sample)
+{
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step_u = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(du));
+    __m256i step_v = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(dv));
+    __m256i width = _mm256_set1_epi32(w);
+    __m256i height = _mm256_set1_epi32(h);
+    __m256i last_x = _mm256_set1_epi32(w - 1);
+    __m256i last_y = _mm256_set1_epi32(h - 1);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi32(1);
+    __m256i minus_one = _mm256_set1_epi32(-1);
+    __m256i half = _mm256_set1_epi32(0x8000);
+    __m256i frac = _mm256_set1_epi32(0xff);
+    int i = 0;
+
+    for (; i + 8 <= n; i += 8)
+    {
+        __m256i vu = _mm256_add_epi32(_mm256_set1_epi32(u), step_u);
+        __m256i vv = _mm256_add_epi32(_mm256_set1_epi32(v), step_v);
+        __m256i x = _mm256_srai_epi32(_mm256_add_epi32(vu, half), 16);
+        __m256i y = _mm256_srai_epi32(_mm256_add_epi32(vv, half), 16);
+        __m256i inside = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpgt_epi32(x, minus_one), _mm256_cmpgt_epi32(width, x)),
+            _mm256_and_si256(_mm256_cmpgt_epi32(y, minus_one), _mm256_cmpgt_epi32(height, y)));
+        __m256i px;
+
+        if (sample == SAMPLE_NEAREST)
+        {
+            __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y, width), x);
+            px = _mm256_mask_i32gather_epi32(zero, src, index, inside, 4);
+        }
+        else
+        {
+            __m256i x0 = _mm256_srai_epi32(vu, 16);
+            __m256i y0 = _mm256_srai_epi32(vv, 16);
+            __m256i x1 = _mm256_min_epi32(_mm256_add_epi32(x0, one), last_x);
+            __m256i y1 = _mm256_min_epi32(_mm256_add_epi32(y0, one), last_y);
+            x0 = _mm256_max_epi32(x0, zero);
+            y0 = _mm256_max_epi32(y0, zero);
+            __m256i row0 = _mm256_mullo_epi32(y0, width);
+            __m256i row1 = _mm256_mullo_epi32(y1, width);
+
+            __m256i p00 = _mm256_mask_i32gather_epi32(zero, src, _mm256_add_epi32(row0, x0), inside, 4);
+            __m256i p01 = _mm256_mask_i32gather_epi32(zero, src, _mm256_add_epi32(row0, x1), inside, 4);
+            __m256i p10 = _mm256_mask_i32gather_epi32(zero, src, _mm256_add_epi32(row1, x0), inside, 4);
+            __m256i p11 = _mm256_mask_i32gather_epi32(zero, src, _mm256_add_epi32(row1, x1), inside, 4);
+
+            // The weights go in both 16-bit halves of each lane
+            __m256i wx = _mm256_and_si256(_mm256_srli_epi32(vu, 8), frac);
+            __m256i wy = _mm256_and_si256(_mm256_srli_epi32(vv, 8), frac);
+            wx = _mm256_or_si256(wx, _mm256_slli_epi32(wx, 16));
+            wy = _mm256_or_si256(wy, _mm256_slli_epi32(wy, 16));
+            px = bilinear_mix_avx2(bilinear_mix_avx2(p00, p01, wx), bilinear_mix_avx2(p10, p11, wx), wy);
+        }
+
+        _mm256_storeu_si256((__m256i *) (out + i), px);
+        u += 8 * du;
+        v += 8 * dv;
+    }
+    affine_span_scalar(src, w, h, out + i, n - i, u, v, du, dv, sample);
+}
+
+#endif
+
+static void affine_span(const int *src, int w, int h, int *out, int n,
+                        int u, int v, int du, int dv, int sample)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (simd_level() == SIMD_AVX2)
+    {
+        affine_span_avx2(src, w, h, out, n, u, v, du, dv, sample);
+        return;
+    }
+#endif
+    affine_span_scalar(src, w, h, out, n, u, v, du, dv, sample);
+}
+
+// m maps output pixel indices straight to source coordinates with
+// whole numbers at pixel centres
+struct affine_job
+{
+    const int *src;
+    int width;
+    int height;
+    int *dst;
+    int new_width;
+    int new_height;
+    struct affine m;
+    int sample;
+};
+
+// Rows here are rows of tiles of the output
+static void affine_tile_rows(void *ctx, int t0, int t1)
+{
+    struct affine_job *job = (struct affine_job *) ctx;
+    const struct affine *m = &job->m;
+    int w = job->width;
+    int h = job->height;
+    int ow = job->new_width;
+    int oh = job->new_height;
+    int du = affine_fixed(m->a);
+    int dv = affine_fixed(m->d);
+
+    for (int ty = t0 * AFFINE_TILE; ty < t1 * AFFINE_TILE && ty < oh; ty += AFFINE_TILE)
+    {
+        int y1 = ty + AFFINE_TILE < oh ? ty + AFFINE_TILE : oh;
+
+        for (int tx = 0; tx < ow; tx += AFFINE_TILE)
+        {
+            int x1 = tx + AFFINE_TILE < ow ? tx + AFFINE_TILE : ow;
+
+            // The source coordinates of the whole tile lie between
+            // those of its corners
+            double umin = 0, umax = 0, vmin = 0, vmax = 0;
+            for (int c = 0; c < 4; ++c)
+            {
+                int x = c & 1 ? x1 - 1 : tx;
+                int y = c & 2 ? y1 - 1 : ty;
+                double u = m->a * x + m->b * y + m->c;
+                double v = m->d * x + m->e * y + m->f;
+                umin = c == 0 || u < umin ? u : umin;
+                umax = c == 0 || u > umax ? u : umax;
+                vmin = c == 0 || v < vmin ? v : vmin;
+                vmax = c == 0 || v > vmax ? v : vmax;
+            }
+            int outside = umax < -1 || umin > w || vmax < -1 || vmin > h;
+            int fixed = umin > -AFFINE_FIXED_LIMIT && umax < AFFINE_FIXED_LIMIT
+                && vmin > -AFFINE_FIXED_LIMIT && vmax < AFFINE_FIXED_LIMIT;
+
+            for (int y = ty; y < y1; ++y)
+            {
+                int *out = job->dst + (long) y * ow + tx;
+                double u = m->a * tx + m->b * y + m->c;
+                double v = m->d * tx + m->e * y + m->f;
+
+                if (outside)
+                {
+                    memset(out, 0, (x1 - tx) * sizeof(int));
+                }
+                else if (fixed)
+                {
+                    affine_span(job->src, w, h, out, x1 - tx, affine_fixed(u), affine_fixed(v),
+                                du, dv, job->sample);
+                }
+                else
+                {
+                    // Far off coordinates (huge images or extreme
+                    // maps) are converted pixel by pixel
+                    for (int x = 0; x < x1 - tx; ++x, u += m->a, v += m->d)
+                    {
+                        int near = u > -AFFINE_FIXED_LIMIT && u < AFFINE_FIXED_LIMIT
+                            && v > -AFFINE_FIXED_LIMIT && v < AFFINE_FIXED_LIMIT;
+                        out[x] = near ? affine_sample(job->src, w, h, affine_fixed(u), affine_fixed(v),
+                                                      job->sample) : 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+int bitmap_affine(struct bitmap *bmp, const struct affine *inverse, int new_width,
+                  int new_height, int sample)
+{
+    bitmap_materialize(bmp);
+    if (new_width < 1 || new_height < 1 || bmp->width < 1 || bmp->height < 1)
+    {
+        printf("Error: Can't warp a %dx%d image to %dx%d\n", bmp->width, bmp->height, new_width, new_height);
+        return -1;
+    }
+    if (bmp_size_check(new_width, new_height) == -1)
+    {
+        return -1;
+    }
+
+    // The gathers need whole-int pixels
+    int layout = bmp->layout;
+    bitmap_set_layout(bmp, LAYOUT_INT);
+
+    struct affine_job job;
+    job.src = bmp->pixels;
+    job.width = bmp->width;
+    job.height = bmp->height;
+    job.new_width = new_width;
+    job.new_height = new_height;
+    job.sample = sample;
+
+    // Output pixel x is centred at x + 0.5, and source pixel u at u + 0.5
+    job.m = *inverse;
+    job.m.c += 0.5 * (inverse->a + inverse->b) - 0.5;
+    job.m.f += 0.5 * (inverse->d + inverse->e) - 0.5;
+
+    job.dst = (int *) bitmap_new_buffer(bmp, (long) new_width * new_height * sizeof(int));
+    parallel_rows((new_height + AFFINE_TILE - 1) / AFFINE_TILE, affine_tile_rows, &job);
+
+    bitmap_replace_buffer(bmp, job.dst);
+    bmp->width = new_width;
+    bmp->height = new_height;
+    bitmap_set_layout(bmp, layout);
+    return 0;
+}
+
+// Rounds an extent up to whole pixels, ignoring rounding errors
+static int affine_extent(double size)
+{
+    int n = (int) (size - 1e-6);
+    if (n < size - 1e-6)
+    {
+        ++n;
+    }
+    return n < 1 ? 1 : n;
+}
+
+int bitmap_warp(struct bitmap *bmp, const struct affine *forward, int sample)
+{
+    bitmap_materialize(bmp);
+    struct affine m = *forward;
+    m.c = 0;
+    m.f = 0;
+
+    struct affine inverse;
+    if (affine_invert(&m, &inverse) == -1)
+    {
+        printf("Error: The transform squashes the image flat\n");
+        return -1;
+    }
+
+    // The corners of the image, relative to its centre, bound the result
+    double hw = bmp->width / 2.0;
+    double hh = bmp->height / 2.0;
+    double ex = (m.a < 0 ? -m.a : m.a) * hw + (m.b < 0 ? -m.b : m.b) * hh;
+    double ey = (m.d < 0 ? -m.d : m.d) * hw + (m.e < 0 ? -m.e : m.e) * hh;
+    if (2 * ex > INT_MAX || 2 * ey > INT_MAX)
+    {
+        printf("Error: The warped image would be too big for a bitmap file\n");
+        return -1;
+    }
+    int new_width = affine_extent(2 * ex);
+    int new_height = affine_extent(2 * ey);
+
+    // Output centre to the origin, back through m, origin to the
+    // source centre
+    inverse.c = hw - (inverse.a * new_width / 2.0 + inverse.b * new_height / 2.0);
+    inverse.f = hh - (inverse.d * new_width / 2.0 + inverse.e * new_height / 2.0);
+    return bitmap_affine(bmp, &inverse, new_width, new_height, sample);
+}
+
+// Averages of two and four pixels, channel by channel, as done by
+// bitmap_squash and bitmap_shrink
+static int average2_pixel(int p1, int p2)
+{
+    int r1, g1, b1, r2, g2, b2;
+
+    pixel_to_rgb(p1, &r1, &g1, &b1);
+    pixel_to_rgb(p2, &r2, &g2, &b2);
+
+    int changed_pixel;
+    rgb_to_pixel(&changed_pixel, (r1 + r2) / 2, (g1 + g2) / 2, (b1 + b2) / 2);
+    return changed_pixel;
+}
+
+static int average4_pixel(int p1, int p2, int p3, int p4)
+{
+    int r1, g1, b1, r2, g2, b2, r3, g3, b3, r4, g4, b4;
+
+    pixel_to_rgb(p1, &r1, &g1, &b1);
+    pixel_to_rgb(p2, &r2, &g2, &b2);
+    pixel_to_rgb(p3, &r3, &g3, &b3);
+    pixel_to_rgb(p4, &r4, &g4, &b4);
+
+    int changed_pixel;
+    rgb_to_pixel(&changed_pixel,
+        (r1 + r2 + r3 + r4) / 4,
+        (g1 + g2 + g3 + g4) / 4,
+        (b1 + b2 + b3 + b4) / 4);
+    return changed_pixel;
+}
+
+// Applies a per-pixel op to a run of n pixels, posterizing with the
+// given table (NULL for the buckets of bitmap_posterize)
+static void point_op_span(int op, const struct posterize_table *posterize, int *px, long n)
+{
+    if (gray_op_weights(op) != NULL)
+    {
+        grayscale_span(gray_op_weights(op), px, n);
+    }
+    else if (op == OP_POSTERIZE && posterize != NULL)
+    {
+        posterize_table_span(posterize, px, n);
+    }
+    else if (op == OP_POSTERIZE)
+    {
+        posterize_span(px, n);
+    }
+}
+
+static int op_from_letter(char letter)
+{
+    switch (letter)
+    {
+    case 'g': case 'G': return OP_GRAYSCALE;
+    case 'p': case 'P': return OP_POSTERIZE;
+    case 'u': case 'U': return OP_SQUASH;
+    case 'm': case 'M': return OP_MIRROR;
+    case 'r': case 'R': return OP_REFLECT;
+    case 'o': case 'O': return OP_ROTATE;
+    case 'k': case 'K': return OP_SKEW;
+    case 'h': case 'H': return OP_SHRINK;
+    }
+    return -1;
+}
+
+// Composes two orientations: applying a and then b is the same as
+// applying the returned code once.
+static int orient_compose(int a, int b)
+{
+    int transposed = a & ORIENT_TRANSPOSE;
+    int bx = (b & ORIENT_FLIP_X) ? 1 : 0;
+    int by = (b & ORIENT_FLIP_Y) ? 1 : 0;
+
+    // b's flips end up on the other axis if a transposes
+    int fx = ((a & ORIENT_FLIP_X) ? 1 : 0) ^ (transposed ? by : bx);
+    int fy = ((a & ORIENT_FLIP_Y) ? 1 : 0) ^ (transposed ? bx : by);
+
+    return ((a ^ b) & ORIENT_TRANSPOSE)
+        | (fx ? ORIENT_FLIP_X : 0)
+        | (fy ? ORIENT_FLIP_Y : 0);
+}
+
+// Size of the image produced by a remap stage
+static void remap_stage_out_size(const struct remap_stage *st, int *w, int *h)
+{
+    if (st->kind == REMAP_ORIENT && (st->orient & ORIENT_TRANSPOSE))
+    {
+        int t = *w;
+        *w = *h;
+        *h = t;
+    }
+    else if (st->kind == REMAP_MIRROR)
+    {
+        *w *= 2;
+    }
+}
+
+// Maps pixel (x, y) of a stage's output back to the pixel of its input
+// it came from. Returns 0 if it has no source (the tail left empty by
+// bitmap_skew).
+static int remap_stage_source(const struct remap_stage *st, int *x, int *y)
+{
+    int w = st->in_width;
+    int h = st->in_height;
+
+    if (st->kind == REMAP_ORIENT)
+    {
+        if (st->orient & ORIENT_TRANSPOSE)
+        {
+            int t = *x;
+            *x = *y;
+            *y = t;
+        }
+        if (st->orient & ORIENT_FLIP_X)
+        {
+            *x = w - 1 - *x;
+        }
+        if (st->orient & ORIENT_FLIP_Y)
+        {
+            *y = h - 1 - *y;
+        }
+    }
+    else if (st->kind == REMAP_MIRROR)
+    {
+        if (*x >= w)
+        {
+            *x = 2 * w - 1 - *x;
+        }
+    }
+    else if (st->kind == REMAP_SKEW)
+    {
+        // bitmap_skew moves pixel i of the buffer to i - y, so row y
+        // lands at y * (w - 1) and overwrites the last pixel of row y - 1.
+        long j = (long) *y * w + *x;
+        if (w == 1)
+        {
+            if (j != 0)
+            {
+                return 0;
+            }
+            *y = h - 1;
+            return 1;
+        }
+
+        long sy = j / (w - 1);
+        long sx = j - sy * (w - 1);
+        if (sy == h && sx == 0)
+        {
+            sy = h - 1;
+            sx = w - 1;
+        }
+        else if (sy >= h)
+        {
+            return 0;
+        }
+        *x = (int) sx;
+        *y = (int) sy;
+    }
+    return 1;
+}
+
+// ---- LAYOUT_BGR24 ----
+// Each channel is a byte of its own here, so the per-pixel kernels
+// work on 16 or 32 channels per instruction with no shifting and
+// masking, and an image takes 3/4 of the memory of LAYOUT_INT.
+
+static void bgr24_grayscale_span_scalar(const struct gray_weights *w, byte *p, long n)
+{
+    for (long i = 0; i < n; ++i, p += 3)
+    {
+        byte gray = (w->blue * p[0] + w->green * p[1] + w->red * p[2] + w->round) >> 15;
+        p[0] = gray;
+        p[1] = gray;
+        p[2] = gray;
+    }
+}
+
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+
+// Grayscale on 16 pixels (48 bytes) at a time: shuffle the B, G and R
+// bytes into a vector each, widen them to 16 bits, weigh them as in
+// grayscale_sse2, then shuffle each gray byte back out three times.
+__attribute__((target("ssse3")))
+static void bgr24_grayscale_span_ssse3(const struct gray_weights *w, byte *p, long n)
+{
+    const __m128i b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+    const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+    const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+    const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+    const __m128i r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+    const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+    const __m128i o0 = _mm_setr_epi8(0, 0, 0, 1, 1, 1, 2, 2, 2, 3, 3, 3, 4, 4, 4, 5);
+    const __m128i o1 = _mm_setr_epi8(5, 5, 6, 6, 6, 7, 7, 7, 8, 8, 8, 9, 9, 9, 10, 10);
+    const __m128i o2 = _mm_setr_epi8(10, 11, 11, 11, 12, 12, 12, 13, 13, 13, 14, 14, 14, 15, 15, 15);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i blue_red = _mm_set1_epi32((w->red << 16) | w->blue);
+    const __m128i green = _mm_set1_epi32(w->green);
+    const __m128i round = _mm_set1_epi32(w->round);
+
+    long i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i *q = (__m128i *) (p + 3 * i);
+        __m128i v0 = _mm_loadu_si128(q);
+        __m128i v1 = _mm_loadu_si128(q + 1);
+        __m128i v2 = _mm_loadu_si128(q + 2);
+
+        __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1)),
+                                 _mm_shuffle_epi8(v2, b2));
+        __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1)),
+                                 _mm_shuffle_epi8(v2, g2));
+        __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1)),
+                                 _mm_shuffle_epi8(v2, r2));
+
+        __m128i lo = grayscale_lanes_sse2(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(g, zero),
+                                          _mm_unpacklo_epi8(r, zero), blue_red, green, round);
+        __m128i hi = grayscale_lanes_sse2(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(g, zero),
+                                          _mm_unpackhi_epi8(r, zero), blue_red, green, round);
+        __m128i gray = _mm_packus_epi16(lo, hi);
+
+        _mm_storeu_si128(q, _mm_shuffle_epi8(gray, o0));
+        _mm_storeu_si128(q + 1, _mm_shuffle_epi8(gray, o1));
+        _mm_storeu_si128(q + 2, _mm_shuffle_epi8(gray, o2));
+    }
+    bgr24_grayscale_span_scalar(w, p + 3 * i, n - i);
+}
+
+#endif
+
+// Applies a per-pixel op to a run of n BGR24 pixels
+static void bgr24_point_span(int op, byte *p, long n)
+{
+#if defined(HAVE_X86_KERNELS) && defined(__SSE2__)
+    if (gray_op_weights(op) != NULL && simd_ssse3())
+    {
+        bgr24_grayscale_span_ssse3(gray_op_weights(op), p, n);
+        return;
+    }
+#endif
+    if (gray_op_weights(op) != NULL)
+    {
+        bgr24_grayscale_span_scalar(gray_op_weights(op), p, n);
+    }
+    else if (op == OP_POSTERIZE)
+    {
+        bgr24_posterize_table_span(posterize_legacy(), p, n);
+    }
+}
+
+// What a range of rows of a BGR24 op needs: the new pixels and their
+// size, and which op or remap stage to run
+struct bgr24_job
+{
+    struct bitmap *bmp;
+    const struct remap_stage *st;
+    byte *dst;
+    int new_width;
+    int new_height;
+    int op;
+};
+
+static void bgr24_point_rows(void *ctx, int y0, int y1)
+{
+    struct bgr24_job *job = (struct bgr24_job *) ctx;
+    struct bitmap *bmp = job->bmp;
+    bgr24_point_span(job->op, bmp->bgr + (long) y0 * bmp->width * 3, (long) (y1 - y0) * bmp->width);
+}
+
+static void bgr24_point(struct bitmap *bmp, int op)
+{
+    struct bgr24_job job = { bmp, NULL, NULL, 0, 0, op };
+    parallel_rows(bmp->height, bgr24_point_rows, &job);
+}
+
+// Rows here are rows of the output. Every channel is averaged on its
+// own, as average2_pixel and average4_pixel do.
+// Copies n pixels, in reverse order if reverse is set
+static void bgr24_copy_pixels(byte *dst, const byte *src, int n, int reverse)
+{
+    if (n == 0)
+    {
+        // Rows of an empty image, which has no buffer to point into
+        return;
+    }
+    if (!reverse)
+    {
+        memcpy(dst, src, (size_t) n * 3);
+        return;
+    }
+    src += (long) (n - 1) * 3;
+    for (int x = 0; x < n; ++x, dst += 3, src -= 3)
+    {
+        dst[0] = src[0];
+        dst[1] = src[1];
+        dst[2] = src[2];
+    }
+}
+
+// Flips and mirrors: every output row is a source row, maybe reversed
+static void bgr24_remap_rows(void *ctx, int y0, int y1)
+{
+    struct bgr24_job *job = (struct bgr24_job *) ctx;
+    const struct remap_stage *st = job->st;
+    int w = job->bmp->width;
+    int h = job->bmp->height;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        byte *out = job->dst + (long) y * job->new_width * 3;
+        if (st->kind == REMAP_MIRROR)
+        {
+            const byte *row = job->bmp->bgr + (long) y * w * 3;
+            bgr24_copy_pixels(out, row, w, 0);
+            bgr24_copy_pixels(out + (long) w * 3, row, w, 1);
+        }
+        else
+        {
+            int sy = (st->orient & ORIENT_FLIP_Y) ? h - 1 - y : y;
+            bgr24_copy_pixels(out, job->bmp->bgr + (long) sy * w * 3, w, st->orient & ORIENT_FLIP_X);
+        }
+    }
+}
+
+// Rows here are rows of the source. Row y moves to y * (w - 1) in the
+// buffer, as in skew_rows; the rows that finish the image also fill
+// the tail left behind.
+static void bgr24_skew_rows(void *ctx, int y0, int y1)
+{
+    struct bgr24_job *job = (struct bgr24_job *) ctx;
+    int w = job->bmp->width;
+    int h = job->bmp->height;
+    if (w == 0)
+    {
+        return;
+    }
+
+    for (int y = y0; y < y1; ++y)
+    {
+        int n = y + 1 < h ? w - 1 : w;
+        memcpy(job->dst + (long) y * (w - 1) * 3, job->bmp->bgr + (long) y * w * 3, (size_t) n * 3);
+    }
+
+    if (y1 == h)
+    {
+        const struct remap_stage *st = job->st;
+        byte *out = job->dst + ((long) (h - 1) * (w - 1) + w) * 3;
+        byte *end = job->dst + (long) w * h * 3;
+        for (; out < end; out += 3)
+        {
+            out[0] = st->fill & 0xff;
+            out[1] = (st->fill >> 8) & 0xff;
+            out[2] = (st->fill >> 16) & 0xff;
+        }
+    }
+}
+
+// Transposing orientations, in rows of ORIENT_TILE tiles of the
+// output so that the source is read a tile at a time
+static void bgr24_orient_tile_rows(void *ctx, int t0, int t1)
+{
+    struct bgr24_job *job = (struct bgr24_job *) ctx;
+    int orient = job->st->orient;
+    const byte *src = job->bmp->bgr;
+    int w = job->bmp->width;
+    int h = job->bmp->height;
+    int ow = job->new_width;
+    int oh = job->new_height;
+
+    for (int ty = t0 * ORIENT_TILE; ty < t1 * ORIENT_TILE && ty < oh; ty += ORIENT_TILE)
+    {
+        int y1 = ty + ORIENT_TILE < oh ? ty + ORIENT_TILE : oh;
+
+        for (int tx = 0; tx < ow; tx += ORIENT_TILE)
+        {
+            int x1 = tx + ORIENT_TILE < ow ? tx + ORIENT_TILE : ow;
+
+            for (int y = ty; y < y1; ++y)
+            {
+                // Output (x, y) is source (y, x), then flipped
+                int sx = (orient & ORIENT_FLIP_X) ? w - 1 - y : y;
+                byte *out = job->dst + ((long) y * ow + tx) * 3;
+                for (int x = tx; x < x1; ++x, out += 3)
+                {
+                    int sy = (orient & ORIENT_FLIP_Y) ? h - 1 - x : x;
+                    const byte *in = src + ((long) sy * w + sx) * 3;
+                    out[0] = in[0];
+                    out[1] = in[1];
+                    out[2] = in[2];
+                }
+            }
+        }
+    }
+}
+
+// Runs one remap stage (its in_width and in_height are filled in
+// here) on a BGR24 bitmap
+static void bgr24_remap(struct bitmap *bmp, const struct remap_stage *st)
+{
+    struct remap_stage stage = *st;
+    stage.in_width = bmp->width;
+    stage.in_height = bmp->height;
+
+    int new_width = bmp->width;
+    int new_height = bmp->height;
+    remap_stage_out_size(&stage, &new_width, &new_height);
+    byte *dst = (byte *) bitmap_new_buffer(bmp, (long) new_width * new_height * 3);
+
+    struct bgr24_job job = { bmp, &stage, dst, new_width, new_height, 0 };
+    if (stage.kind == REMAP_SKEW)
+    {
+        parallel_rows(bmp->height, bgr24_skew_rows, &job);
+    }
+    else if (stage.kind == REMAP_ORIENT && (stage.orient & ORIENT_TRANSPOSE))
+    {
+        parallel_rows((new_height + ORIENT_TILE - 1) / ORIENT_TILE, bgr24_orient_tile_rows, &job);
+    }
+    else
+    {
+        parallel_rows(new_height, bgr24_remap_rows, &job);
+    }
+
+    bitmap_replace_buffer(bmp, dst);
+    bmp->width = new_width;
+    bmp->height = new_height;
+}
+
+// Where a pass reads its pixels from: a decoded pixel array, or
+// straight from the 24-bit or 32-bit rows (bpp bytes per pixel) of a
+// mapped BMP file when pixels is NULL. 32-bit pixels are used as they
+// are, with no copy or conversion, since they already are ints.
+struct pixel_source
+{
+    int *pixels;
+    byte *file;
+    int offset;
+    int stride;
+    int width;
+    int height;
+    int bpp;
+};
+
+static inline int source_pixel(const struct pixel_source *src, int x, int y)
+{
+    if (src->pixels != NULL)
+    {
+        return src->pixels[(long) y * src->width + x];
+    }
+
+    // Rows are stored bottom to top (top-down files have offset at
+    // their last row and a negative stride)
+    byte *p = src->file + src->offset + (long) (src->height - 1 - y) * src->stride + src->bpp * x;
+    if (src->bpp == 4)
+    {
+        return *((int *) p) & 0xffffff;
+    }
+    return (p[2] << 16) | (p[1] << 8) | p[0];
+}
+
+// Reads pixel (x, y) of the image a pass's resample step would produce
+static int pass_sample(int resample, const struct pixel_source *src, int x, int y)
+{
+    if (resample == OP_SQUASH)
+    {
+        return average2_pixel(source_pixel(src, 2 * x, y), source_pixel(src, 2 * x + 1, y));
+    }
+    else if (resample == OP_SHRINK)
+    {
+        return average4_pixel(source_pixel(src, 2 * x, 2 * y), source_pixel(src, 2 * x + 1, 2 * y),
+            source_pixel(src, 2 * x, 2 * y + 1), source_pixel(src, 2 * x + 1, 2 * y + 1));
+    }
+    return source_pixel(src, x, y);
+}
+
+static void pipeline_init_pass(struct pipeline_pass *pass)
+{
+    pass->resample = -1;
+    pass->nremaps = 0;
+    pass->npoint = 0;
+    pass->posterize = NULL;
+}
+
+// Adds a remap to the end of a pass. Returns -1 if the pass is full.
+static int pass_add_remap(struct pipeline_pass *pass, const struct remap_stage *st)
+{
+    // A mirrored image reads the same both ways, so a reflect after a
+    // mirror does nothing
+    if (st->kind == REMAP_ORIENT && st->orient == ORIENT_FLIP_X && pass->nremaps > 0
+        && pass->remaps[pass->nremaps - 1].kind == REMAP_MIRROR)
+    {
+        return 0;
+    }
+
+    // Per-pixel ops don't move pixels, so back to back orientations
+    // compose even with some of them in between.
+    if (st->kind == REMAP_ORIENT && pass->nremaps > 0
+        && pass->remaps[pass->nremaps - 1].kind == REMAP_ORIENT)
+    {
+        struct remap_stage *last = &pass->remaps[pass->nremaps - 1];
+        last->orient = orient_compose(last->orient, st->orient);
+        if (last->orient == 0)
+        {
+            pass->nremaps--;
+        }
+        return 0;
+    }
+
+    if (pass->nremaps == MAX_PIPELINE_OPS)
+    {
+        return -1;
+    }
+    pass->remaps[pass->nremaps++] = *st;
+    return 0;
+}
+
+static int pipeline_add_op(struct pipeline *pl, int op)
+{
+    struct pipeline_pass *pass = &pl->passes[pl->npasses - 1];
+
+    if (op == OP_SQUASH || op == OP_SHRINK)
+    {
+        // A resample has to see the finished pixels of everything
+        // before it, so it starts a new pass.
+        if (pass->resample >= 0 || pass->nremaps > 0 || pass->npoint > 0)
+        {
+            if (pl->npasses == MAX_PIPELINE_OPS)
+            {
+                return -1;
+            }
+            pass = &pl->passes[pl->npasses++];
+            pipeline_init_pass(pass);
+        }
+        pass->resample = op;
+        return 0;
+    }
+
+    if (op == OP_GRAYSCALE || op == OP_POSTERIZE)
+    {
+        if (pass->npoint == MAX_PIPELINE_OPS)
+        {
+            return -1;
+        }
+        pass->point_ops[pass->npoint++] = op;
+        return 0;
+    }
+
+    struct remap_stage st = { REMAP_ORIENT, 0, 0, pass->npoint, 0, 0 };
+    if (op == OP_REFLECT)
+    {
+        st.orient = ORIENT_FLIP_X;
+    }
+    else if (op == OP_ROTATE)
+    {
+        st.orient = ORIENT_TRANSPOSE;
+    }
+    else if (op == OP_MIRROR)
+    {
+        st.kind = REMAP_MIRROR;
+    }
+    else
+    {
+        st.kind = REMAP_SKEW;
+    }
+    return pass_add_remap(pass, &st);
+}
+
+// The empty tail of a skew only sees the per-pixel ops after it
+static void pipeline_set_fills(struct pipeline *pl)
+{
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        struct pipeline_pass *pass = &pl->passes[i];
+        for (int s = 0; s < pass->nremaps; ++s)
+        {
+            struct remap_stage *st = &pass->remaps[s];
+            st->fill = 0;
+            for (int k = st->fill_from; k < pass->npoint; ++k)
+            {
+                point_op_span(pass->point_ops[k], pass->posterize, &st->fill, 1);
+            }
+        }
+    }
+}
+
+int pipeline_plan(const char *ops, struct pipeline *pl)
+{
+    pl->npasses = 1;
+    pl->warp = 0;
+    pl->resize_width = 0;
+    pipeline_init_pass(&pl->passes[0]);
+
+    for (const char *c = ops; *c != '\0'; ++c)
+    {
+        if (*c == ',')
+        {
+            continue;
+        }
+
+        int op = op_from_letter(*c);
+        if (op == -1 || (c[1] != ',' && c[1] != '\0'))
+        {
+            printf("Error: Unknown operation in \"%s\"\n", ops);
+            return -1;
+        }
+        if (pipeline_add_op(pl, op) == -1)
+        {
+            printf("Error: Too many operations in \"%s\"\n", ops);
+            return -1;
+        }
+    }
+
+    pipeline_set_fills(pl);
+    return 0;
+}
+
+void pipeline_set_posterize(struct pipeline *pl, const struct posterize_table *t)
+{
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        pl->passes[i].posterize = t;
+    }
+    pipeline_set_fills(pl);
+}
+
+void pipeline_set_grayscale(struct pipeline *pl, int mode)
+{
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        struct pipeline_pass *pass = &pl->passes[i];
+        for (int k = 0; k < pass->npoint; ++k)
+        {
+            if (gray_op_weights(pass->point_ops[k]) != NULL)
+            {
+                pass->point_ops[k] = gray_ops[mode];
+            }
+        }
+    }
+    pipeline_set_fills(pl);
+}
+
+void pipeline_set_resize(struct pipeline *pl, int width, int height, int filter)
+{
+    pl->resize_width = width;
+    pl->resize_height = height;
+    pl->resize_filter = filter;
+}
+
+void pipeline_set_warp(struct pipeline *pl, const struct affine *forward, int sample)
+{
+    pl->warp = 1;
+    pl->warp_forward = *forward;
+    pl->warp_sample = sample;
+}
+
+// A pass being run: the stages with their sizes filled in, where the
+// pixels come from and where the output goes. If out_file is set, each
+// finished row is encoded straight into that mapped BMP file instead
+// of new_pixels.
+struct pass_job
+{
+    const struct pipeline_pass *pass;
+    const struct remap_stage *stages;
+    struct pixel_source src;
+    int *new_pixels;
+    int width;
+    int height;
+    byte *out_file;
+};
+
+static void pass_point_rows(void *ctx, int y0, int y1)
+{
+    struct pass_job *job = (struct pass_job *) ctx;
+
+    for (int y = y0; y < y1; ++y)
+    {
+        for (int k = 0; k < job->pass->npoint; ++k)
+        {
+            point_op_span(job->pass->point_ops[k], job->pass->posterize, job->src.pixels + (long) y * job->width, job->width);
+        }
+    }
+}
+
+static void pass_remap_rows(void *ctx, int y0, int y1)
+{
+    struct pass_job *job = (struct pass_job *) ctx;
+    const struct pipeline_pass *pass = job->pass;
+    int w = job->width;
+    int *fill_x = (int *) thread_scratch(SCRATCH_REMAP, 3 * (long) w * sizeof(int));
+    int *fill_v = fill_x + w;
+    int *scratch = fill_v + w;
+    struct bitmap out = { w, job->height, NULL, LAYOUT_INT, NULL, NULL, NULL, NULL };
+    int stride = bmp_file_stride(&out);
+
+    for (int y = y0; y < y1; ++y)
+    {
+        int *row = job->out_file != NULL ? scratch : job->new_pixels + (long) y * w;
+        int nfill = 0;
+
+        for (int x = 0; x < w; ++x)
+        {
+            int sx = x;
+            int sy = y;
+            int s = pass->nremaps - 1;
+            while (s >= 0 && remap_stage_source(&job->stages[s], &sx, &sy))
+            {
+                --s;
+            }
+
+            if (s >= 0)
+            {
+                fill_x[nfill] = x;
+                fill_v[nfill] = job->stages[s].fill;
+                ++nfill;
+                row[x] = 0;
+            }
+            else
+            {
+                row[x] = pass_sample(pass->resample, &job->src, sx, sy);
+            }
+        }
+
+        for (int k = 0; k < pass->npoint; ++k)
+        {
+            point_op_span(pass->point_ops[k], pass->posterize, row, w);
+        }
+        for (int f = 0; f < nfill; ++f)
+        {
+            row[fill_x[f]] = fill_v[f];
+        }
+
+        if (job->out_file != NULL)
+        {
+            encode_row(row, job->out_file + 54 + (long) (job->height - 1 - y) * stride, w);
+        }
+    }
+}
+
+// Fills in the sizes of a pass's stages for a w x h input, and returns
+// the size of its output in w and h
+static void pass_prepare(const struct pipeline_pass *pass, struct remap_stage *stages, int *w, int *h)
+{
+    if (pass->resample == OP_SQUASH)
+    {
+        *w /= 2;
+    }
+    else if (pass->resample == OP_SHRINK)
+    {
+        *w /= 2;
+        *h /= 2;
+    }
+    for (int s = 0; s < pass->nremaps; ++s)
+    {
+        stages[s] = pass->remaps[s];
+        stages[s].in_width = *w;
+        stages[s].in_height = *h;
+        remap_stage_out_size(&stages[s], w, h);
+    }
+}
+
+static void pipeline_run_pass(const struct pipeline_pass *pass, struct bitmap *bmp)
+{
+    struct remap_stage stages[MAX_PIPELINE_OPS];
+    int w = bmp->width;
+    int h = bmp->height;
+    pass_prepare(pass, stages, &w, &h);
+
+    struct pass_job job = { pass, stages, { bmp->pixels, NULL, 0, 0, bmp->width, bmp->height, 4 },
+                            NULL, w, h, NULL };
+
+    if (pass->resample == -1 && pass->nremaps == 0)
+    {
+        // Nothing moves: run the per-pixel ops in place, row by row
+        parallel_rows(h, pass_point_rows, &job);
+        return;
+    }
+
+    if (pass->resample == -1 && pass->nremaps == 1 && stages[0].kind == REMAP_ORIENT)
+    {
+        // A lone orientation goes through the tiled version, then the
+        // per-pixel ops run in place
+        bitmap_orient(bmp, stages[0].orient);
+        job.src.pixels = bmp->pixels;
+        parallel_rows(h, pass_point_rows, &job);
+        return;
+    }
+
+    job.new_pixels = (int *) bitmap_new_buffer(bmp, (long) w * h * sizeof(int));
+    parallel_rows(h, pass_remap_rows, &job);
+
+    bitmap_replace_buffer(bmp, job.new_pixels);
+    bmp->width = w;
+    bmp->height = h;
+}
+
+int pipeline_is_direct(const struct pipeline *pl)
+{
+    return pl->npasses == 1 && !pl->warp && pl->resize_width == 0;
+}
+
+// Runs a pass from src into the rows of a new 24-bit out_filename.
+// in_bytes is what reading src costs, for the trace.
+static int pass_run_to_file(const struct pipeline_pass *pass, const struct pixel_source *src, long in_bytes,
+                            char *out_filename)
+{
+    struct remap_stage stages[MAX_PIPELINE_OPS];
+    struct bitmap out = { src->width, src->height, NULL, LAYOUT_INT, NULL, NULL, NULL, NULL };
+    pass_prepare(pass, stages, &out.width, &out.height);
+
+    int file_size = bmp_file_size(&out);
+    int ev = trace_begin("map_file_for_writing");
+    byte *o_pointer = map_file_for_writing(out_filename, file_size);
+    trace_end(ev, 0);
+    if (o_pointer == NULL)
+    {
+        return -1;
+    }
+    write_bitmap_header(o_pointer, &out);
+
+    struct pass_job job = { pass, stages, *src, NULL, out.width, out.height, o_pointer };
+    ev = trace_begin("direct transform");
+    parallel_rows(out.height, pass_remap_rows, &job);
+    trace_end(ev, in_bytes + file_size);
+
+    ev = trace_begin("munmap");
+    munmap(o_pointer, file_size);
+    trace_end(ev, file_size);
+    return 0;
+}
+
+int pipeline_run_direct(const struct pipeline *pl, void *bmp_file, char *out_filename)
+{
+    return pipeline_run_direct_rect(pl, bmp_file, NULL, out_filename);
+}
+
+int pipeline_run_direct_rect(const struct pipeline *pl, void *bmp_file, const struct rect *r, char *out_filename)
+{
+    struct bitmap in;
+    struct bmp_format fmt;
+    if (read_bitmap_format(bmp_file, &in, &fmt) == -1 || !pipeline_is_direct(pl))
+    {
+        return -1;
+    }
+    if (fmt.format != BMP_BGR24 && fmt.format != BMP_BGRA32)
+    {
+        printf("Error: Only 24-bit and 32-bit BGRA bitmaps can be transformed directly\n");
+        return -1;
+    }
+    struct rect whole = { 0, 0, in.width, in.height };
+    if (r == NULL)
+    {
+        r = &whole;
+    }
+    else if (!rect_inside(r, in.width, in.height))
+    {
+        return -1;
+    }
+
+    // The source's rows run from its offset, its last row first, so the
+    // window starts at the stored row of its last row
+    int bpp = fmt.format == BMP_BGRA32 ? 4 : 3;
+    struct pixel_source src = { NULL, (byte *) bmp_file, fmt.offset, fmt.stride, r->width, r->height, bpp };
+    if (fmt.top_down)
+    {
+        src.offset += (in.height - 1) * fmt.stride;
+        src.stride = -fmt.stride;
+    }
+    src.offset += (long) (in.height - r->y - r->height) * src.stride + (long) r->x * bpp;
+    long in_bytes = r == &whole ? bmp_format_file_size(&fmt, &in) : (long) r->height * r->width * bpp;
+    return pass_run_to_file(&pl->passes[0], &src, in_bytes, out_filename);
+}
+
+int pipeline_run_direct_bitmap(const struct pipeline *pl, const struct bitmap *bmp, char *out_filename)
+{
+    if (!pipeline_is_direct(pl) || bmp->layout != LAYOUT_INT || bmp->pending != NULL)
+    {
+        return -1;
+    }
+    struct pixel_source src = { bmp->pixels, NULL, 0, 0, bmp->width, bmp->height, 4 };
+    return pass_run_to_file(&pl->passes[0], &src, bitmap_bytes(bmp), out_filename);
+}
+
+// The same pass for a LAYOUT_BGR24 bitmap, one step at a time. The
+// per-pixel ops go first, where there are no more pixels than after
+// the remaps; the skew tails they then don't see get their fill.
+static void pipeline_run_pass_bgr24(const struct pipeline_pass *pass, struct bitmap *bmp)
+{
+    if (pass->resample != -1)
+    {
+        bitmap_downsample(bmp, 2, pass->resample == OP_SHRINK ? 2 : 1);
+    }
+    for (int k = 0; k < pass->npoint; ++k)
+    {
+        if (pass->point_ops[k] == OP_POSTERIZE && pass->posterize != NULL)
+        {
+            bitmap_posterize_table(bmp, pass->posterize);
+        }
+        else
+        {
+            bgr24_point(bmp, pass->point_ops[k]);
+        }
+    }
+    for (int s = 0; s < pass->nremaps; ++s)
+    {
+        bgr24_remap(bmp, &pass->remaps[s]);
+    }
+}
+
+int pipeline_run(const struct pipeline *pl, struct bitmap *bmp)
+{
+    // The passes move the pixels themselves, so a lazy bitmap is
+    // brought up to date and taken out of lazy mode while they run
+    bitmap_materialize(bmp);
+    struct pipeline_pass *pending = bmp->pending;
+    bmp->pending = NULL;
+
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "pipeline pass %d", i + 1);
+        long in_bytes = bitmap_bytes(bmp);
+
+        int ev = trace_begin(name);
+        if (bmp->layout == LAYOUT_BGR24)
+        {
+            pipeline_run_pass_bgr24(&pl->passes[i], bmp);
+        }
+        else
+        {
+            pipeline_run_pass(&pl->passes[i], bmp);
+        }
+        trace_end(ev, in_bytes + bitmap_bytes(bmp));
+    }
+
+    int result = 0;
+    if (pl->warp)
+    {
+        long in_bytes = bitmap_bytes(bmp);
+        int ev = trace_begin("warp");
+        result = bitmap_warp(bmp, &pl->warp_forward, pl->warp_sample);
+        trace_end(ev, in_bytes + bitmap_bytes(bmp));
+    }
+
+    if (pl->resize_width != 0 && result == 0)
+    {
+        long in_bytes = bitmap_bytes(bmp);
+        int ev = trace_begin("resize");
+        result = bitmap_resize(bmp, pl->resize_width, pl->resize_height, pl->resize_filter);
+        trace_end(ev, in_bytes + bitmap_bytes(bmp));
+    }
+    bmp->pending = pending;
+    return result;
+}
+
+// ---- Lazy geometric ops ----
+
+void bitmap_set_lazy(struct bitmap *bmp, int lazy)
+{
+    if (lazy && bmp->pending == NULL)
+    {
+        bmp->pending = (struct pipeline_pass *) bitmap_malloc(sizeof(struct pipeline_pass));
+        pipeline_init_pass(bmp->pending);
+    }
+    else if (!lazy && bmp->pending != NULL)
+    {
+        bitmap_materialize(bmp);
+        free(bmp->pending);
+        bmp->pending = NULL;
+    }
+}
+
+void bitmap_materialize(struct bitmap *bmp)
+{
+    struct pipeline_pass *pending = bmp->pending;
+    if (pending == NULL || pending->nremaps == 0)
+    {
+        return;
+    }
+
+    // What is left once the remaps have composed runs through the
+    // ops' own kernels (tiled for orientations), which beats walking
+    // every pixel back through a chain of stages. bmp leaves lazy mode
+    // meanwhile so that they happen now instead of being deferred.
+    bmp->pending = NULL;
+    long in_bytes = bitmap_bytes(bmp);
+    int ev = trace_begin("materialize");
+    for (int s = 0; s < pending->nremaps; ++s)
+    {
+        const struct remap_stage *st = &pending->remaps[s];
+        if (bmp->layout == LAYOUT_BGR24)
+        {
+            bgr24_remap(bmp, st);
+        }
+        else if (st->kind == REMAP_ORIENT)
+        {
+            bitmap_orient(bmp, st->orient);
+        }
+        else if (st->kind == REMAP_MIRROR)
+        {
+            bitmap_mirror(bmp);
+        }
+        else
+        {
+            // bitmap_skew leaves its tail black, but per-pixel ops
+            // since may have given it another fill
+            bitmap_skew(bmp);
+            long n = (long) bmp->width * bmp->height;
+            long tail = bmp->width > 0 ? (long) (bmp->height - 1) * (bmp->width - 1) + bmp->width : n;
+            for (long i = tail; i < n && st->fill != 0; ++i)
+            {
+                bmp->pixels[i] = st->fill;
+            }
+        }
+    }
+    trace_end(ev, in_bytes + bitmap_bytes(bmp));
+
+    pipeline_init_pass(pending);
+    bmp->pending = pending;
+}
+
+static int bitmap_defer(struct bitmap *bmp, const struct remap_stage *st)
+{
+    if (bmp->pending == NULL)
+    {
+        return 0;
+    }
+    if (pass_add_remap(bmp->pending, st) == -1)
+    {
+        // A full pass is applied to make room
+        bitmap_materialize(bmp);
+        pass_add_remap(bmp->pending, st);
+    }
+    return 1;
+}
+
+// The per-pixel op itself runs on the pixels as they are, since it
+// doesn't care where they end up. Only the black tails of pending
+// skews, which don't exist yet, have to be told about it.
+static void bitmap_defer_point(struct bitmap *bmp, int op, const struct posterize_table *t)
+{
+    if (bmp->pending == NULL)
+    {
+        return;
+    }
+    for (int s = 0; s < bmp->pending->nremaps; ++s)
+    {
+        point_op_span(op, t, &bmp->pending->remaps[s].fill, 1);
+    }
+}
+
+// ---- Undo history ----
+
+// A tile of pixels, with its rows packed together, shared by refs
+// states
+struct history_tile
+{
+    int refs;
+    long bytes;
+    byte data[];
+};
+
+static int history_tiles(int width, int height)
+{
+    return ((width + HISTORY_TILE - 1) / HISTORY_TILE) * ((height + HISTORY_TILE - 1) / HISTORY_TILE);
+}
+
+void history_init(struct history *h, long budget)
+{
+    h->states = NULL;
+    h->nstates = 0;
+    h->capacity = 0;
+    h->current = -1;
+    h->budget = budget;
+    h->bytes = 0;
+}
+
+static void history_state_free(struct history *h, struct history_state *st)
+{
+    int ntiles = history_tiles(st->width, st->height);
+    for (int i = 0; i < ntiles; ++i)
+    {
+        if (--st->tiles[i]->refs == 0)
+        {
+            h->bytes -= st->tiles[i]->bytes;
+            free(st->tiles[i]);
+        }
+    }
+    free(st->tiles);
+    free(st->pending);
+}
+
+void history_release(struct history *h)
+{
+    for (int i = 0; i < h->nstates; ++i)
+    {
+        history_state_free(h, &h->states[i]);
+    }
+    free(h->states);
+    history_init(h, h->budget);
+}
+
+struct history_job
+{
+    const byte *pixels;
+    int bpp;
+    const struct history_state *prev;
+    struct history_state *st;
+    long new_bytes;
+};
+
+// Rows here are rows of tiles. A tile the same as the one in its place
+// in the previous state is shared with it, and only a changed one is
+// copied.
+static void history_tile_rows(void *ctx, int t0, int t1)
+{
+    struct history_job *job = (struct history_job *) ctx;
+    struct history_state *st = job->st;
+    long row_bytes = (long) st->width * job->bpp;
+    int tiles_x = (st->width + HISTORY_TILE - 1) / HISTORY_TILE;
+
+    for (int ty = t0; ty < t1; ++ty)
+    {
+        int y0 = ty * HISTORY_TILE;
+        int th = st->height - y0 < HISTORY_TILE ? st->height - y0 : HISTORY_TILE;
+
+        for (int tx = 0; tx < tiles_x; ++tx)
+        {
+            int x0 = tx * HISTORY_TILE;
+            int tw = st->width - x0 < HISTORY_TILE ? st->width - x0 : HISTORY_TILE;
+            long tile_row = (long) tw * job->bpp;
+            const byte *src = job->pixels + y0 * row_bytes + (long) x0 * job->bpp;
+            int i = ty * tiles_x + tx;
+
+            struct history_tile *old = job->prev != NULL ? job->prev->tiles[i] : NULL;
+            int same = old != NULL;
+            for (int r = 0; r < th && same; ++r)
+            {
+                same = memcmp(src + r * row_bytes, old->data + r * tile_row, tile_row) == 0;
+            }
+            if (same)
+            {
+                // Only this tile row's thread touches this tile
+                old->refs++;
+                st->tiles[i] = old;
+                continue;
+            }
+
+            struct history_tile *tile = (struct history_tile *) bitmap_malloc(sizeof(struct history_tile) + th * tile_row);
+            tile->refs = 1;
+            tile->bytes = th * tile_row;
+            for (int r = 0; r < th; ++r)
+            {
+                memcpy(tile->data + r * tile_row, src + r * row_bytes, tile_row);
+            }
+            st->tiles[i] = tile;
+            __atomic_add_fetch(&job->new_bytes, tile->bytes, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void history_push(struct history *h, struct bitmap *bmp)
+{
+    int ev = trace_begin("history");
+
+    while (h->nstates > h->current + 1)
+    {
+        history_state_free(h, &h->states[--h->nstates]);
+    }
+    if (h->nstates == h->capacity)
+    {
+        h->capacity = h->capacity == 0 ? 16 : 2 * h->capacity;
+        h->states = (struct history_state *) realloc(h->states, h->capacity * sizeof(struct history_state));
+    }
+
+    struct history_state *st = &h->states[h->nstates];
+    st->width = bmp->width;
+    st->height = bmp->height;
+    st->layout = bmp->layout;
+    st->pending = NULL;
+    if (bmp->pending != NULL)
+    {
+        st->pending = (struct pipeline_pass *) bitmap_malloc(sizeof(struct pipeline_pass));
+        *st->pending = *bmp->pending;
+    }
+    st->tiles = (struct history_tile **) bitmap_malloc(history_tiles(st->width, st->height) * sizeof(struct history_tile *));
+
+    struct history_job job;
+    job.pixels = bmp->layout == LAYOUT_BGR24 ? bmp->bgr : (const byte *) bmp->pixels;
+    job.bpp = bmp->layout == LAYOUT_BGR24 ? 3 : 4;
+    job.prev = h->nstates > 0 ? &h->states[h->nstates - 1] : NULL;
+    job.st = st;
+    job.new_bytes = 0;
+    if (job.prev != NULL && (job.prev->width != st->width || job.prev->height != st->height
+                             || job.prev->layout != st->layout))
+    {
+        job.prev = NULL;
+    }
+    parallel_rows((st->height + HISTORY_TILE - 1) / HISTORY_TILE, history_tile_rows, &job);
+    h->bytes += job.new_bytes;
+    h->current = h->nstates++;
+
+    while (h->bytes > h->budget && h->nstates > 1)
+    {
+        history_state_free(h, &h->states[0]);
+        memmove(h->states, h->states + 1, (h->nstates - 1) * sizeof(struct history_state));
+        h->nstates--;
+        h->current--;
+    }
+
+    trace_end(ev, bitmap_bytes(bmp) + job.new_bytes);
+}
+
+// Copies a state's tiles back into bmp's pixels. If bmp already has
+// the state's size and layout, that is done in place, and only the
+// tile rows that differ are written and marked dirty.
+static void history_restore(const struct history_state *st, struct bitmap *bmp)
+{
+    int bpp = st->layout == LAYOUT_BGR24 ? 3 : 4;
+    long row_bytes = (long) st->width * bpp;
+    int in_place = bmp->width == st->width && bmp->height == st->height && bmp->layout == st->layout;
+    byte *pixels;
+    if (in_place)
+    {
+        pixels = bmp->layout == LAYOUT_BGR24 ? bmp->bgr : (byte *) bmp->pixels;
+    }
+    else
+    {
+        pixels = (byte *) bitmap_new_buffer(bmp, row_bytes * st->height);
+    }
+    int tiles_x = (st->width + HISTORY_TILE - 1) / HISTORY_TILE;
+
+    for (int i = 0; i < history_tiles(st->width, st->height); ++i)
+    {
+        int x0 = i % tiles_x * HISTORY_TILE;
+        int y0 = i / tiles_x * HISTORY_TILE;
+        long tile_row = (long) (st->width - x0 < HISTORY_TILE ? st->width - x0 : HISTORY_TILE) * bpp;
+        for (long r = 0; r * tile_row < st->tiles[i]->bytes; ++r)
+        {
+            byte *dst = pixels + (y0 + r) * row_bytes + (long) x0 * bpp;
+            const byte *src = st->tiles[i]->data + r * tile_row;
+            if (in_place && memcmp(dst, src, tile_row) == 0)
+            {
+                continue;
+            }
+            memcpy(dst, src, tile_row);
+            if (in_place)
+            {
+                bitmap_mark_dirty(bmp, y0 + r, y0 + r + 1);
+            }
+        }
+    }
+
+    if (!in_place)
+    {
+        bmp->layout = st->layout;
+        bitmap_replace_buffer(bmp, pixels);
+    }
+    bmp->width = st->width;
+    bmp->height = st->height;
+    if (st->pending != NULL)
+    {
+        if (bmp->pending == NULL)
+        {
+            bmp->pending = (struct pipeline_pass *) bitmap_malloc(sizeof(struct pipeline_pass));
+        }
+        *bmp->pending = *st->pending;
+    }
+    else if (bmp->pending != NULL)
+    {
+        pipeline_init_pass(bmp->pending);
+    }
+}
+
+int history_undo(struct history *h, struct bitmap *bmp)
+{
+    if (h->current <= 0)
+    {
+        return -1;
+    }
+    history_restore(&h->states[--h->current], bmp);
+    return 0;
+}
+
+int history_redo(struct history *h, struct bitmap *bmp)
+{
+    if (h->current + 1 >= h->nstates)
+    {
+        return -1;
+    }
+    history_restore(&h->states[++h->current], bmp);
+    return 0;
+}
+
+// ---- Dirty rows ----
+
+// The rows of a tracked bitmap that changed, and what they are to be
+// written over: the bitmap's size when tracking started, and the
+// file's identity and mtime as it was last written
+struct dirty_rows
+{
+    int width;
+    int height;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    long size;
+    byte rows[];
+};
+
+// Rows encoded per pwrite() by write_bitmap_dirty()
+#define DIRTY_RUN_ROWS 256
+
+static void dirty_rows_stamp(struct dirty_rows *d, const struct stat *st)
+{
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    d->size = st->st_size;
+}
+
+void bitmap_track_dirty(struct bitmap *bmp, const char *filename)
+{
+    free(bmp->dirty);
+    bmp->dirty = NULL;
+
+    struct stat st;
+    if (stat(filename, &st) == -1)
+    {
+        return;
+    }
+    struct dirty_rows *d = (struct dirty_rows *) bitmap_malloc(sizeof(struct dirty_rows) + bmp->height);
+    d->width = bmp->width;
+    d->height = bmp->height;
+    memset(d->rows, 0, bmp->height);
+    dirty_rows_stamp(d, &st);
+    bmp->dirty = d;
+}
+
+void bitmap_mark_dirty(struct bitmap *bmp, int y0, int y1)
+{
+    struct dirty_rows *d = bmp->dirty;
+    if (d == NULL)
+    {
+        return;
+    }
+    y0 = y0 < 0 ? 0 : y0;
+    y1 = y1 > d->height ? d->height : y1;
+    if (y0 < y1)
+    {
+        memset(d->rows + y0, 1, y1 - y0);
+    }
+}
+
+int write_bitmap_dirty(struct bitmap *bmp, char *filename)
+{
+    bitmap_materialize(bmp);
+
+    // Anything else may have written the file since, or the bitmap no
+    // longer fits it
+    struct dirty_rows *d = bmp->dirty;
+    struct stat st;
+    if (d == NULL || d->width != bmp->width || d->height != bmp->height || stat(filename, &st) == -1
+        || st.st_dev != d->dev || st.st_ino != d->ino || st.st_size != d->size
+        || st.st_mtim.tv_sec != d->mtime.tv_sec || st.st_mtim.tv_nsec != d->mtime.tv_nsec)
+    {
+        return -1;
+    }
+
+    int ndirty = 0;
+    for (int y = 0; y < bmp->height; ++y)
+    {
+        ndirty += d->rows[y];
+    }
+    if (ndirty == 0)
+    {
+        return 0;
+    }
+    int fd = open(filename, O_WRONLY);
+    if (fd == -1)
+    {
+        return -1;
+    }
+
+    int ev = trace_begin("write_bitmap_dirty");
+    int stride = bmp_file_stride(bmp);
+    long row_bytes = (long) bmp->width * 3;
+    // calloc, so the padding at the end of each row stays zero
+    byte *buffer = (byte *) calloc(ndirty < DIRTY_RUN_ROWS ? ndirty : DIRTY_RUN_ROWS, stride);
+    int written = 0;
+    int y = 0;
+    while (y < bmp->height)
+    {
+        if (!d->rows[y])
+        {
+            ++y;
+            continue;
+        }
+
+        // A run of changed rows is one stretch of the file, with its
+        // rows from bottom to top
+        int end = y;
+        while (end < bmp->height && d->rows[end] && end - y < DIRTY_RUN_ROWS)
+        {
+            ++end;
+        }
+        for (int r = y; r < end; ++r)
+        {
+            byte *dst = buffer + (long) (end - 1 - r) * stride;
+            if (bmp->layout == LAYOUT_BGR24)
+            {
+                memcpy(dst, bmp->bgr + r * row_bytes, row_bytes);
+            }
+            else
+            {
+                encode_row(bmp->pixels + (long) r * bmp->width, dst, bmp->width);
+            }
+        }
+
+        // The pixel data starts right after the 54 bytes of header
+        long bytes = (long) (end - y) * stride;
+        if (pwrite(fd, buffer, bytes, 54 + (off_t) (bmp->height - end) * stride) != bytes)
+        {
+            perror(NULL);
+            free(buffer);
+            close(fd);
+            trace_end(ev, (long) written * stride);
+            return -1;
+        }
+        memset(d->rows + y, 0, end - y);
+        written += end - y;
+        y = end;
+    }
+
+    fstat(fd, &st);
+    dirty_rows_stamp(d, &st);
+    free(buffer);
+    close(fd);
+    trace_end(ev, (long) written * stride);
+    return written;
+}
+
+// ---- Image statistics ----
+
+// Counts a run of pixels and their lumas into two sets of bins, even
+// pixels into one and odd ones into the other, so that two pixels of
+// the same color don't wait on each other's increment. luma holds the
+// pixels again after a BT.601 grayscale, so its low bytes are the
+// lumas.
+static void stats_count(const int *px, const int *luma, long n, unsigned int bins[2][4][256])
+{
+    long i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        int p = px[i];
+        int q = px[i + 1];
+        bins[0][CHANNEL_BLUE][p & 0xff]++;
+        bins[1][CHANNEL_BLUE][q & 0xff]++;
+        bins[0][CHANNEL_GREEN][(p >> 8) & 0xff]++;
+        bins[1][CHANNEL_GREEN][(q >> 8) & 0xff]++;
+        bins[0][CHANNEL_RED][(p >> 16) & 0xff]++;
+        bins[1][CHANNEL_RED][(q >> 16) & 0xff]++;
+        bins[0][STATS_LUMA][luma[i] & 0xff]++;
+        bins[1][STATS_LUMA][luma[i + 1] & 0xff]++;
+    }
+    if (i < n)
+    {
+        int p = px[i];
+        bins[0][CHANNEL_BLUE][p & 0xff]++;
+        bins[0][CHANNEL_GREEN][(p >> 8) & 0xff]++;
+        bins[0][CHANNEL_RED][(p >> 16) & 0xff]++;
+        bins[0][STATS_LUMA][luma[i] & 0xff]++;
+    }
+}
+
+// Where the rows to count come from: a bitmap, or else the rows of a
+// mapped file, first of them at first and each step bytes after the
+// one above
+struct stats_job
+{
+    const struct bitmap *bmp;
+    const struct bmp_format *fmt;
+    const byte *first;
+    long step;
+    int width;
+    struct image_stats *st;
+};
+
+// Each range of rows counts into bins of its own, on the stack, and
+// adds them to the totals once at the end. Rows are decoded into the
+// thread's scratch.
+static void stats_rows(void *ctx, int y0, int y1)
+{
+    struct stats_job *job = (struct stats_job *) ctx;
+    const struct bitmap *bmp = job->bmp;
+    int width = job->width;
+    int *row = (int *) thread_scratch(SCRATCH_STATS, 2L * width * sizeof(int));
+    int *luma = row + width;
+    unsigned int bins[2][4][256];
+    memset(bins, 0, sizeof(bins));
+
+    for (int y = y0; y < y1; ++y)
+    {
+        const int *px = row;
+        if (bmp == NULL)
+        {
+            decode_format_row(job->fmt, job->first + y * job->step, row, width);
+        }
+        else if (bmp->layout == LAYOUT_BGR24)
+        {
+            decode_row(bmp->bgr + (long) y * width * 3, row, width);
+        }
+        else
+        {
+            px = bmp->pixels + (long) y * width;
+        }
+        memcpy(luma, px, width * sizeof(int));
+        grayscale_span(&gray_weights[GRAY_BT601], luma, width);
+        stats_count(px, luma, width, bins);
+    }
+
+    for (int c = 0; c < 4; ++c)
+    {
+        for (int v = 0; v < 256; ++v)
+        {
+            unsigned long count = (unsigned long) bins[0][c][v] + bins[1][c][v];
+            if (count != 0)
+            {
+                __atomic_add_fetch(&job->st->histogram[c][v], count, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+// Counts the rows of a job into st, and works out the rest from the
+// histograms
+static void stats_run(struct stats_job *job, int width, int height, struct image_stats *st)
+{
+    int ev = trace_begin("stats");
+    memset(st, 0, sizeof(*st));
+    st->width = width;
+    st->height = height;
+    st->pixels = (long) width * height;
+    job->width = width;
+    job->st = st;
+    parallel_rows(height, stats_rows, job);
+
+    for (int c = 0; c < 4; ++c)
+    {
+        double sum = 0;
+        st->min[c] = 255;
+        st->max[c] = 0;
+        for (int v = 0; v < 256; ++v)
+        {
+            if (st->histogram[c][v] != 0)
+            {
+                st->min[c] = v < st->min[c] ? v : st->min[c];
+                st->max[c] = v;
+            }
+            sum += (double) v * st->histogram[c][v];
+        }
+        if (st->pixels == 0)
+        {
+            st->min[c] = 0;
+        }
+        st->mean[c] = st->pixels > 0 ? sum / st->pixels : 0;
+    }
+    trace_end(ev, st->pixels * sizeof(int));
+}
+
+void bitmap_stats(struct bitmap *bmp, struct image_stats *st)
+{
+    bitmap_materialize(bmp);
+    struct stats_job job = { bmp, NULL, NULL, 0, 0, NULL };
+    stats_run(&job, bmp->width, bmp->height, st);
+}
+
+int bmp_file_stats(void *bmp_file, const struct rect *r, struct image_stats *st)
+{
+    struct bitmap in;
+    struct bmp_format format;
+    struct bmp_format *fmt = &format;
+    if (read_bitmap_format(bmp_file, &in, fmt) == -1)
+    {
+        return -1;
+    }
+    struct rect whole = { 0, 0, in.width, in.height };
+    if (r == NULL)
+    {
+        r = &whole;
+    }
+    else if (!rect_inside(r, in.width, in.height))
+    {
+        return -1;
+    }
+
+    // Row y of the window, as read_bitmap_rect() finds it
+    long first_row = fmt->top_down ? r->y : in.height - 1 - r->y;
+    const byte *first = (const byte *) bmp_file + fmt->offset + first_row * fmt->stride
+        + (long) r->x * bmp_format_bpp(fmt->format);
+    struct stats_job job = { NULL, fmt, first, fmt->top_down ? fmt->stride : -fmt->stride, 0, NULL };
+    stats_run(&job, r->width, r->height, st);
+    return 0;
+}
+
+void image_stats_print_json(const struct image_stats *st)
+{
+    static const char *names[4] = { "blue", "green", "red", "luma" };
+    static const int order[4] = { CHANNEL_RED, CHANNEL_GREEN, CHANNEL_BLUE, STATS_LUMA };
+
+    printf("{\n");
+    printf("  \"width\": %d,\n  \"height\": %d,\n  \"pixels\": %ld,\n", st->width, st->height, st->pixels);
+    for (int k = 0; k < 4; ++k)
+    {
+        int c = order[k];
+        printf("  \"%s\": {\n", names[c]);
+        printf("    \"min\": %d,\n    \"max\": %d,\n    \"mean\": %.4f,\n", st->min[c], st->max[c], st->mean[c]);
+        printf("    \"histogram\": [");
+        for (int v = 0; v < 256; ++v)
+        {
+            printf("%s%ld", v == 0 ? "" : v % 16 == 0 ? ",\n      " : ", ", st->histogram[c][v]);
+        }
+        printf("]\n  }%s\n", k < 3 ? "," : "");
+    }
+    printf("}\n");
+}
+
+// The smallest value v with more than count pixels of a histogram
+// below or at it
+static int histogram_rank(const long *histogram, long count)
+{
+    long seen = 0;
+    for (int v = 0; v < 256; ++v)
+    {
+        seen += histogram[v];
+        if (seen > count)
+        {
+            return v;
+        }
+    }
+    return 255;
+}
+
+void posterize_table_auto_levels(struct posterize_table *t, const struct image_stats *st, double clip)
+{
+    long clipped = (long) (clip * st->pixels);
+    for (int c = 0; c < 3; ++c)
+    {
+        int low = histogram_rank(st->histogram[c], clipped);
+        int high = histogram_rank(st->histogram[c], st->pixels - 1 - clipped);
+        for (int v = 0; v < 256; ++v)
+        {
+            int value = v;
+            if (high > low)
+            {
+                value = v <= low ? 0 : v >= high ? 255 : ((v - low) * 255 + (high - low) / 2) / (high - low);
+            }
+            t->lut[c][v] = value;
+        }
+    }
+    posterize_table_compile(t);
+}
+
+int posterize_table_auto(struct posterize_table *t, const struct image_stats *st, int n)
+{
+    if (n < 2 || n > 256)
+    {
+        printf("Error: A posterize needs 2 to 256 levels per channel\n");
+        return -1;
+    }
+
+    for (int c = 0; c < 3; ++c)
+    {
+        const long *histogram = st->histogram[c];
+        int thresholds[255];
+        int values[256];
+
+        // Level k starts at the value below which k / n of the pixels
+        // lie, kept far enough apart that every level has a value
+        for (int k = 1; k < n; ++k)
+        {
+            int at = histogram_rank(histogram, (long) ((double) k * st->pixels / n) - 1) + 1;
+            int lowest = k > 1 ? thresholds[k - 2] + 1 : 1;
+            int highest = 256 - n + k;
+            thresholds[k - 1] = at < lowest ? lowest : at > highest ? highest : at;
+        }
+
+        // Each level's value is the mean of its pixels, or its middle if
+        // it has none
+        for (int k = 0; k < n; ++k)
+        {
+            int from = k > 0 ? thresholds[k - 1] : 0;
+            int to = k < n - 1 ? thresholds[k] : 256;
+            double sum = 0;
+            long count = 0;
+            for (int v = from; v < to; ++v)
+            {
+                sum += (double) v * histogram[v];
+                count += histogram[v];
+            }
+            values[k] = count > 0 ? (int) (sum / count + 0.5) : (from + to - 1) / 2;
+        }
+
+        if (posterize_table_channel(t, c, n, thresholds, values) == -1)
+        {
+            return -1;
+        }
+    }
+    posterize_table_compile(t);
+    return 0;
+}
+
+int pipeline_is_row_local(const struct pipeline *pl)
+{
+    if (pl->warp || pl->resize_width != 0)
+    {
+        return 0;
+    }
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        const struct pipeline_pass *pass = &pl->passes[i];
+        for (int s = 0; s < pass->nremaps; ++s)
+        {
+            const struct remap_stage *st = &pass->remaps[s];
+            if (st->kind != REMAP_MIRROR
+                && !(st->kind == REMAP_ORIENT && st->orient == ORIENT_FLIP_X))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+int pipeline_run_streaming(const struct pipeline *pl, char *in_filename, char *out_filename, long mem_budget)
+{
+    if (!pipeline_is_row_local(pl))
+    {
+        printf("Error: Only grayscale, posterize, mirror, reflect, squash and shrink can be streamed, without --resize or a warp\n");
+        return -1;
+    }
+
+    int fd = open(in_filename, O_RDONLY);
+    if (fd == -1)
+    {
+        perror(NULL);
+        return -1;
+    }
+
+    byte header[54];
+    struct bitmap in;
+    int offset;
+    if (pread_fully(fd, header, sizeof(header), 0) == -1
+        || (offset = read_bitmap_header(header, &in)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    long in_stride = bmp_file_stride(&in);
+
+    // Follow the image size through the passes. Every shrink halves the
+    // rows, so a strip has to be a multiple of rows_per_out input rows.
+    // row_bytes is roughly what one input row costs across all the
+    // buffers a strip needs.
+    int out_width = in.width;
+    int out_height = in.height;
+    long rows_per_out = 1;
+    long row_bytes = in_stride + 4L * in.width;
+    for (int i = 0; i < pl->npasses; ++i)
+    {
+        struct remap_stage stages[MAX_PIPELINE_OPS];
+        if (pl->passes[i].resample == OP_SHRINK)
+        {
+            rows_per_out *= 2;
+        }
+        pass_prepare(&pl->passes[i], stages, &out_width, &out_height);
+        row_bytes += (4L * out_width + rows_per_out - 1) / rows_per_out;
+    }
+    struct bitmap out = { out_width, out_height, NULL, LAYOUT_INT, NULL, NULL, NULL, NULL };
+    long out_stride = bmp_file_stride(&out);
+    row_bytes += (out_stride + rows_per_out - 1) / rows_per_out;
+
+    // Input rows past the last full group are dropped, as bitmap_shrink does
+    long in_rows = out_height * rows_per_out;
+    long strip = mem_budget / row_bytes;
+    strip -= strip % rows_per_out;
+    if (strip < rows_per_out)
+    {
+        printf("Error: --mem-budget needs at least %ld bytes for one strip of this image\n",
+               rows_per_out * row_bytes);
+        close(fd);
+        return -1;
+    }
+    if (strip > in_rows && in_rows > 0)
+    {
+        strip = in_rows;
+    }
+
+    int ofd = open(out_filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (ofd == -1)
+    {
+        perror(NULL);
+        close(fd);
+        return -1;
+    }
+
+    byte out_header[54] = { 0 };
+    write_bitmap_header(out_header, &out);
+    if (ftruncate(ofd, 54 + out_stride * out_height) == -1
+        || pwrite_fully(ofd, out_header, sizeof(out_header), 0) == -1)
+    {
+        perror(NULL);
+        close(fd);
+        close(ofd);
+        return -1;
+    }
+
+    byte *in_buf = (byte *) bitmap_malloc(strip * in_stride);
+    // calloc so the padding at the end of each row stays zero
+    byte *out_buf = (byte *) bitmap_calloc(strip / rows_per_out, out_stride);
+    int result = 0;
+
+    // Every strip's passes ping-pong between the same two buffers
+    struct pixel_arena arena;
+    pixel_arena_init(&arena);
+
+    for (long y0 = 0; y0 < in_rows && result == 0; y0 += strip)
+    {
+        int rows = (int) (in_rows - y0 < strip ? in_rows - y0 : strip);
+
+        // Rows are stored bottom to top, so the strip is one run of the
+        // file that ends with row y0
+        int ev = trace_begin("pread");
+        result = pread_fully(fd, in_buf, rows * in_stride,
+            offset + (in.height - y0 - rows) * in_stride);
+        trace_end(ev, rows * in_stride);
+        if (result == -1)
+        {
+            break;
+        }
+
+        ev = trace_begin("strip transform");
+        struct bitmap strip_bmp = { in.width, rows, NULL, LAYOUT_INT, NULL, &arena, NULL, NULL };
+        bitmap_replace_buffer(&strip_bmp, bitmap_new_buffer(&strip_bmp, bitmap_bytes(&strip_bmp)));
+        for (int r = 0; r < rows; ++r)
+        {
+            decode_row(in_buf + (rows - 1 - r) * in_stride, strip_bmp.pixels + (long) r * in.width, in.width);
+        }
+
+        pipeline_run(pl, &strip_bmp);
+
+        int out_rows = strip_bmp.height;
+        for (int r = 0; r < out_rows; ++r)
+        {
+            encode_row(strip_bmp.pixels + (long) r * out_width, out_buf + (out_rows - 1 - r) * out_stride, out_width);
+        }
+        trace_end(ev, rows * in_stride + out_rows * out_stride);
+
+        long oy0 = y0 / rows_per_out;
+        ev = trace_begin("pwrite");
+        result = pwrite_fully(ofd, out_buf, out_rows * out_stride,
+            54 + (out_height - oy0 - out_rows) * out_stride);
+        trace_end(ev, out_rows * out_stride);
+    }
+
+    free(in_buf);
+    free(out_buf);
+    pixel_arena_release(&arena);
+    close(fd);
+    close(ofd);
+    return result;
+}
+
+// Parses a size such as 4096, 512K, 64M or 2G
+static long parse_size(const char *text)
+{
+    char *end;
+    long size = strtol(text, &end, 10);
+    if (*end == 'k' || *end == 'K')
+    {
+        size <<= 10;
+    }
+    else if (*end == 'm' || *end == 'M')
+    {
+        size <<= 20;
+    }
+    else if (*end == 'g' || *end == 'G')
+    {
+        size <<= 30;
+    }
+    return size;
+}
+
+// "int" or "bgr24" to a pixel_layout, or -1
+static int parse_layout(const char *name)
+{
+    if (strcmp(name, "int") == 0)
+    {
+        return LAYOUT_INT;
+    }
+    else if (strcmp(name, "bgr24") == 0)
+    {
+        return LAYOUT_BGR24;
+    }
+    return -1;
+}
+
+// "average", "bt601" or "bt709" to a gray_mode, or -1
+static int parse_gray_mode(const char *name)
+{
+    static const char *names[3] = { "average", "bt601", "bt709" };
+    for (int mode = 0; mode < 3; ++mode)
+    {
+        if (strcmp(name, names[mode]) == 0)
+        {
+            return mode;
+        }
+    }
+    return -1;
+}
+
+// How the headless and batch modes write their output files, and in
+// which BMP_ pixel format
+struct writer_options
+{
+    int pwrite;
+    int direct;
+    int fsync_policy;
+    long buffer_size;
+    int format;
+    int top_down;
+};
+
+// Handles the writer options at argv[*i]: --writer mmap|pwrite,
+// --o-direct, --fsync none|end|each and --write-buffer SIZE (the last
+// three imply --writer pwrite), --out-format bgr24|bgra32|bitfields|pal8
+// and --top-down. Returns 1 if it used the option (and its value), 0 if
+// the option isn't one of these, -1 if it is invalid.
+static int parse_writer_option(int argc, char *argv[], int *i, struct writer_options *opts)
+{
+    const char *arg = argv[*i];
+    const char *value = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (strcmp(arg, "--o-direct") == 0)
+    {
+        opts->pwrite = 1;
+        opts->direct = 1;
+        return 1;
+    }
+    if (strcmp(arg, "--top-down") == 0)
+    {
+        opts->top_down = 1;
+        return 1;
+    }
+    if (value == NULL)
+    {
+        return 0;
+    }
+
+    if (strcmp(arg, "--writer") == 0)
+    {
+        if (strcmp(value, "mmap") != 0 && strcmp(value, "pwrite") != 0)
+        {
+            printf("Error: --writer needs mmap or pwrite\n");
+            return -1;
+        }
+        opts->pwrite = strcmp(value, "pwrite") == 0;
+    }
+    else if (strcmp(arg, "--fsync") == 0)
+    {
+        if (strcmp(value, "none") == 0)
+        {
+            opts->fsync_policy = FSYNC_NONE;
+        }
+        else if (strcmp(value, "end") == 0)
+        {
+            opts->fsync_policy = FSYNC_END;
+        }
+        else if (strcmp(value, "each") == 0)
+        {
+            opts->fsync_policy = FSYNC_EACH;
+        }
+        else
+        {
+            printf("Error: --fsync needs none, end or each\n");
+            return -1;
+        }
+        opts->pwrite = 1;
+    }
+    else if (strcmp(arg, "--write-buffer") == 0)
+    {
+        opts->buffer_size = parse_size(value);
+        if (opts->buffer_size <= 0)
+        {
+            printf("Error: --write-buffer needs a size such as 4M\n");
+            return -1;
+        }
+        opts->pwrite = 1;
+    }
+    else if (strcmp(arg, "--out-format") == 0)
+    {
+        static const char *names[] = { "bgr24", "bgra32", "bitfields", "pal8" };
+        opts->format = -1;
+        for (int f = BMP_BGR24; f <= BMP_PAL8; ++f)
+        {
+            if (strcmp(value, names[f]) == 0)
+            {
+                opts->format = f;
+            }
+        }
+        if (opts->format == -1)
+        {
+            printf("Error: --out-format needs bgr24, bgra32, bitfields or pal8\n");
+            return -1;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+    ++*i;
+    return 1;
+}
+
+// Parses up to max comma separated numbers, stopping at the first
+// other character (returned in *end). Returns how many it read, or -1
+// if there are too many or one is missing.
+static int parse_int_list(const char *text, int *out, int max, const char **end)
+{
+    int n = 0;
+    for (;;)
+    {
+        char *after;
+        long v = strtol(text, &after, 10);
+        if (after == text || n == max)
+        {
+            return -1;
+        }
+        out[n++] = (int) v;
+        text = after;
+        if (*text != ',')
+        {
+            break;
+        }
+        ++text;
+    }
+    *end = text;
+    return n;
+}
+
+// A posterize for the headless and batch modes, used by their 'p' ops
+// once set is 1
+struct posterize_options
+{
+    int set;
+    struct posterize_table table;
+};
+
+// Handles the posterize options at argv[*i]: --levels N or R,G,B, and
+// --thresholds [red:|green:|blue:]T,T,...[=V,V,...] for a custom
+// channel (all three without a prefix). Channels not mentioned are
+// left alone. Returns 1 if it used the option, 0 if the option isn't
+// one of these, -1 if it is invalid.
+static int parse_posterize_option(int argc, char *argv[], int *i, struct posterize_options *opts)
+{
+    const char *arg = argv[*i];
+    const char *value = *i + 1 < argc ? argv[*i + 1] : NULL;
+    const char *end;
+
+    if (value == NULL || (strcmp(arg, "--levels") != 0 && strcmp(arg, "--thresholds") != 0))
+    {
+        return 0;
+    }
+    if (!opts->set)
+    {
+        posterize_table_levels(&opts->table, 256, 256, 256);
+    }
+
+    if (strcmp(arg, "--levels") == 0)
+    {
+        int levels[3];
+        int n = parse_int_list(value, levels, 3, &end);
+        if (n == 1)
+        {
+            levels[1] = levels[0];
+            levels[2] = levels[0];
+        }
+        if ((n != 1 && n != 3) || *end != '\0')
+        {
+            printf("Error: --levels needs N or R,G,B\n");
+            return -1;
+        }
+        if (posterize_table_levels(&opts->table, levels[0], levels[1], levels[2]) == -1)
+        {
+            return -1;
+        }
+    }
+    else if (strcmp(arg, "--thresholds") == 0)
+    {
+        static const char *names[3] = { "blue:", "green:", "red:" };
+        int first = CHANNEL_BLUE;
+        int last = CHANNEL_RED;
+        for (int c = 0; c < 3; ++c)
+        {
+            if (strncmp(value, names[c], strlen(names[c])) == 0)
+            {
+                first = c;
+                last = c;
+                value += strlen(names[c]);
+            }
+        }
+
+        int thresholds[256];
+        int values[256];
+        int n = parse_int_list(value, thresholds, 255, &end);
+        int nvalues = -1;
+        if (n > 0 && *end == '=')
+        {
+            nvalues = parse_int_list(end + 1, values, 256, &end);
+        }
+        if (n <= 0 || *end != '\0' || (nvalues != -1 && nvalues != n + 1))
+        {
+            printf("Error: --thresholds needs T,T,... optionally followed by =V,V,... with one more value\n");
+            return -1;
+        }
+        for (int c = first; c <= last; ++c)
+        {
+            if (posterize_table_thresholds(&opts->table, c, n + 1, thresholds,
+                                           nvalues == -1 ? NULL : values) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    opts->set = 1;
+    ++*i;
+    return 1;
+}
+
+// The final resize of the headless and batch modes, if width is set
+struct resize_options
+{
+    int width;
+    int height;
+    int filter;
+};
+
+// Handles --resize WxH and --filter box|bilinear|lanczos at argv[*i].
+// Returns 1 if it used the option, 0 if the option isn't one of these,
+// -1 if it is invalid.
+static int parse_resize_option(int argc, char *argv[], int *i, struct resize_options *opts)
+{
+    const char *arg = argv[*i];
+    const char *value = *i + 1 < argc ? argv[*i + 1] : NULL;
+
+    if (value == NULL)
+    {
+        return 0;
+    }
+    if (strcmp(arg, "--resize") == 0)
+    {
+        if (sscanf(value, "%dx%d", &opts->width, &opts->height) != 2 || opts->width < 1 || opts->height < 1)
+        {
+            printf("Error: --resize needs WxH, e.g. 320x240\n");
+            return -1;
+        }
+    }
+    else if (strcmp(arg, "--filter") == 0)
+    {
+        if (strcmp(value, "box") == 0)
+        {
+            opts->filter = FILTER_BOX;
+        }
+        else if (strcmp(value, "bilinear") == 0)
+        {
+            opts->filter = FILTER_BILINEAR;
+        }
+        else if (strcmp(value, "lanczos") == 0)
+        {
+            opts->filter = FILTER_LANCZOS;
+        }
+        else
+        {
+            printf("Error: --filter needs box, bilinear or lanczos\n");
+            return -1;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+    ++*i;
+    return 1;
+}
+
+// The warp of the headless and batch modes, if set
+struct warp_options
+{
+    int set;
+    struct affine forward;
+    int sample;
+};
+
+// Parses "X" or "X,Y" into x and y. Returns how many numbers there
+// were, or -1 if invalid.
+static int parse_double_pair(const char *value, double *x, double *y)
+{
+    char *end;
+    *x = strtod(value, &end);
+    if (end == value || (*end != '\0' && *end != ','))
+    {
+        return -1;
+    }
+    if (*end == '\0')
+    {
+        return 1;
+    }
+
+    const char *second = end + 1;
+    *y = strtod(second, &end);
+    return end != second && *end == '\0' ? 2 : -1;
+}
+
+// Handles --rotate DEG, --shear X[,Y], --scale X[,Y] and --sample
+// nearest|bilinear at argv[*i]. The transforms compose in the order
+// given. Returns 1 if it used the option, 0 if the option isn't one of
+// these, -1 if it is invalid.
+static int parse_warp_option(int argc, char *argv[], int *i, struct warp_options *opts)
+{
+    const char *arg = argv[*i];
+    const char *value = *i + 1 < argc ? argv[*i + 1] : NULL;
+    double x, y;
+
+    if (value == NULL)
+    {
+        return 0;
+    }
+    if (strcmp(arg, "--rotate") == 0)
+    {
+        if (parse_double_pair(value, &x, &y) != 1)
+        {
+            printf("Error: --rotate needs an angle in degrees\n");
+            return -1;
+        }
+        affine_rotate(&opts->forward, x);
+        opts->set = 1;
+    }
+    else if (strcmp(arg, "--shear") == 0)
+    {
+        // A single factor shears horizontally
+        int n = parse_double_pair(value, &x, &y);
+        if (n == -1)
+        {
+            printf("Error: --shear needs X or X,Y\n");
+            return -1;
+        }
+        affine_shear(&opts->forward, x, n == 2 ? y : 0);
+        opts->set = 1;
+    }
+    else if (strcmp(arg, "--scale") == 0)
+    {
+        int n = parse_double_pair(value, &x, &y);
+        if (n == -1 || x <= 0 || (n == 2 && y <= 0))
+        {
+            printf("Error: --scale needs positive X or X,Y\n");
+            return -1;
+        }
+        affine_scale(&opts->forward, x, n == 2 ? y : x);
+        opts->set = 1;
+    }
+    else if (strcmp(arg, "--sample") == 0)
+    {
+        if (strcmp(value, "nearest") == 0)
+        {
+            opts->sample = SAMPLE_NEAREST;
+        }
+        else if (strcmp(value, "bilinear") == 0)
+        {
+            opts->sample = SAMPLE_BILINEAR;
+        }
+        else
+        {
+            printf("Error: --sample needs nearest or bilinear\n");
+            return -1;
+        }
+    }
+    else
+    {
+        return 0;
+    }
+
+    struct affine inverse;
+    if (affine_invert(&opts->forward, &inverse) == -1)
+    {
+        printf("Error: %s %s squashes the image flat\n", arg, value);
+        return -1;
+    }
+    ++*i;
+    return 1;
+}
+
+// A width x height bitmap of random (but repeatable) pixels
+static void make_test_bitmap(struct bitmap *bmp, int width, int height)
+{
+    bmp->width = width;
+    bmp->height = height;
+    bmp->layout = LAYOUT_INT;
+    bmp->bgr = NULL;
+    bmp->arena = NULL;
+    bmp->pending = NULL;
+    bmp->dirty = NULL;
+    long n = (long) width * height;
+    bmp->pixels = (int *) malloc(n * sizeof(int));
+
+    unsigned int seed = 12345;
+    for (long i = 0; i < n; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        bmp->pixels[i] = (seed >> 8) & 0xffffff;
+    }
+}
+
+// A fresh copy of bmp's pixels, in the same layout, in arena's
+// buffers if arena isn't NULL
+static void copy_test_bitmap(struct bitmap *copy, const struct bitmap *bmp, struct pixel_arena *arena)
+{
+    long bytes = bitmap_bytes(bmp);
+    *copy = *bmp;
+    copy->arena = arena;
+    copy->pixels = NULL;
+    copy->bgr = NULL;
+    copy->pending = NULL;
+    copy->dirty = NULL;
+    void *buffer = arena != NULL ? bitmap_new_buffer(copy, bytes) : malloc(bytes);
+    memcpy(buffer, bmp->layout == LAYOUT_BGR24 ? (void *) bmp->bgr : (void *) bmp->pixels, bytes);
+    bitmap_replace_buffer(copy, buffer);
+}
+
+// Best of a few runs of op on fresh copies of bmp, in seconds
+static double time_op(void (*op)(struct bitmap *), const struct bitmap *bmp, int runs)
+{
+    double best = 0;
+
+    for (int i = 0; i < runs; ++i)
+    {
+        struct bitmap copy;
+        copy_test_bitmap(&copy, bmp, NULL);
+
+        double start = now_seconds();
+        op(&copy);
+        double elapsed = now_seconds() - start;
+        if (i == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+        bitmap_free(&copy);
+    }
+    return best;
+}
+
+static int bench_rotate(int nsizes, double *sizes)
+{
+    printf("%8s %12s %12s %12s %8s\n", "MP", "size", "untiled ms", "tiled ms", "speedup");
+    for (int i = 0; i < nsizes; ++i)
+    {
+        // 4:3, so that transposes aren't square
+        int width = 1;
+        while ((double) width * width * 3 < sizes[i] * 1e6 * 4)
+        {
+            width++;
+        }
+
+        struct bitmap bmp;
+        make_test_bitmap(&bmp, width, (int) (sizes[i] * 1e6 / width + 0.5));
+
+        double untiled = time_op(bitmap_rotate_untiled, &bmp, 3);
+        double tiled = time_op(bitmap_rotate, &bmp, 3);
+
+        char size[32];
+        snprintf(size, sizeof(size), "%dx%d", bmp.width, bmp.height);
+        printf("%8.0f %12s %12.2f %12.2f %7.2fx\n", sizes[i], size, untiled * 1e3, tiled * 1e3, untiled / tiled);
+        free(bmp.pixels);
+    }
+    return 0;
+}
+
+// One line of "project2 bench": latencies in seconds, and how much
+// data one run processes
+struct bench_result
+{
+    const char *name;
+    double median;
+    double p99;
+    double megapixels;
+    double bytes;
+};
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// Sorts the times of n runs and fills in the median and p99 of res
+static void bench_summarize(double *times, int n, struct bench_result *res)
+{
+    qsort(times, n, sizeof(double), compare_doubles);
+    res->median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+
+    int p99 = (int) ((99L * n + 99) / 100) - 1;
+    res->p99 = times[p99 < 0 ? 0 : p99];
+}
+
+// Compiled posterizes for the bench: 5 levels run as steps, 64 levels
+// have too many steps and run as byte lookups
+static struct posterize_table bench_levels5;
+static struct posterize_table bench_levels64;
+
+static void bench_posterize_levels5(struct bitmap *bmp)
+{
+    bitmap_posterize_table(bmp, &bench_levels5);
+}
+
+static void bench_posterize_levels64(struct bitmap *bmp)
+{
+    bitmap_posterize_table(bmp, &bench_levels64);
+}
+
+static void bench_grayscale_bt601(struct bitmap *bmp)
+{
+    bitmap_to_grayscale_mode(bmp, GRAY_BT601);
+}
+
+static void bench_grayscale_bt709(struct bitmap *bmp)
+{
+    bitmap_to_grayscale_mode(bmp, GRAY_BT709);
+}
+
+// Resizes to a third with a box (whole factors, so bitmap_downsample)
+// and to two fifths with the other filters
+static void bench_resize_box(struct bitmap *bmp)
+{
+    bitmap_resize(bmp, bmp->width / 3, bmp->height / 3, FILTER_BOX);
+}
+
+static void bench_resize_bilinear(struct bitmap *bmp)
+{
+    bitmap_resize(bmp, bmp->width * 2 / 5, bmp->height * 2 / 5, FILTER_BILINEAR);
+}
+
+static void bench_resize_lanczos(struct bitmap *bmp)
+{
+    bitmap_resize(bmp, bmp->width * 2 / 5, bmp->height * 2 / 5, FILTER_LANCZOS);
+}
+
+// Rotations for the bench, which read the source diagonally
+static double bench_warp_angle = 30;
+
+static void bench_warp_nearest(struct bitmap *bmp)
+{
+    struct affine m;
+    affine_identity(&m);
+    affine_rotate(&m, bench_warp_angle);
+    bitmap_warp(bmp, &m, SAMPLE_NEAREST);
+}
+
+static void bench_warp_bilinear(struct bitmap *bmp)
+{
+    struct affine m;
+    affine_identity(&m);
+    affine_rotate(&m, bench_warp_angle);
+    bitmap_warp(bmp, &m, SAMPLE_BILINEAR);
+}
+
+// A chain of remaps done one at a time, and the same in lazy mode,
+// where it costs one pass
+static void bench_remaps(struct bitmap *bmp)
+{
+    bitmap_rotate_90(bmp);
+    bitmap_reflect(bmp);
+    bitmap_skew(bmp);
+    bitmap_rotate_90(bmp);
+    bitmap_reflect(bmp);
+}
+
+static void bench_remaps_eager(struct bitmap *bmp)
+{
+    bench_remaps(bmp);
+}
+
+static void bench_remaps_lazy(struct bitmap *bmp)
+{
+    bitmap_set_lazy(bmp, 1);
+    bench_remaps(bmp);
+    bitmap_set_lazy(bmp, 0);
+}
+
+static struct image_stats bench_stats_result;
+
+static void bench_stats(struct bitmap *bmp)
+{
+    bitmap_stats(bmp, &bench_stats_result);
+}
+
+// Times iters runs of op, each on a fresh copy of bmp, made in arena
+// if it isn't NULL
+static void bench_op(const char *name, void (*op)(struct bitmap *), const struct bitmap *bmp,
+                     struct pixel_arena *arena, int iters, struct bench_result *res)
+{
+    long n = (long) bmp->width * bmp->height;
+    double *times = (double *) malloc(iters * sizeof(double));
+    long out_bytes = 0;
+
+    for (int i = 0; i < iters; ++i)
+    {
+        struct bitmap copy;
+        copy_test_bitmap(&copy, bmp, arena);
+
+        double start = now_seconds();
+        op(&copy);
+        times[i] = now_seconds() - start;
+
+        out_bytes = bitmap_bytes(&copy);
+        bitmap_free(&copy);
+    }
+
+    res->name = name;
+    res->megapixels = n / 1e6;
+    res->bytes = (double) bitmap_bytes(bmp) + out_bytes;
+    bench_summarize(times, iters, res);
+    free(times);
+}
+
+// Times the rotations with the scalar kernels and with the AVX2
+// gathers (skipped if the CPU has no AVX2). Returns how many results
+// it filled in.
+static int bench_warps(const struct bitmap *bmp, int iters, struct bench_result *results)
+{
+    static const struct
+    {
+        const char *name;
+        void (*op)(struct bitmap *);
+        int level;
+    } runs[] = {
+        { "warp nearest scalar", bench_warp_nearest, SIMD_SCALAR },
+        { "warp nearest gather", bench_warp_nearest, SIMD_AVX2 },
+        { "warp bilinear scalar", bench_warp_bilinear, SIMD_SCALAR },
+        { "warp bilinear gather", bench_warp_bilinear, SIMD_AVX2 },
+    };
+    int nruns = sizeof(runs) / sizeof(runs[0]);
+    int best = simd_level();
+    int n = 0;
+
+    for (int k = 0; k < nruns; ++k)
+    {
+        if (runs[k].level > best)
+        {
+            continue;
+        }
+        simd_selected = runs[k].level;
+        bench_op(runs[k].name, runs[k].op, bmp, NULL, iters, &results[n++]);
+    }
+    simd_selected = best;
+    return n;
+}
+
+// Times decoding a .bmp file held in memory into a struct bitmap
+static void bench_read(const struct bitmap *bmp, int iters, struct bench_result *res)
+{
+    struct bitmap src = *bmp;
+    int file_size = bmp_file_size(&src);
+    byte *file = (byte *) calloc(file_size, 1);
+    write_bitmap(file, &src);
+
+    double *times = (double *) malloc(iters * sizeof(double));
+    for (int i = 0; i < iters; ++i)
+    {
+        struct bitmap out;
+        double start = now_seconds();
+        read_bitmap_layout(file, &out, bmp->layout);
+        times[i] = now_seconds() - start;
+        bitmap_free(&out);
+    }
+
+    res->name = "read_bitmap";
+    res->megapixels = (double) bmp->width * bmp->height / 1e6;
+    res->bytes = file_size + (double) bitmap_bytes(bmp);
+    bench_summarize(times, iters, res);
+    free(times);
+    free(file);
+}
+
+// Times encoding a struct bitmap into a .bmp file held in memory
+static void bench_write(const struct bitmap *bmp, int iters, struct bench_result *res)
+{
+    struct bitmap src = *bmp;
+    int file_size = bmp_file_size(&src);
+    byte *file = (byte *) calloc(file_size, 1);
+
+    double *times = (double *) malloc(iters * sizeof(double));
+    for (int i = 0; i < iters; ++i)
+    {
+        double start = now_seconds();
+        write_bitmap(file, &src);
+        times[i] = now_seconds() - start;
+    }
+
+    res->name = "write_bitmap";
+    res->megapixels = (double) bmp->width * bmp->height / 1e6;
+    res->bytes = file_size + (double) bitmap_bytes(bmp);
+    bench_summarize(times, iters, res);
+    free(times);
+    free(file);
+}
+
+// Times a plain memcpy of a .bmp file's worth of bytes between warm
+// buffers, the ceiling for read_bitmap and write_bitmap
+static void bench_memcpy(const struct bitmap *bmp, int iters, struct bench_result *res)
+{
+    struct bitmap src = *bmp;
+    int file_size = bmp_file_size(&src);
+    byte *from = (byte *) calloc(file_size, 1);
+    byte *to = (byte *) calloc(file_size, 1);
+
+    double *times = (double *) malloc(iters * sizeof(double));
+    for (int i = 0; i < iters; ++i)
+    {
+        double start = now_seconds();
+        memcpy(to, from, file_size);
+        times[i] = now_seconds() - start;
+    }
+
+    res->name = "memcpy (file size)";
+    res->megapixels = (double) bmp->width * bmp->height / 1e6;
+    res->bytes = 2.0 * file_size;
+    bench_summarize(times, iters, res);
+    free(times);
+    free(from);
+    free(to);
+}
+
+// Times writing bmp to a new file in dir with each writer backend
+static int bench_writers(const struct bitmap *bmp, int iters, const char *dir, struct bench_result *results)
+{
+    static const struct
+    {
+        const char *name;
+        int pwrite;
+        int direct;
+        int fsync_policy;
+    } backends[] = {
+        { "write mmap", 0, 0, FSYNC_NONE },
+        { "write mmap + fsync", 0, 0, FSYNC_END },
+        { "write pwrite", 1, 0, FSYNC_NONE },
+        { "write pwrite + fsync", 1, 0, FSYNC_END },
+        { "write O_DIRECT", 1, 1, FSYNC_END },
+    };
+    int nbackends = sizeof(backends) / sizeof(backends[0]);
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/project2-bench-%d.bmp", dir, (int) getpid());
+    struct bitmap src = *bmp;
+    int file_size = bmp_file_size(&src);
+    double *times = (double *) malloc(iters * sizeof(double));
+
+    for (int k = 0; k < nbackends; ++k)
+    {
+        struct bmp_writer writer;
+        bmp_writer_init(&writer, 4L << 20, backends[k].direct, backends[k].fsync_policy);
+
+        for (int i = 0; i < iters; ++i)
+        {
+            // Output files are normally new ones
+            unlink(path);
+
+            double start = now_seconds();
+            if (backends[k].pwrite)
+            {
+                if (write_bitmap_file(&writer, path, &src, NULL) == -1)
+                {
+                    free(times);
+                    return -1;
+                }
+            }
+            else
+            {
+                void *o_pointer = map_file_for_writing(path, file_size);
+                if (o_pointer == NULL)
+                {
+                    free(times);
+                    return -1;
+                }
+                write_bitmap(o_pointer, &src);
+                munmap(o_pointer, file_size);
+                if (backends[k].fsync_policy == FSYNC_END)
+                {
+                    int fd = open(path, O_RDWR);
+                    fdatasync(fd);
+                    close(fd);
+                }
+            }
+            times[i] = now_seconds() - start;
+        }
+
+        results[k].name = backends[k].name;
+        results[k].megapixels = (double) bmp->width * bmp->height / 1e6;
+        results[k].bytes = file_size + (double) bitmap_bytes(bmp);
+        bench_summarize(times, iters, &results[k]);
+        bmp_writer_release(&writer);
+    }
+
+    unlink(path);
+    free(times);
+    return nbackends;
+}
+
+static const char *simd_level_name(int level)
+{
+    if (level == SIMD_AVX2)
+    {
+        return "avx2";
+    }
+    else if (level == SIMD_SSE2)
+    {
+        return "sse2";
+    }
+    return "scalar";
+}
+
+static void bench_print(const struct bench_result *results, int n, const struct bitmap *bmp,
+                        int iters, int threads, int json)
+{
+    if (!json)
+    {
+        printf("%dx%d, %d iterations, %d threads, %s kernels, %s layout\n",
+            bmp->width, bmp->height, iters, threads, simd_level_name(simd_level()),
+            bmp->layout == LAYOUT_BGR24 ? "bgr24" : "int");
+        printf("%-20s %12s %12s %10s %10s\n", "op", "median ms", "p99 ms", "MP/s", "GB/s");
+        for (int i = 0; i < n; ++i)
+        {
+            const struct bench_result *r = &results[i];
+            printf("%-20s %12.3f %12.3f %10.1f %10.2f\n", r->name, r->median * 1e3, r->p99 * 1e3,
+                r->megapixels / r->median, r->bytes / r->median / 1e9);
+        }
+        return;
+    }
+
+    printf("{\n");
+    printf("  \"width\": %d,\n  \"height\": %d,\n", bmp->width, bmp->height);
+    printf("  \"iterations\": %d,\n  \"threads\": %d,\n", iters, threads);
+    printf("  \"simd\": \"%s\",\n", simd_level_name(simd_level()));
+    printf("  \"layout\": \"%s\",\n", bmp->layout == LAYOUT_BGR24 ? "bgr24" : "int");
+#ifdef __VERSION__
+    printf("  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+    printf("  \"results\": [\n");
+    for (int i = 0; i < n; ++i)
+    {
+        const struct bench_result *r = &results[i];
+        printf("    { \"op\": \"%s\", \"median_ms\": %.4f, \"p99_ms\": %.4f, "
+               "\"mp_per_s\": %.2f, \"gb_per_s\": %.3f }%s\n",
+            r->name, r->median * 1e3, r->p99 * 1e3, r->megapixels / r->median,
+            r->bytes / r->median / 1e9, i + 1 < n ? "," : "");
+    }
+    printf("  ]\n}\n");
+}
+
+int run_bench_cli(int argc, char *argv[])
+{
+    if (argc >= 3 && strcmp(argv[2], "rotate") == 0)
+    {
+        double sizes[16] = { 1, 16, 64 };
+        int nsizes = 3;
+
+        if (argc > 3)
+        {
+            nsizes = 0;
+            for (int i = 3; i < argc && nsizes < 16; ++i)
+            {
+                sizes[nsizes++] = atof(argv[i]);
+            }
+        }
+        return bench_rotate(nsizes, sizes);
+    }
+
+    int width = 4000;
+    int height = 3000;
+    int iters = 10;
+    int threads = 1;
+    int json = 0;
+    int layout = LAYOUT_INT;
+    int use_arena = 0;
+    int writers = argc >= 3 && strcmp(argv[2], "writer") == 0;
+    int warps = argc >= 3 && strcmp(argv[2], "warp") == 0;
+    const char *dir = "/tmp";
+
+    for (int i = writers || warps ? 3 : 2; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width < 2 || height < 2)
+            {
+                printf("Error: --size needs WxH, e.g. 4000x3000\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc)
+        {
+            iters = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+        {
+            json = 1;
+        }
+        else if (strcmp(argv[i], "--arena") == 0)
+        {
+            use_arena = 1;
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            dir = argv[++i];
+        }
+        else if (strcmp(argv[i], "--angle") == 0 && i + 1 < argc)
+        {
+            bench_warp_angle = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+        {
+            layout = parse_layout(argv[++i]);
+            if (layout == -1)
+            {
+                printf("Error: --layout needs int or bgr24\n");
+                return 1;
+            }
+        }
+        else
+        {
+            printf("Usage: %s bench [--size WxH] [--iters N] [--threads N] [--layout int|bgr24]\n"
+                   "       [--arena] [--json]\n"
+                   "       %s bench rotate [MP ...]\n"
+                   "       %s bench writer [--size WxH] [--iters N] [--dir DIR] [--json]\n"
+                   "       %s bench warp [--size WxH] [--iters N] [--threads N] [--angle DEG] [--json]\n",
+                   argv[0], argv[0], argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (iters < 1 || threads < 1)
+    {
+        printf("Error: --iters and --threads need positive numbers\n");
+        return 1;
+    }
+    set_thread_count(threads);
+
+    static const struct
+    {
+        const char *name;
+        void (*op)(struct bitmap *);
+    } ops[] = {
+        { "bitmap_to_grayscale", bitmap_to_grayscale },
+        { "grayscale bt601", bench_grayscale_bt601 },
+        { "grayscale bt709", bench_grayscale_bt709 },
+        { "bitmap_posterize", bitmap_posterize },
+        { "posterize 5 levels", bench_posterize_levels5 },
+        { "posterize 64 levels", bench_posterize_levels64 },
+        { "bitmap_mirror", bitmap_mirror },
+        { "bitmap_squash", bitmap_squash },
+        { "bitmap_reflect", bitmap_reflect },
+        { "bitmap_rotate", bitmap_rotate },
+        { "bitmap_skew", bitmap_skew },
+        { "bitmap_shrink", bitmap_shrink },
+        { "resize box 1/3", bench_resize_box },
+        { "resize bilinear 2/5", bench_resize_bilinear },
+        { "resize lanczos 2/5", bench_resize_lanczos },
+        { "warp rotate bilinear", bench_warp_bilinear },
+        { "5 remaps eager", bench_remaps_eager },
+        { "5 remaps lazy", bench_remaps_lazy },
+        { "bitmap_stats", bench_stats },
+    };
+    int nops = sizeof(ops) / sizeof(ops[0]);
+    posterize_table_levels(&bench_levels5, 5, 5, 5);
+    posterize_table_levels(&bench_levels64, 64, 64, 64);
+
+    struct bitmap bmp;
+    make_test_bitmap(&bmp, width, height);
+    bitmap_set_layout(&bmp, layout);
+
+    struct pixel_arena arena;
+    pixel_arena_init(&arena);
+
+    struct bench_result results[32];
+    int n = 0;
+    if (writers)
+    {
+        n = bench_writers(&bmp, iters, dir, results);
+        if (n > 0)
+        {
+            bench_print(results, n, &bmp, iters, threads, json);
+        }
+        bitmap_free(&bmp);
+        return n > 0 ? 0 : 1;
+    }
+    if (warps)
+    {
+        n = bench_warps(&bmp, iters, results);
+        bench_print(results, n, &bmp, iters, threads, json);
+        bitmap_free(&bmp);
+        return 0;
+    }
+    bench_read(&bmp, iters, &results[n++]);
+    for (int i = 0; i < nops; ++i)
+    {
+        bench_op(ops[i].name, ops[i].op, &bmp, use_arena ? &arena : NULL, iters, &results[n++]);
+    }
+    bench_write(&bmp, iters, &results[n++]);
+    bench_memcpy(&bmp, iters, &results[n++]);
+
+    bench_print(results, n, &bmp, iters, threads, json);
+    bitmap_free(&bmp);
+    pixel_arena_release(&arena);
+    return 0;
+}
+
+// ---- Self tests ----
+
+// Each test returns how many checks failed, having printed the first
+// few of them
+
+// The SIMD settings the tests run under: each level up to the best one
+// this CPU (and PROJECT2_SIMD) allows, with SSE2 both without and with
+// the SSSE3 kernels
+struct test_simd
+{
+    const char *name;
+    int level;
+    int ssse3;
+};
+
+static const struct test_simd test_simds[4] = {
+    { "scalar", SIMD_SCALAR, 0 },
+    { "sse2", SIMD_SSE2, 0 },
+    { "ssse3", SIMD_SSE2, 1 },
+    { "avx2", SIMD_AVX2, 1 },
+};
+
+// Switches the kernels to one of test_simds, or returns 0 if it is
+// beyond what is allowed. test_simd_restore() goes back to the best.
+static int test_simd_force(const struct test_simd *t)
+{
+    simd_selected = -1;
+    int best = simd_level();
+    if (t->level > best || (t->ssse3 && !simd_ssse3_selected))
+    {
+        return 0;
+    }
+    simd_selected = t->level;
+    simd_ssse3_selected = t->ssse3;
+    return 1;
+}
+
+static void test_simd_restore(void)
+{
+    simd_selected = -1;
+    simd_level();
+}
+
+// Every 24-bit pixel, in both layouts and under each SIMD setting,
+// through grayscale in each gray_mode and through posterize, against
+// grayscale_pixel and posterize_pixel. The runs are a few pixels
+// longer than a power of two, so the vector kernels' tails get
+// checked too.
+static int test_point_ops(void)
+{
+    static const int ops[4] = { OP_GRAYSCALE, OP_GRAYSCALE_BT601, OP_GRAYSCALE_BT709, OP_POSTERIZE };
+    const long chunk = (1 << 16) + 3;
+    int *px = (int *) bitmap_malloc(chunk * sizeof(int));
+    byte *bgr = (byte *) bitmap_malloc(chunk * 3);
+    int failures = 0;
+
+    for (int t = 0; t < 4; ++t)
+    {
+        if (!test_simd_force(&test_simds[t]))
+        {
+            continue;
+        }
+        for (int k = 0; k < 4; ++k)
+        {
+            const struct gray_weights *w = gray_op_weights(ops[k]);
+            for (long first = 0; first < 1L << 24; first += chunk)
+            {
+                long n = (1L << 24) - first < chunk ? (1L << 24) - first : chunk;
+                for (long i = 0; i < n; ++i)
+                {
+                    px[i] = (int) (first + i);
+                }
+                encode_row_scalar(px, bgr, n);
+                if (w != NULL)
+                {
+                    grayscale_span(w, px, n);
+                }
+                else
+                {
+                    posterize_span(px, n);
+                }
+                bgr24_point_span(ops[k], bgr, n);
+
+                for (long i = 0; i < n; ++i)
+                {
+                    int p = (int) (first + i);
+                    int want = w != NULL ? grayscale_pixel(w, p) : posterize_pixel(p);
+                    int got = (bgr[3 * i + 2] << 16) | (bgr[3 * i + 1] << 8) | bgr[3 * i];
+                    if ((px[i] != want || got != want) && failures++ < 5)
+                    {
+                        printf("  %s, op %d: %06x became %06x (int) and %06x (bgr24), not %06x\n",
+                               test_simds[t].name, ops[k], p, px[i], got, want);
+                    }
+                }
+            }
+        }
+    }
+    test_simd_restore();
+    free(px);
+    free(bgr);
+    return failures;
+}
+
+// decode_row and encode_row under each SIMD setting, at widths around
+// the 8- and 16-pixel vectors: every pixel must match rgb_to_pixel and
+// pixel_to_rgb, and guard bytes after each row must stay untouched
+static int test_row_round_trip(void)
+{
+    static const int widths[] = { 1, 7, 8, 9, 15, 16, 17, 31, 33 };
+    const int guard = 64;
+    byte src[3 * 33];
+    byte out[3 * 33 + 64];
+    int px[33 + 64 / 4];
+    int failures = 0;
+
+    unsigned int seed = 777;
+    for (int i = 0; i < (int) sizeof(src); ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        src[i] = (seed >> 16) & 0xff;
+    }
+
+    for (int t = 0; t < 4; ++t)
+    {
+        if (!test_simd_force(&test_simds[t]))
+        {
+            continue;
+        }
+        for (int k = 0; k < (int) (sizeof(widths) / sizeof(widths[0])); ++k)
+        {
+            int n = widths[k];
+            memset(px, 0xa5, sizeof(px));
+            memset(out, 0xa5, sizeof(out));
+            decode_row(src, px, n);
+            encode_row(px, out, n);
+
+            for (int x = 0; x < n; ++x)
+            {
+                int want;
+                rgb_to_pixel(&want, src[3 * x + 2], src[3 * x + 1], src[3 * x]);
+                int r, g, b;
+                pixel_to_rgb(px[x], &r, &g, &b);
+                if ((px[x] != want || out[3 * x] != b || out[3 * x + 1] != g || out[3 * x + 2] != r)
+                    && failures++ < 5)
+                {
+                    printf("  %s, width %d: pixel %d decoded to %06x, not %06x\n", test_simds[t].name, n, x,
+                           px[x], want);
+                }
+            }
+            for (int i = n; i < (int) (sizeof(px) / sizeof(px[0])); ++i)
+            {
+                if (px[i] != (int) 0xa5a5a5a5 && failures++ < 5)
+                {
+                    printf("  %s, width %d: decode_row wrote past the row\n", test_simds[t].name, n);
+                }
+            }
+            for (int i = 3 * n; i < 3 * n + guard; ++i)
+            {
+                if (out[i] != 0xa5 && failures++ < 5)
+                {
+                    printf("  %s, width %d: encode_row wrote past the row\n", test_simds[t].name, n);
+                }
+            }
+        }
+    }
+    test_simd_restore();
+    return failures;
+}
+
+// A warp whose canvas can't fit a .bmp file is refused and leaves the
+// image alone, and a large one that fits comes out at the size its
+// corners give
+static int test_warp_limits(void)
+{
+    int failures = 0;
+    struct bitmap bmp;
+    make_test_bitmap(&bmp, 523, 411);
+
+    struct affine m;
+    affine_identity(&m);
+    affine_scale(&m, 200, 200);
+    if (bitmap_warp(&bmp, &m, SAMPLE_BILINEAR) != -1 || bmp.width != 523 || bmp.height != 411)
+    {
+        printf("  a 200x scale of 523x411 wasn't refused\n");
+        failures++;
+    }
+
+    affine_identity(&m);
+    affine_rotate(&m, 90);
+    affine_scale(&m, 100000, 1);
+    if (bitmap_warp(&bmp, &m, SAMPLE_NEAREST) != -1 || bmp.width != 523 || bmp.height != 411)
+    {
+        printf("  a rotate and 100000x scale wasn't refused\n");
+        failures++;
+    }
+
+    affine_identity(&m);
+    affine_rotate(&m, 90);
+    affine_scale(&m, 8, 8);
+    if (bitmap_warp(&bmp, &m, SAMPLE_BILINEAR) != 0 || bmp.width != 411 * 8 || bmp.height != 523 * 8)
+    {
+        printf("  a rotate and 8x scale of 523x411 gave %dx%d\n", bmp.width, bmp.height);
+        failures++;
+    }
+    bitmap_free(&bmp);
+    return failures;
+}
+
+int run_test_cli(int argc, char *argv[])
+{
+    static const struct
+    {
+        const char *name;
+        int (*run)(void);
+    } tests[] = {
+        { "point-ops", test_point_ops },
+        { "row-round-trip", test_row_round_trip },
+        { "warp-limits", test_warp_limits },
+    };
+    int ntests = sizeof(tests) / sizeof(tests[0]);
+
+    int failed = 0;
+    int ran = 0;
+    for (int i = 0; i < ntests; ++i)
+    {
+        int wanted = argc <= 2;
+        for (int k = 2; k < argc; ++k)
+        {
+            wanted |= strcmp(argv[k], tests[i].name) == 0;
+        }
+        if (!wanted)
+        {
+            continue;
+        }
+
+        int failures = tests[i].run();
+        printf("%s %s\n", failures == 0 ? "ok  " : "FAIL", tests[i].name);
+        failed += failures != 0;
+        ran++;
+    }
+    if (ran == 0)
+    {
+        printf("Usage: %s test [NAME ...]\n", argv[0]);
+        return 1;
+    }
+    return failed != 0;
+}
+
+// A bounded queue of pointers between two stages of the batch
+// pipeline. batch_queue_pop() blocks until there is an item, and
+// returns NULL once the queue is closed and empty.
+struct batch_queue
+{
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+static void batch_queue_init(struct batch_queue *q, int capacity)
+{
+    q->items = (void **) malloc(capacity * sizeof(void *));
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+}
+
+static void batch_queue_destroy(struct batch_queue *q)
+{
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+}
+
+static void batch_queue_push(struct batch_queue *q, void *item)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+    {
+        pthread_cond_wait(&q->not_full, &q->lock);
+    }
+    q->items[(q->head + q->count) % q->capacity] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void *batch_queue_pop(struct batch_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+    {
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    }
+
+    void *item = NULL;
+    if (q->count > 0)
+    {
+        item = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+static void batch_queue_close(struct batch_queue *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// One image on its way through the batch. Slots go round from the
+// reader to a worker to the writer and back, each with the arena its
+// pixels live in, so memory use is fixed by the number of slots.
+struct batch_slot
+{
+    const char *in_path;
+    char out_path[4096];
+    byte *file;
+    long file_size;
+    struct pixel_arena arena;
+    struct bitmap bmp;
+    int ok;
+};
+
+struct batch
+{
+    const struct pipeline *pl;
+    int layout;
+    char **paths;
+    int npaths;
+    const char *out_dir;
+    struct batch_queue free_slots;
+    struct batch_queue to_transform;
+    struct batch_queue to_write;
+    int workers_running;
+};
+
+// Maps each input in turn and asks the kernel to start reading it in
+// before a worker gets to it
+static void *batch_reader(void *arg)
+{
+    struct batch *b = (struct batch *) arg;
+
+    for (int i = 0; i < b->npaths; ++i)
+    {
+        struct batch_slot *slot = (struct batch_slot *) batch_queue_pop(&b->free_slots);
+        int ev = trace_begin("batch read");
+
+        slot->in_path = b->paths[i];
+        const char *name = strrchr(slot->in_path, '/');
+        name = name != NULL ? name + 1 : slot->in_path;
+        int n = snprintf(slot->out_path, sizeof(slot->out_path), "%s/%s", b->out_dir, name);
+
+        struct stat statbuf;
+        slot->file = NULL;
+        slot->ok = n < (int) sizeof(slot->out_path) && stat(slot->in_path, &statbuf) == 0
+            && statbuf.st_size >= 54;
+        if (slot->ok)
+        {
+            slot->file_size = statbuf.st_size;
+            slot->file = (byte *) map_file_for_reading((char *) slot->in_path);
+            slot->ok = slot->file != NULL;
+        }
+        if (slot->ok)
+        {
+            madvise(slot->file, slot->file_size, MADV_SEQUENTIAL);
+            madvise(slot->file, slot->file_size, MADV_WILLNEED);
+        }
+
+        trace_end(ev, 0);
+        batch_queue_push(&b->to_transform, slot);
+    }
+    batch_queue_close(&b->to_transform);
+    return NULL;
+}
+
+// Decodes an image into its slot's arena and runs the pipeline on it
+static void *batch_worker(void *arg)
+{
+    struct batch *b = (struct batch *) arg;
+    struct batch_slot *slot;
+
+    while ((slot = (struct batch_slot *) batch_queue_pop(&b->to_transform)) != NULL)
+    {
+        if (slot->ok)
+        {
+            int ev = trace_begin("batch transform");
+            slot->ok = bmp_file_check(slot->file, slot->file_size) != -1;
+            if (slot->ok)
+            {
+                read_bitmap_arena(slot->file, &slot->bmp, b->layout, &slot->arena);
+            }
+            munmap(slot->file, slot->file_size);
+            if (slot->ok)
+            {
+                slot->ok = pipeline_run(b->pl, &slot->bmp) != -1;
+            }
+            trace_end(ev, slot->file_size);
+        }
+        batch_queue_push(&b->to_write, slot);
+    }
+
+    if (__atomic_sub_fetch(&b->workers_running, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        batch_queue_close(&b->to_write);
+    }
+    return NULL;
+}
+
+// Adds path to a growing list
+static void batch_add_path(char ***paths, int *npaths, int *cap, const char *path)
+{
+    if (*npaths == *cap)
+    {
+        *cap = *cap ? 2 * *cap : 64;
+        *paths = (char **) realloc(*paths, *cap * sizeof(char *));
+    }
+    (*paths)[(*npaths)++] = strdup(path);
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// The .bmp files of a directory, in name order, or the lines of a list
+// file. Returns -1 if source can't be read.
+static int batch_collect(const char *source, char ***paths, int *npaths)
+{
+    int cap = 0;
+    *paths = NULL;
+    *npaths = 0;
+
+    DIR *dir = opendir(source);
+    if (dir != NULL)
+    {
+        struct dirent *entry;
+        char path[4096];
+        while ((entry = readdir(dir)) != NULL)
+        {
+            size_t len = strlen(entry->d_name);
+            if (len > 4 && strcasecmp(entry->d_name + len - 4, ".bmp") == 0
+                && snprintf(path, sizeof(path), "%s/%s", source, entry->d_name) < (int) sizeof(path))
+            {
+                batch_add_path(paths, npaths, &cap, path);
+            }
+        }
+        closedir(dir);
+        qsort(*paths, *npaths, sizeof(char *), compare_strings);
+        return 0;
+    }
+
+    FILE *list = fopen(source, "r");
+    if (list == NULL)
+    {
+        perror(source);
+        return -1;
+    }
+    char line[4096];
+    while (fgets(line, sizeof(line), list) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] != '\0')
+        {
+            batch_add_path(paths, npaths, &cap, line);
+        }
+    }
+    fclose(list);
+    return 0;
+}
+
+int run_batch_cli(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        printf("Usage: %s --batch <dir|list> outdir --ops g,p,h,o [--workers N] [--queue N]\n"
+               "       [--layout int|bgr24] [--trace FILE] [--writer mmap|pwrite] [--o-direct]\n"
+               "       [--fsync none|end|each] [--write-buffer SIZE] [--levels N|R,G,B]\n"
+               "       [--thresholds [red:|green:|blue:]T,T,...[=V,V,...]] [--resize WxH]\n"
+               "       [--filter box|bilinear|lanczos] [--rotate DEG] [--shear X[,Y]] [--scale X[,Y]]\n"
+               "       [--sample nearest|bilinear] [--out-format bgr24|bgra32|bitfields|pal8]\n"
+               "       [--top-down] [--gray average|bt601|bt709]\n", argv[0]);
+        return 1;
+    }
+
+    char *ops = NULL;
+    int workers = 4;
+    int depth = 2;
+    int layout = LAYOUT_INT;
+    int gray = GRAY_AVERAGE;
+    struct writer_options wopts = { 0, 0, FSYNC_NONE, 4L << 20, BMP_BGR24, 0 };
+    struct posterize_options popts;
+    popts.set = 0;
+    struct resize_options ropts = { 0, 0, FILTER_LANCZOS };
+    struct warp_options aopts;
+    aopts.set = 0;
+    aopts.sample = SAMPLE_BILINEAR;
+    affine_identity(&aopts.forward);
+
+    for (int i = 4; i < argc; ++i)
+    {
+        int used = parse_writer_option(argc, argv, &i, &wopts);
+        if (used == 0)
+        {
+            used = parse_posterize_option(argc, argv, &i, &popts);
+        }
+        if (used == 0)
+        {
+            used = parse_resize_option(argc, argv, &i, &ropts);
+        }
+        if (used == 0)
+        {
+            used = parse_warp_option(argc, argv, &i, &aopts);
+        }
+        if (used == -1)
+        {
+            return 1;
+        }
+        else if (used)
+        {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            ops = argv[++i];
+        }
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+        {
+            workers = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+        {
+            depth = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+        {
+            layout = parse_layout(argv[++i]);
+            if (layout == -1)
+            {
+                printf("Error: --layout needs int or bgr24\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--gray") == 0 && i + 1 < argc)
+        {
+            gray = parse_gray_mode(argv[++i]);
+            if (gray == -1)
+            {
+                printf("Error: --gray needs average, bt601 or bt709\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_enable(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (ops == NULL || workers < 1 || depth < 1)
+    {
+        printf("Error: --batch needs --ops, and positive --workers and --queue\n");
+        return 1;
+    }
+
+    struct pipeline plan;
+    struct pipeline *pl = &plan;
+    if (pipeline_plan(ops, pl) == -1)
+    {
+        return 1;
+    }
+    if (popts.set)
+    {
+        pipeline_set_posterize(pl, &popts.table);
+    }
+    pipeline_set_grayscale(pl, gray);
+    if (aopts.set)
+    {
+        pipeline_set_warp(pl, &aopts.forward, aopts.sample);
+    }
+    if (ropts.width != 0)
+    {
+        pipeline_set_resize(pl, ropts.width, ropts.height, ropts.filter);
+    }
+
+    struct batch b;
+    b.pl = pl;
+    b.layout = layout;
+    b.out_dir = argv[3];
+    if (batch_collect(argv[2], &b.paths, &b.npaths) == -1)
+    {
+        return 1;
+    }
+
+    // Every worker has a whole image to itself, so the rows of one
+    // image stay on one thread. Kernels are picked before the threads
+    // start.
+    set_thread_count(1);
+    simd_level();
+
+    // Up to depth images wait in each queue on top of those being worked on
+    int nslots = workers + 2 * depth + 1;
+    struct batch_slot *slots = (struct batch_slot *) calloc(nslots, sizeof(struct batch_slot));
+    batch_queue_init(&b.free_slots, nslots);
+    batch_queue_init(&b.to_transform, nslots);
+    batch_queue_init(&b.to_write, nslots);
+    for (int i = 0; i < nslots; ++i)
+    {
+        pixel_arena_init(&slots[i].arena);
+        batch_queue_push(&b.free_slots, &slots[i]);
+    }
+    b.workers_running = workers;
+
+    double start = now_seconds();
+    pthread_t reader;
+    pthread_t *threads = (pthread_t *) malloc(workers * sizeof(pthread_t));
+    pthread_create(&reader, NULL, batch_reader, &b);
+    for (int i = 0; i < workers; ++i)
+    {
+        pthread_create(&threads[i], NULL, batch_worker, &b);
+    }
+
+    // This thread is the writer, with one write buffer for every file
+    struct bmp_writer writer;
+    if (wopts.pwrite)
+    {
+        bmp_writer_init(&writer, wopts.buffer_size, wopts.direct, wopts.fsync_policy);
+    }
+
+    struct bmp_format format;
+    struct bmp_format *out_fmt = &format;
+    long done = 0, failed = 0;
+    double bytes_out = 0;
+    struct batch_slot *slot;
+    while ((slot = (struct batch_slot *) batch_queue_pop(&b.to_write)) != NULL)
+    {
+        int written = 0;
+        int file_size = 0;
+        // An image with too many colors for a palette counts as failed
+        if (slot->ok && bmp_format_for(out_fmt, &slot->bmp, wopts.format, wopts.top_down) == 0)
+        {
+            int ev = trace_begin("batch write");
+            file_size = bmp_format_file_size(out_fmt, &slot->bmp);
+            if (wopts.pwrite)
+            {
+                written = write_bitmap_file(&writer, slot->out_path, &slot->bmp, out_fmt) == 0;
+            }
+            else
+            {
+                byte *o_pointer = (byte *) map_file_for_writing(slot->out_path, file_size);
+                if (o_pointer != NULL)
+                {
+                    write_bitmap_format(o_pointer, &slot->bmp, out_fmt);
+                    munmap(o_pointer, file_size);
+                    written = 1;
+                }
+            }
+            trace_end(ev, file_size);
+        }
+
+        if (written)
+        {
+            done++;
+            bytes_out += file_size;
+        }
+        else
+        {
+            printf("Error: could not process %s\n", slot->in_path);
+            failed++;
+        }
+        batch_queue_push(&b.free_slots, slot);
+    }
+
+    pthread_join(reader, NULL);
+    for (int i = 0; i < workers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = now_seconds() - start;
+    if (wopts.pwrite)
+    {
+        bmp_writer_release(&writer);
+    }
+
+    printf("%ld images (%ld failed) in %.3f s with %d workers: %.1f images/s, %.1f MB/s written\n",
+        done, failed, elapsed, workers, elapsed > 0 ? done / elapsed : 0.0,
+        elapsed > 0 ? bytes_out / elapsed / 1e6 : 0.0);
+
+    for (int i = 0; i < nslots; ++i)
+    {
+        pixel_arena_release(&slots[i].arena);
+    }
+    for (int i = 0; i < b.npaths; ++i)
+    {
+        free(b.paths[i]);
+    }
+    batch_queue_destroy(&b.free_slots);
+    batch_queue_destroy(&b.to_transform);
+    batch_queue_destroy(&b.to_write);
+    free(b.paths);
+    free(threads);
+    free(slots);
+    return failed > 0 ? 1 : 0;
+}
+
+int run_mips_cli(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        printf("Usage: %s --mips in.bmp out_prefix [--max-levels N] [--trace FILE]\n", argv[0]);
+        return 1;
+    }
+
+    int max_levels = MAX_MIP_LEVELS;
+    for (int i = 4; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--max-levels") == 0 && i + 1 < argc)
+        {
+            max_levels = atoi(argv[++i]);
+            if (max_levels < 1)
+            {
+                printf("Error: --max-levels needs a positive number\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_enable(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    int ev = trace_begin("map_file_for_reading");
+    long in_size;
+    void *bmp_file = map_bitmap_for_reading(argv[2], &in_size);
+    trace_end(ev, 0);
+    if (bmp_file == NULL)
+    {
+        return 1;
+    }
+
+    struct bitmap in;
+    struct bmp_format fmt;
+    int levels = read_bitmap_format(bmp_file, &in, &fmt) == -1 ? -1 : write_mip_chain(bmp_file, argv[3], max_levels);
+    munmap(bmp_file, in_size);
+    if (levels >= 0)
+    {
+        printf("%d levels written, down to %dx%d\n", levels,
+               levels > 0 ? in.width >> levels : in.width, levels > 0 ? in.height >> levels : in.height);
+    }
+    return levels == -1;
+}
+
+int run_pipeline_cli(int argc, char *argv[])
+{
+    char *in_filename = argv[1];
+    char *out_filename = argv[2];
+    char *ops = NULL;
+    int direct = 1;
+    int streaming = 0;
+    long mem_budget = 64L << 20;
+    int layout = LAYOUT_INT;
+    int gray = GRAY_AVERAGE;
+    struct writer_options wopts = { 0, 0, FSYNC_NONE, 4L << 20, BMP_BGR24, 0 };
+    struct posterize_options popts;
+    popts.set = 0;
+    struct resize_options ropts = { 0, 0, FILTER_LANCZOS };
+    struct warp_options aopts;
+    aopts.set = 0;
+    aopts.sample = SAMPLE_BILINEAR;
+    affine_identity(&aopts.forward);
+    struct rect crop = { 0, 0, 0, 0 };
+    int auto_levels = 0;
+    int auto_posterize = 0;
+
+    for (int i = 3; i < argc; ++i)
+    {
+        int used = parse_writer_option(argc, argv, &i, &wopts);
+        if (used == 0)
+        {
+            used = parse_posterize_option(argc, argv, &i, &popts);
+        }
+        if (used == 0)
+        {
+            used = parse_resize_option(argc, argv, &i, &ropts);
+        }
+        if (used == 0)
+        {
+            used = parse_warp_option(argc, argv, &i, &aopts);
+        }
+        if (used == -1)
+        {
+            return 1;
+        }
+        else if (used)
+        {
+            continue;
+        }
+
+        if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+        {
+            ops = argv[++i];
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+            {
+                printf("Error: --threads needs a positive number\n");
+                return 1;
+            }
+            set_thread_count(n);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_enable(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--no-direct") == 0)
+        {
+            direct = 0;
+        }
+        else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d+%d+%d", &crop.width, &crop.height, &crop.x, &crop.y) != 4
+                || crop.width < 1 || crop.height < 1)
+            {
+                printf("Error: --crop needs WxH+X+Y, e.g. 64x64+100+200\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--auto-levels") == 0)
+        {
+            auto_levels = 1;
+        }
+        else if (strcmp(argv[i], "--auto-posterize") == 0 && i + 1 < argc)
+        {
+            auto_posterize = atoi(argv[++i]);
+            if (auto_posterize < 2 || auto_posterize > 256)
+            {
+                printf("Error: --auto-posterize needs 2 to 256 levels\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            streaming = 1;
+        }
+        else if (strcmp(argv[i], "--mem-budget") == 0 && i + 1 < argc)
+        {
+            mem_budget = parse_size(argv[++i]);
+            if (mem_budget <= 0)
+            {
+                printf("Error: --mem-budget needs a size such as 64M\n");
+                return 1;
+            }
+            streaming = 1;
+        }
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+        {
+            layout = parse_layout(argv[++i]);
+            if (layout == -1)
+            {
+                printf("Error: --layout needs int or bgr24\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--gray") == 0 && i + 1 < argc)
+        {
+            gray = parse_gray_mode(argv[++i]);
+            if (gray == -1)
+            {
+                printf("Error: --gray needs average, bt601 or bt709\n");
+                return 1;
+            }
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (ops == NULL)
+    {
+        printf("Usage: %s in.bmp out.bmp --ops g,p,h,o [--threads N] [--no-direct]\n"
+               "       [--stream] [--mem-budget SIZE] [--layout int|bgr24] [--trace FILE]\n"
+               "       [--writer mmap|pwrite] [--o-direct] [--fsync none|end|each] [--write-buffer SIZE]\n"
+               "       [--levels N|R,G,B] [--thresholds [red:|green:|blue:]T,T,...[=V,V,...]]\n"
+               "       [--resize WxH] [--filter box|bilinear|lanczos] [--rotate DEG] [--shear X[,Y]]\n"
+               "       [--scale X[,Y]] [--sample nearest|bilinear]\n"
+               "       [--out-format bgr24|bgra32|bitfields|pal8] [--top-down] [--crop WxH+X+Y]\n"
+               "       [--auto-levels | --auto-posterize N] [--gray average|bt601|bt709]\n",
+               argv[0]);
+        return 1;
+    }
+
+    struct pipeline plan;
+    struct pipeline *pl = &plan;
+    if (pipeline_plan(ops, pl) == -1)
+    {
+        return 1;
+    }
+    if (popts.set)
+    {
+        pipeline_set_posterize(pl, &popts.table);
+    }
+    pipeline_set_grayscale(pl, gray);
+    if (aopts.set)
+    {
+        pipeline_set_warp(pl, &aopts.forward, aopts.sample);
+    }
+    if (ropts.width != 0)
+    {
+        pipeline_set_resize(pl, ropts.width, ropts.height, ropts.filter);
+    }
+
+    if (streaming && (wopts.format != BMP_BGR24 || wopts.top_down))
+    {
+        printf("Error: --stream only writes 24-bit bitmaps with their rows bottom to top\n");
+        return 1;
+    }
+    if (streaming && crop.width != 0)
+    {
+        printf("Error: --stream can't be used with --crop\n");
+        return 1;
+    }
+    if ((auto_levels || auto_posterize) && (streaming || popts.set || (auto_levels && auto_posterize)))
+    {
+        printf("Error: --auto-levels and --auto-posterize go without --stream, --levels, --thresholds or each other\n");
+        return 1;
+    }
+    if (streaming)
+    {
+        int result = pipeline_run_streaming(pl, in_filename, out_filename, mem_budget);
+        return result == -1 ? 1 : 0;
+    }
+
+    int ev = trace_begin("map_file_for_reading");
+    long in_size;
+    void *pointer = map_bitmap_for_reading(in_filename, &in_size);
+    trace_end(ev, 0);
+    if (pointer == NULL)
+    {
+        return 1;
+    }
+
+    struct bitmap in;
+    struct bmp_format in_fmt;
+    read_bitmap_format(pointer, &in, &in_fmt);
+    const struct rect *window = crop.width != 0 ? &crop : NULL;
+
+    // The automatic posterizes are worked out from the input's rows
+    // (the window's, with --crop) before anything is decoded
+    if (auto_levels || auto_posterize)
+    {
+        struct image_stats stats;
+        struct image_stats *st = &stats;
+        int result = bmp_file_stats(pointer, window, st);
+        if (result == 0 && auto_levels)
+        {
+            posterize_table_auto_levels(&popts.table, st, 0.005);
+        }
+        else if (result == 0)
+        {
+            result = posterize_table_auto(&popts.table, st, auto_posterize);
+        }
+        if (result == -1)
+        {
+            munmap(pointer, in_size);
+            return 1;
+        }
+        pipeline_set_posterize(pl, &popts.table);
+    }
+
+    // Single-pass chains go straight from file to file, unless the
+    // input has to be decoded (8-bit or other masks) or the output is
+    // to go through the pwrite writer or be in another format
+    if (direct && !wopts.pwrite && pipeline_is_direct(pl)
+        && (in_fmt.format == BMP_BGR24 || in_fmt.format == BMP_BGRA32)
+        && wopts.format == BMP_BGR24 && !wopts.top_down)
+    {
+        int result = pipeline_run_direct_rect(pl, pointer, window, out_filename);
+        munmap(pointer, in_size);
+        return result == -1 ? 1 : 0;
+    }
+
+    // The passes ping-pong between two buffers instead of allocating
+    // one each
+    struct pixel_arena arena;
+    pixel_arena_init(&arena);
+
+    struct bitmap bmp;
+    ev = trace_begin("read_bitmap");
+    if (read_bitmap_rect(pointer, &bmp, layout, &arena, window) == -1)
+    {
+        munmap(pointer, in_size);
+        pixel_arena_release(&arena);
+        return 1;
+    }
+    trace_end(ev, (window != NULL ? (long) crop.width * crop.height * 3 : in_size) + bitmap_bytes(&bmp));
+    munmap(pointer, in_size);
+
+    if (pipeline_run(pl, &bmp) == -1)
+    {
+        pixel_arena_release(&arena);
+        return 1;
+    }
+
+    struct bmp_format format;
+    struct bmp_format *out_fmt = &format;
+    if (bmp_format_for(out_fmt, &bmp, wopts.format, wopts.top_down) == -1)
+    {
+        pixel_arena_release(&arena);
+        return 1;
+    }
+    int file_size = bmp_format_file_size(out_fmt, &bmp);
+    if (wopts.pwrite)
+    {
+        struct bmp_writer writer;
+        bmp_writer_init(&writer, wopts.buffer_size, wopts.direct, wopts.fsync_policy);
+        ev = trace_begin("write_bitmap_file");
+        int result = write_bitmap_file(&writer, out_filename, &bmp, out_fmt);
+        trace_end(ev, file_size + bitmap_bytes(&bmp));
+        bmp_writer_release(&writer);
+        pixel_arena_release(&arena);
+        return result == -1 ? 1 : 0;
+    }
 
+    ev = trace_begin("map_file_for_writing");
+    void *o_pointer = map_file_for_writing(out_filename, file_size);
+    trace_end(ev, 0);
+    if (o_pointer == NULL)
+    {
+        pixel_arena_release(&arena);
+        return 1;
+    }
+    ev = trace_begin("write_bitmap");
+    write_bitmap_format(o_pointer, &bmp, out_fmt);
+    trace_end(ev, file_size + bitmap_bytes(&bmp));
+    ev = trace_begin("munmap");
+    munmap(o_pointer, file_size);
+    trace_end(ev, file_size);
 
-        for (int y = 0; y < bmp->height; ++y)
-            {
-                for (int x = 0; x < bmp->width; ++x)
-                {
-                    int stored_pixel = bmp->pixels[y * bmp->width + x];
+    pixel_arena_release(&arena);
+    return 0;
+}
 
-                    new_pixels[y * bmp->width + (bmp->width - x + 1)] = stored_pixel;
-                }
-            }
-            
-        free(bmp->pixels);
-        bmp->pixels = new_pixels;
+// ---- Server mode ----
+
+// A decoded input kept by the server. mtime and size are the file's
+// when it was decoded, to tell whether it has changed since.
+struct cache_entry
+{
+    char *path;
+    struct timespec mtime;
+    long size;
+    struct bitmap bmp;
+    long last_used;
+};
+
+// The server's decoded inputs. Once they take more than budget bytes,
+// the least recently used go first.
+struct image_cache
+{
+    struct cache_entry *entries;
+    int nentries;
+    int capacity;
+    long bytes;
+    long budget;
+    long tick;
+    long hits;
+    long misses;
+    long evictions;
+};
+
+#define SERVE_LATENCIES 1024
+
+// The latencies of the last SERVE_LATENCIES requests of one kind, in
+// seconds
+struct latency_ring
+{
+    double times[SERVE_LATENCIES];
+    int count;
+    int next;
+};
+
+struct serve_state
+{
+    struct image_cache cache;
+    struct pixel_arena arena;
+    long requests;
+    struct latency_ring all;
+    struct latency_ring hits;
+    struct latency_ring misses;
+};
+
+static volatile sig_atomic_t serve_stopping;
+
+static void serve_stop(int sig)
+{
+    (void) sig;
+    serve_stopping = 1;
 }
 
-void bitmap_rotate(struct bitmap *bmp)
+static void image_cache_init(struct image_cache *cache, long budget)
 {
-    int new_width = bmp->height;
-    int new_height = bmp->width;
-    
-    int *new_pixels = (int *) malloc(new_width * new_height * sizeof(int));
+    memset(cache, 0, sizeof(*cache));
+    cache->budget = budget;
+}
 
+// Forgets entry i, moving the last entry into its place
+static void image_cache_drop(struct image_cache *cache, int i)
+{
+    struct cache_entry *e = &cache->entries[i];
+    cache->bytes -= bitmap_bytes(&e->bmp);
+    bitmap_free(&e->bmp);
+    free(e->path);
+    cache->entries[i] = cache->entries[--cache->nentries];
+}
 
-        for (int y = 0; y < bmp->height; ++y)
+// Evicts the least recently used entries until the cache fits its
+// budget
+static void image_cache_trim(struct image_cache *cache)
+{
+    while (cache->bytes > cache->budget && cache->nentries > 0)
+    {
+        int oldest = 0;
+        for (int i = 1; i < cache->nentries; i++)
+        {
+            if (cache->entries[i].last_used < cache->entries[oldest].last_used)
             {
-                for (int x = 0; x < bmp->width; ++x)
-                {
-                    int stored_pixel = bmp->pixels[y * bmp->width + x];
-                    new_pixels[x * new_width + y] = stored_pixel;
-                }
+                oldest = i;
             }
-            
-        free(bmp->pixels);
-        bmp->pixels = new_pixels;
-        bmp->width = new_height;
-        bmp->height = new_width;
+        }
+        image_cache_drop(cache, oldest);
+        cache->evictions++;
+    }
 }
 
-void bitmap_skew(struct bitmap *bmp)
+static void image_cache_release(struct image_cache *cache)
 {
-    int *new_pixels = (int *) malloc(bmp->width * bmp->height * sizeof(int));
+    while (cache->nentries > 0)
+    {
+        image_cache_drop(cache, cache->nentries - 1);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->capacity = 0;
+}
 
-        for (int y = 0; y < bmp->height; ++y)
+// The decoded pixels of filename, as LAYOUT_INT, from the cache if the
+// file hasn't changed since it was decoded, otherwise decoded now and
+// added. *hit says which. Returns NULL if the file can't be read. The
+// cache isn't trimmed here, so the entry stays valid until the next
+// image_cache_trim().
+static struct cache_entry *image_cache_get(struct image_cache *cache, const char *filename, int *hit)
+{
+    char *path = realpath(filename, NULL);
+    struct stat st;
+    if (path == NULL || stat(path, &st) == -1)
+    {
+        printf("Error: Cannot open %s\n", filename);
+        free(path);
+        return NULL;
+    }
+
+    cache->tick++;
+    for (int i = 0; i < cache->nentries; i++)
+    {
+        struct cache_entry *e = &cache->entries[i];
+        if (strcmp(e->path, path) != 0)
+        {
+            continue;
+        }
+        if (e->size == st.st_size && e->mtime.tv_sec == st.st_mtim.tv_sec
+            && e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            free(path);
+            e->last_used = cache->tick;
+            cache->hits++;
+            *hit = 1;
+            return e;
+        }
+        // The file changed under its old pixels
+        image_cache_drop(cache, i);
+        break;
+    }
+
+    cache->misses++;
+    *hit = 0;
+    // A file cut short would fault the whole server on its missing
+    // pages, so its headers are checked against its length first
+    long mapped;
+    void *pointer = map_bitmap_for_reading(path, &mapped);
+    if (pointer == NULL)
+    {
+        free(path);
+        return NULL;
+    }
+    struct bitmap bmp;
+    int ev = trace_begin("read_bitmap");
+    int result = read_bitmap_layout(pointer, &bmp, LAYOUT_INT);
+    trace_end(ev, mapped + (result == -1 ? 0 : bitmap_bytes(&bmp)));
+    munmap(pointer, mapped);
+    if (result == -1)
+    {
+        free(path);
+        return NULL;
+    }
+
+    if (cache->nentries == cache->capacity)
+    {
+        cache->capacity = cache->capacity ? 2 * cache->capacity : 16;
+        cache->entries = (struct cache_entry *) realloc(cache->entries, cache->capacity * sizeof(struct cache_entry));
+    }
+    struct cache_entry *e = &cache->entries[cache->nentries++];
+    e->path = path;
+    e->mtime = st.st_mtim;
+    e->size = st.st_size;
+    e->bmp = bmp;
+    e->last_used = cache->tick;
+    cache->bytes += bitmap_bytes(&bmp);
+    return e;
+}
+
+static void latency_ring_add(struct latency_ring *ring, double seconds)
+{
+    ring->times[ring->next] = seconds;
+    ring->next = (ring->next + 1) % SERVE_LATENCIES;
+    if (ring->count < SERVE_LATENCIES)
+    {
+        ring->count++;
+    }
+}
+
+// Writes " NAME_p50 X NAME_p99 Y", in milliseconds, for the latencies
+// in ring
+static void latency_ring_print(FILE *out, const char *name, const struct latency_ring *ring)
+{
+    struct bench_result res = { name, 0, 0, 0, 0 };
+    if (ring->count > 0)
+    {
+        double times[SERVE_LATENCIES];
+        memcpy(times, ring->times, ring->count * sizeof(double));
+        bench_summarize(times, ring->count, &res);
+    }
+    fprintf(out, " %s_p50 %.3f %s_p99 %.3f", name, res.median * 1e3, name, res.p99 * 1e3);
+}
+
+// Runs ops on in_filename into out_filename, with 'g' in the given
+// gray_mode, and replies with the size of the result, the time taken
+// and whether the input was cached.
+// Single-pass chains run straight from the cached pixels into the
+// output file. Other chains run on a copy in the server's arena, so
+// the cached pixels stay as they were.
+static void serve_apply(struct serve_state *server, char *ops, char *in_filename, char *out_filename, int gray,
+                        FILE *out)
+{
+    double start = now_seconds();
+
+    struct pipeline plan;
+    struct pipeline *pl = &plan;
+    if (pipeline_plan(ops, pl) == -1)
+    {
+        fprintf(out, "error bad ops %s\n", ops);
+        return;
+    }
+    pipeline_set_grayscale(pl, gray);
+
+    int hit;
+    struct cache_entry *entry = image_cache_get(&server->cache, in_filename, &hit);
+    if (entry == NULL)
+    {
+        fprintf(out, "error cannot read %s\n", in_filename);
+        return;
+    }
+
+    int width = entry->bmp.width;
+    int height = entry->bmp.height;
+    int result;
+    if (pipeline_is_direct(pl))
+    {
+        struct remap_stage stages[MAX_PIPELINE_OPS];
+        pass_prepare(&pl->passes[0], stages, &width, &height);
+        result = pipeline_run_direct_bitmap(pl, &entry->bmp, out_filename);
+    }
+    else
+    {
+        struct bitmap work = { width, height, NULL, LAYOUT_INT, NULL, &server->arena, NULL, NULL };
+        long bytes = bitmap_bytes(&work);
+        void *buffer = bitmap_new_buffer(&work, bytes);
+        memcpy(buffer, entry->bmp.pixels, bytes);
+        bitmap_replace_buffer(&work, buffer);
+
+        if (pipeline_run(pl, &work) == -1)
+        {
+            fprintf(out, "error cannot run %s on %s\n", ops, in_filename);
+            bitmap_free(&work);
+            return;
+        }
+        width = work.width;
+        height = work.height;
+
+        int file_size = bmp_file_size(&work);
+        void *o_pointer = map_file_for_writing(out_filename, file_size);
+        result = -1;
+        if (o_pointer != NULL)
+        {
+            int ev = trace_begin("write_bitmap");
+            write_bitmap(o_pointer, &work);
+            trace_end(ev, file_size + bitmap_bytes(&work));
+            munmap(o_pointer, file_size);
+            result = 0;
+        }
+        bitmap_free(&work);
+    }
+    image_cache_trim(&server->cache);
+
+    if (result == -1)
+    {
+        fprintf(out, "error cannot write %s\n", out_filename);
+        return;
+    }
+    double elapsed = now_seconds() - start;
+    latency_ring_add(&server->all, elapsed);
+    latency_ring_add(hit ? &server->hits : &server->misses, elapsed);
+    fprintf(out, "ok %d %d %.3f %s\n", width, height, elapsed * 1e3, hit ? "hit" : "miss");
+}
+
+static void serve_stats(const struct serve_state *server, FILE *out)
+{
+    const struct image_cache *cache = &server->cache;
+    fprintf(out, "ok requests %ld hits %ld misses %ld evictions %ld entries %d bytes %ld budget %ld",
+            server->requests, cache->hits, cache->misses, cache->evictions, cache->nentries, cache->bytes,
+            cache->budget);
+    latency_ring_print(out, "all", &server->all);
+    latency_ring_print(out, "hit", &server->hits);
+    latency_ring_print(out, "miss", &server->misses);
+    fprintf(out, "\n");
+}
+
+// Answers one request line. Returns 1 if it asks the server to stop.
+static int serve_request(struct serve_state *server, char *line, FILE *out)
+{
+    char *save;
+    char *words[5];
+    int nwords = 0;
+    for (char *word = strtok_r(line, " \t\r\n", &save); word != NULL; word = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (nwords == 5)
+        {
+            nwords++;
+            break;
+        }
+        words[nwords++] = word;
+    }
+    if (nwords == 0)
+    {
+        return 0;
+    }
+
+    server->requests++;
+    if (strcmp(words[0], "apply") == 0 && (nwords == 4 || nwords == 5))
+    {
+        int gray = nwords == 5 ? parse_gray_mode(words[4]) : GRAY_AVERAGE;
+        if (gray == -1)
+        {
+            fprintf(out, "error bad gray mode %s\n", words[4]);
+        }
+        else
+        {
+            serve_apply(server, words[1], words[2], words[3], gray, out);
+        }
+    }
+    else if (strcmp(words[0], "stats") == 0 && nwords == 1)
+    {
+        serve_stats(server, out);
+    }
+    else if (strcmp(words[0], "quit") == 0 && nwords == 1)
+    {
+        fprintf(out, "ok bye\n");
+        return 1;
+    }
+    else
+    {
+        fprintf(out, "error usage: apply OPS IN OUT [average|bt601|bt709] | stats | quit\n");
+    }
+    return 0;
+}
+
+int run_serve_cli(int argc, char *argv[])
+{
+    long budget = 512L << 20;
+    if (argc < 3)
+    {
+        printf("Usage: %s --serve SOCKET [--cache SIZE] [--threads N] [--trace FILE]\n", argv[0]);
+        return 1;
+    }
+    char *socket_path = argv[2];
+    for (int i = 3; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc)
+        {
+            budget = parse_size(argv[++i]);
+            if (budget <= 0)
             {
-                for (int x = 0; x < bmp->width; ++x)
-                {
-                    int i = y * bmp->width + x;
-                    int stored_pixel = bmp->pixels[i];
+                printf("Error: --cache needs a size such as 512M\n");
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+            {
+                printf("Error: --threads needs a positive number\n");
+                return 1;
+            }
+            set_thread_count(n);
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            trace_enable(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
 
-                    new_pixels[i - y] = stored_pixel;
-                }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        printf("Error: The socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    // A socket left behind by a server that is gone is replaced, but
+    // nothing else is
+    struct stat st;
+    if (stat(socket_path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            printf("Error: %s exists and is not a socket\n", socket_path);
+            return 1;
+        }
+        unlink(socket_path);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 || listen(fd, 16) == -1)
+    {
+        perror(NULL);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+
+    // A client that goes away before its reply mustn't take the server
+    // with it, and SIGINT or SIGTERM stop it cleanly
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = serve_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    struct serve_state *server = (struct serve_state *) calloc(1, sizeof(struct serve_state));
+    image_cache_init(&server->cache, budget);
+    pixel_arena_init(&server->arena);
+
+    printf("Serving on %s\n", socket_path);
+    fflush(stdout);
+
+    int stop = 0;
+    while (!stop && !serve_stopping)
+    {
+        int conn = accept(fd, NULL, NULL);
+        if (conn == -1)
+        {
+            if (errno != EINTR)
+            {
+                perror(NULL);
             }
-            
-        free(bmp->pixels);
-        bmp->pixels = new_pixels;
+            continue;
+        }
+
+        // One client at a time, each with as many requests as it likes
+        FILE *in = fdopen(conn, "r");
+        FILE *out = fdopen(dup(conn), "w");
+        char line[4096];
+        while (!stop && fgets(line, sizeof(line), in) != NULL)
+        {
+            stop = serve_request(server, line, out);
+            fflush(out);
+            fflush(stdout);
+        }
+        fclose(out);
+        fclose(in);
+    }
+
+    close(fd);
+    unlink(socket_path);
+    image_cache_release(&server->cache);
+    pixel_arena_release(&server->arena);
+    free(server);
+    return 0;
 }
 
-void bitmap_shrink(struct bitmap *bmp)
+int run_client_cli(int argc, char *argv[])
 {
-    int new_width = bmp->width / 2;
-    int new_height = bmp->height / 2;
+    if (argc < 4)
+    {
+        printf("Usage: %s --client SOCKET apply OPS IN OUT [average|bt601|bt709] | stats | quit\n", argv[0]);
+        return 1;
+    }
+
+    // The server has its own working directory, so the paths of an
+    // apply are sent absolute
+    char line[4096];
+    int length = 0;
+    char cwd[4096];
+    int is_apply = strcmp(argv[3], "apply") == 0 && (argc == 7 || argc == 8);
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+    {
+        cwd[0] = '\0';
+    }
+    for (int i = 3; i < argc && length < (int) sizeof(line); i++)
+    {
+        const char *sep = i == 3 ? "" : " ";
+        if (is_apply && (i == 5 || i == 6) && argv[i][0] != '/')
+        {
+            length += snprintf(line + length, sizeof(line) - length, "%s%s/%s", sep, cwd, argv[i]);
+        }
+        else
+        {
+            length += snprintf(line + length, sizeof(line) - length, "%s%s", sep, argv[i]);
+        }
+    }
+    if (length >= (int) sizeof(line) - 1)
+    {
+        printf("Error: The request is too long\n");
+        return 1;
+    }
+    line[length++] = '\n';
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(argv[2]) >= sizeof(addr.sun_path))
+    {
+        printf("Error: The socket path %s is too long\n", argv[2]);
+        return 1;
+    }
+    strcpy(addr.sun_path, argv[2]);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+    {
+        perror(NULL);
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return 1;
+    }
+    if (write(fd, line, length) != length)
+    {
+        perror(NULL);
+        close(fd);
+        return 1;
+    }
 
-    int *new_pixels = (int *) malloc(new_width * new_height * sizeof(int));
+    FILE *in = fdopen(fd, "r");
+    char reply[4096];
+    if (fgets(reply, sizeof(reply), in) == NULL)
+    {
+        printf("Error: No reply from the server\n");
+        fclose(in);
+        return 1;
+    }
+    fclose(in);
+    printf("%s", reply);
+    return strncmp(reply, "ok", 2) == 0 ? 0 : 1;
+}
 
-        for (int y = 0; y < bmp->height;)
+int run_stats_cli(int argc, char *argv[])
+{
+    struct rect crop = { 0, 0, 0, 0 };
+    if (argc < 3)
+    {
+        printf("Usage: %s --stats in.bmp [--crop WxH+X+Y] [--threads N]\n", argv[0]);
+        return 1;
+    }
+    for (int i = 3; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc)
+        {
+            if (sscanf(argv[++i], "%dx%d+%d+%d", &crop.width, &crop.height, &crop.x, &crop.y) != 4
+                || crop.width < 1 || crop.height < 1)
             {
-                for (int x = 0; x < bmp->width;)
-                {
-                    int m = (y / 2) * new_width + (x / 2);
-                    int n = y * bmp->width + x;
-                    int o = y * bmp->width + x + 1;
-                    int p = (y + 1) * bmp->width + x;
-                    int q = (y + 1) * bmp->width + x + 1;
-
-                    int first_pixel = bmp->pixels[n];
-                    int second_pixel = bmp->pixels[o];
-                    int third_pixel = bmp->pixels[p];
-                    int fourth_pixel = bmp->pixels[q];
-
-                    int r1, g1, b1, r2, g2, b2, r3, g3, b3, r4, g4, b4;
-                    
-                    pixel_to_rgb(first_pixel, &r1, &g1, &b1);
-                    pixel_to_rgb(second_pixel, &r2, &g2, &b2);
-                    pixel_to_rgb(third_pixel, &r3, &g3, &b3);
-                    pixel_to_rgb(fourth_pixel, &r4, &g4, &b4);
-
-
-                    int r = (r1 + r2 + r3 + r4) / 4;
-                    int g = (g1 + g2 + g3 + g4) / 4;
-                    int b = (b1 + b2 + b3 + b4) / 4;
-                    int changed_pixel;
-                    rgb_to_pixel(&changed_pixel, r, g, b);
-                    new_pixels[m] = changed_pixel;
-                    //
-                    x+= 2;
-                }
-                y+= 2;
+                printf("Error: --crop needs WxH+X+Y, e.g. 64x64+100+200\n");
+                return 1;
             }
-            
-            free(bmp->pixels);
-            bmp->pixels = new_pixels;
-            bmp->width = new_width;
-            bmp->height = new_height;
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            int n = atoi(argv[++i]);
+            if (n < 1)
+            {
+                printf("Error: --threads needs a positive number\n");
+                return 1;
+            }
+            set_thread_count(n);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    long mapped;
+    void *pointer = map_bitmap_for_reading(argv[2], &mapped);
+    if (pointer == NULL)
+    {
+        return 1;
+    }
+
+    struct image_stats stats;
+    struct image_stats *st = &stats;
+    int result = bmp_file_stats(pointer, crop.width != 0 ? &crop : NULL, st);
+    munmap(pointer, mapped);
+    if (result == 0)
+    {
+        image_stats_print_json(st);
+    }
+    return result == -1 ? 1 : 0;
 }